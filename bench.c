@@ -0,0 +1,551 @@
+/* bench.c: a benchmark harness that drives ptwrap with synthetic commands */
+/*
+MIT License
+
+Copyright (c) 2016 WATANABE Yuki
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* The harness runs ptwrap with each of the following commands, which are
+ * the harness itself invoked with --child:
+ *
+ *   bulk:   writes lines in 64 KiB chunks as fast as possible, like yes(1)
+ *   lines:  writes a 64-byte line at a time
+ *   bursty: writes bursts of 256 KiB separated by 10 ms of silence
+ *   echo:   echoes each byte of input in the raw mode
+ *   idle:   writes a 64 KiB burst and then sleeps for two seconds
+ *
+ * For the writers, the harness reads the output of ptwrap and measures the
+ * throughput. For the echo responder, it sends one byte at a time and
+ * measures the round-trip latency. Many idle children are run in one
+ * ptwrap --multiplex, whose RSS is sampled before they start and while they
+ * sleep to estimate the memory taken by an idle session; the others are
+ * run in the headless mode. The results are written to stdout as one JSON
+ * object per line, including the --stats report of ptwrap, and a summary is
+ * written to stderr. */
+
+#define _XOPEN_SOURCE 600
+#define _DARWIN_C_SOURCE 1
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *program_name;
+
+static void errno_exit(const char *message) {
+    fprintf(stderr, "%s: ", program_name);
+    perror(message);
+    exit(EXIT_FAILURE);
+}
+
+static void usage_exit(void) {
+    fprintf(stderr, "usage: %s [--size=<MiB>] [--round-trips=<n>] "
+            "[--sessions=<n>] [--strace] <ptwrap> [<option>...]\n",
+            program_name);
+    exit(EXIT_FAILURE);
+}
+
+#define CHUNK_SIZE (64 * 1024)
+#define LINE_SIZE 64
+#define BURST_SIZE (256 * 1024)
+#define BURST_INTERVAL 10000 /* microseconds */
+#define IDLE_BURST_SIZE (64 * 1024)
+#define IDLE_TIME 2000000 /* microseconds */
+#define IDLE_SAMPLE_DELAY 1000000 /* microseconds */
+#define EOF_CHAR '\4'
+#define STATS_FD 3
+#define MAX_REPORT_SIZE 4096
+
+static uint64_t current_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+static void sleep_for(uint64_t microseconds) {
+    struct timespec pause = {
+        .tv_sec = (time_t) (microseconds / 1000000),
+        .tv_nsec = (long) (microseconds % 1000000) * 1000,
+    };
+    while (nanosleep(&pause, &pause) < 0 && errno == EINTR) { }
+}
+
+static void write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t size = write(fd, data, length);
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+            errno_exit("write");
+        }
+        data += size, length -= size;
+    }
+}
+
+/* Writes `size' bytes of lines in `chunk'-byte writes, pausing for
+ * `interval' microseconds after every `burst' bytes. */
+static int write_output(
+        uint64_t size, size_t chunk, uint64_t burst, uint64_t interval) {
+    static char data[CHUNK_SIZE];
+    memset(data, 'y', sizeof data);
+    for (size_t i = LINE_SIZE - 1; i < sizeof data; i += LINE_SIZE)
+        data[i] = '\n';
+    for (uint64_t written = 0; written < size; ) {
+        size_t length = size - written < chunk ? size - written : chunk;
+        write_all(STDOUT_FILENO, data, length);
+        written += length;
+        if (burst > 0 && written % burst == 0)
+            sleep_for(interval);
+    }
+    return EXIT_SUCCESS;
+}
+
+static int echo_input(void) {
+    struct termios termios;
+    if (tcgetattr(STDIN_FILENO, &termios) < 0)
+        errno_exit("tcgetattr");
+    termios.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    termios.c_oflag &= ~OPOST;
+    termios.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    termios.c_cc[VMIN] = 1;
+    termios.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &termios) < 0)
+        errno_exit("tcsetattr");
+    /* Let the harness know that the terminal is ready. */
+    write_all(STDOUT_FILENO, "!", 1);
+
+    char buffer[256];
+    for (;;) {
+        ssize_t size = read(STDIN_FILENO, buffer, sizeof buffer);
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0 || memchr(buffer, EOF_CHAR, (size_t) size) != NULL)
+            return EXIT_SUCCESS;
+        write_all(STDOUT_FILENO, buffer, (size_t) size);
+    }
+}
+
+static int run_child(const char *mode, uint64_t size) {
+    if (strcmp(mode, "bulk") == 0)
+        return write_output(size, CHUNK_SIZE, 0, 0);
+    if (strcmp(mode, "lines") == 0)
+        return write_output(size, LINE_SIZE, 0, 0);
+    if (strcmp(mode, "bursty") == 0)
+        return write_output(size, CHUNK_SIZE, BURST_SIZE, BURST_INTERVAL);
+    if (strcmp(mode, "echo") == 0)
+        return echo_input();
+    if (strcmp(mode, "idle") == 0) {
+        write_output(size, CHUNK_SIZE, 0, 0);
+        sleep_for(IDLE_TIME);
+        return EXIT_SUCCESS;
+    }
+    fprintf(stderr, "%s: %s: unknown child\n", program_name, mode);
+    return EXIT_FAILURE;
+}
+
+/* A running instance of ptwrap */
+struct run_T {
+    pid_t pid;
+    int input_fd, output_fd, stats_fd;
+    uint64_t start_time;
+    char trace_path[32]; /* empty unless run under strace */
+};
+
+static struct options_T {
+    uint64_t size; /* bytes written by each writer */
+    size_t round_trips;
+    size_t sessions; /* idle sessions in the multiplexed run */
+    bool strace;
+    char **ptwrap_argv; /* ptwrap and its options */
+    int ptwrap_argc;
+} options = {
+    .size = 64 * 1024 * 1024,
+    .round_trips = 2000,
+    .sessions = 64,
+};
+
+/* Starts ptwrap with the child `mode', or in the multiplexed mode without
+ * a command if `mode' is NULL. Only the former is run under strace. */
+static void start_run(struct run_T *run, const char *mode) {
+    char size[32];
+    snprintf(size, sizeof size, "%llu", (unsigned long long) options.size);
+    char stats_option[32];
+    snprintf(stats_option, sizeof stats_option, "--stats-fd=%d", STATS_FD);
+
+    char **argv = calloc((size_t) options.ptwrap_argc + 16, sizeof *argv);
+    if (argv == NULL)
+        errno_exit("calloc");
+    int argc = 0;
+    run->trace_path[0] = '\0';
+    if (options.strace && mode != NULL) {
+        strcpy(run->trace_path, "/tmp/ptwrap-bench-XXXXXX");
+        int fd = mkstemp(run->trace_path);
+        if (fd < 0)
+            errno_exit("mkstemp");
+        close(fd);
+        argv[argc++] = "strace";
+        argv[argc++] = "-f";
+        argv[argc++] = "-c";
+        argv[argc++] = "-o";
+        argv[argc++] = run->trace_path;
+    }
+    argv[argc++] = options.ptwrap_argv[0];
+    argv[argc++] = mode != NULL ? "--headless" : "--multiplex";
+    argv[argc++] = "--stats=json";
+    argv[argc++] = stats_option;
+    for (int i = 1; i < options.ptwrap_argc; i++)
+        argv[argc++] = options.ptwrap_argv[i];
+    if (mode != NULL) {
+        argv[argc++] = "--";
+        argv[argc++] = (char *) program_name;
+        argv[argc++] = "--child";
+        argv[argc++] = (char *) mode;
+        argv[argc++] = size;
+    }
+    argv[argc] = NULL;
+
+    int input[2], output[2], stats[2];
+    if (pipe(input) < 0 || pipe(output) < 0 || pipe(stats) < 0)
+        errno_exit("pipe");
+    run->start_time = current_time();
+    run->pid = fork();
+    if (run->pid < 0)
+        errno_exit("fork");
+    if (run->pid == 0) {
+        dup2(input[0], STDIN_FILENO);
+        dup2(output[1], STDOUT_FILENO);
+        dup2(stats[1], STATS_FD);
+        for (int fd = STATS_FD + 1; fd < 64; fd++)
+            close(fd);
+        execvp(argv[0], argv);
+        errno_exit(argv[0]);
+    }
+    free(argv);
+    close(input[0]);
+    close(output[1]);
+    close(stats[1]);
+    run->input_fd = input[1];
+    run->output_fd = output[0];
+    run->stats_fd = stats[0];
+}
+
+/* The results of a run */
+struct result_T {
+    double seconds;
+    long max_rss; /* in kilobytes */
+    char report[MAX_REPORT_SIZE]; /* the --stats report */
+    long long syscalls; /* or -1 if not traced */
+};
+
+/* Reads the statistics and waits for ptwrap to exit. */
+static void finish_run(struct run_T *run, struct result_T *result) {
+    close(run->input_fd);
+    close(run->output_fd);
+    size_t length = 0;
+    for (ssize_t size; length < sizeof result->report - 1 &&
+            (size = read(run->stats_fd, &result->report[length],
+                         sizeof result->report - 1 - length)) != 0; ) {
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+            errno_exit("read");
+        }
+        length += (size_t) size;
+    }
+    while (length > 0 && result->report[length - 1] == '\n')
+        length--;
+    result->report[length] = '\0';
+    if (length == 0)
+        strcpy(result->report, "null");
+    close(run->stats_fd);
+
+    int status;
+    struct rusage usage;
+    while (wait4(run->pid, &status, 0, &usage) < 0)
+        if (errno != EINTR)
+            errno_exit("wait4");
+    result->seconds = (double) (current_time() - run->start_time) / 1e6;
+    result->max_rss = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "%s: ptwrap exited abnormally\n", program_name);
+
+    /* The last line of strace -c is the total: the percentage, seconds,
+     * microseconds per call, calls, and errors. */
+    result->syscalls = -1;
+    if (run->trace_path[0] != '\0') {
+        FILE *trace = fopen(run->trace_path, "r");
+        char line[256];
+        while (trace != NULL && fgets(line, sizeof line, trace) != NULL) {
+            double percentage, seconds;
+            long long per_call, calls;
+            if (strstr(line, "total") != NULL && sscanf(line,
+                        "%lf %lf %lld %lld", &percentage, &seconds,
+                        &per_call, &calls) == 4)
+                result->syscalls = calls;
+        }
+        if (trace != NULL)
+            fclose(trace);
+        unlink(run->trace_path);
+    }
+}
+
+/* Returns the number following `"name":' after `"section":' in the
+ * report, or 0. */
+static unsigned long long report_value(
+        const char *report, const char *section, const char *name) {
+    char key[64];
+    const char *p = report;
+    if (section != NULL) {
+        snprintf(key, sizeof key, "\"%s\":", section);
+        if ((p = strstr(p, key)) == NULL)
+            return 0;
+    }
+    snprintf(key, sizeof key, "\"%s\":", name);
+    if ((p = strstr(p, key)) == NULL)
+        return 0;
+    return strtoull(&p[strlen(key)], NULL, 10);
+}
+
+static void bench_writer(const char *mode) {
+    struct run_T run;
+    start_run(&run, mode);
+    static char buffer[CHUNK_SIZE];
+    uint64_t bytes = 0;
+    for (ssize_t size; (size = read(run.output_fd, buffer, sizeof buffer))
+            != 0; ) {
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+            errno_exit("read");
+        }
+        bytes += (uint64_t) size;
+    }
+
+    struct result_T result;
+    finish_run(&run, &result);
+    double megabytes = (double) bytes / 1e6;
+    unsigned long long calls =
+        report_value(result.report, NULL, "wakeups") +
+        report_value(result.report, "outgoing", "reads") +
+        report_value(result.report, "outgoing", "writes");
+    printf("{\"benchmark\":\"%s\",\"bytes\":%llu,\"seconds\":%.6f,"
+            "\"mb_per_s\":%.2f,\"io_calls_per_mb\":%.2f,",
+            mode, (unsigned long long) bytes, result.seconds,
+            megabytes / result.seconds, (double) calls / megabytes);
+    if (result.syscalls >= 0)
+        printf("\"syscalls_per_mb\":%.2f,",
+                (double) result.syscalls / megabytes);
+    printf("\"max_rss_kb\":%ld,\"ptwrap_stats\":%s}\n",
+            result.max_rss, result.report);
+    fprintf(stderr, "%-8s %10.2f MB/s %10.2f IO calls/MB %8ld KiB RSS\n",
+            mode, megabytes / result.seconds, (double) calls / megabytes,
+            result.max_rss);
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t sorted[], size_t count, double p) {
+    size_t index = (size_t) (p * (double) count);
+    return sorted[index < count ? index : count - 1];
+}
+
+/* Reads exactly one byte of output. */
+static bool read_byte(int fd, char *c) {
+    for (;;) {
+        ssize_t size = read(fd, c, 1);
+        if (size >= 0)
+            return size == 1;
+        if (errno != EINTR)
+            errno_exit("read");
+    }
+}
+
+static void bench_echo(void) {
+    struct run_T run;
+    start_run(&run, "echo");
+    char c;
+    if (!read_byte(run.output_fd, &c) || c != '!') {
+        fprintf(stderr, "%s: echo responder did not start\n", program_name);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t *latencies = calloc(options.round_trips, sizeof *latencies);
+    if (latencies == NULL)
+        errno_exit("calloc");
+    size_t count = 0;
+    for (; count < options.round_trips; count++) {
+        char key = (char) ('a' + count % 26);
+        uint64_t sent = current_time();
+        write_all(run.input_fd, &key, 1);
+        if (!read_byte(run.output_fd, &c) || c != key)
+            break;
+        latencies[count] = current_time() - sent;
+    }
+    write_all(run.input_fd, &(char) { EOF_CHAR }, 1);
+
+    struct result_T result;
+    finish_run(&run, &result);
+    if (count == 0) {
+        fprintf(stderr, "%s: no echo received\n", program_name);
+        exit(EXIT_FAILURE);
+    }
+    qsort(latencies, count, sizeof *latencies, compare_latency);
+    printf("{\"benchmark\":\"echo\",\"round_trips\":%zu,\"p50_us\":%llu,"
+            "\"p90_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu,", count,
+            (unsigned long long) percentile(latencies, count, 0.50),
+            (unsigned long long) percentile(latencies, count, 0.90),
+            (unsigned long long) percentile(latencies, count, 0.99),
+            (unsigned long long) latencies[count - 1]);
+    if (result.syscalls >= 0)
+        printf("\"syscalls_per_round_trip\":%.2f,",
+                (double) result.syscalls / (double) count);
+    printf("\"max_rss_kb\":%ld,\"ptwrap_stats\":%s}\n",
+            result.max_rss, result.report);
+    fprintf(stderr, "%-8s %10llu us p50 %7llu us p99 %8ld KiB RSS\n",
+            "echo", (unsigned long long) percentile(latencies, count, 0.50),
+            (unsigned long long) percentile(latencies, count, 0.99),
+            result.max_rss);
+    free(latencies);
+}
+
+/* Returns the resident set size of the process in kilobytes, or -1 if it
+ * cannot be found out, as where there is no /proc. */
+static long resident_size(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%ld/statm", (long) pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    long size, resident;
+    bool found = fscanf(file, "%ld %ld", &size, &resident) == 2;
+    fclose(file);
+    return found ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+static void bench_sessions(void) {
+    struct run_T run;
+    start_run(&run, NULL);
+    /* Let the wrapper set up before taking the baseline. */
+    sleep_for(IDLE_SAMPLE_DELAY / 10);
+    long baseline = resident_size(run.pid);
+
+    FILE *specs = fdopen(run.input_fd, "w");
+    if (specs == NULL)
+        errno_exit("fdopen");
+    for (size_t i = 0; i < options.sessions; i++)
+        fprintf(specs, "/dev/null %s --child idle %d\n",
+                program_name, IDLE_BURST_SIZE);
+    if (fflush(specs) == EOF)
+        errno_exit("write");
+    sleep_for(IDLE_SAMPLE_DELAY);
+    long idle = resident_size(run.pid);
+
+    /* Wait for the exit statuses of the sessions so that the stats report
+     * covers them. */
+    fclose(specs);
+    run.input_fd = -1;
+    static char buffer[CHUNK_SIZE];
+    for (ssize_t size; (size = read(run.output_fd, buffer, sizeof buffer))
+            != 0; )
+        if (size < 0 && errno != EINTR)
+            errno_exit("read");
+
+    struct result_T result;
+    finish_run(&run, &result);
+    double per_session = baseline >= 0 && idle >= 0 ?
+        (double) (idle - baseline) / (double) options.sessions : -1;
+    printf("{\"benchmark\":\"sessions\",\"sessions\":%zu,",
+            options.sessions);
+    if (per_session >= 0)
+        printf("\"baseline_rss_kb\":%ld,\"idle_rss_kb\":%ld,"
+                "\"rss_per_session_kb\":%.2f,", baseline, idle, per_session);
+    printf("\"max_rss_kb\":%ld,\"ptwrap_stats\":%s}\n",
+            result.max_rss, result.report);
+    if (per_session >= 0)
+        fprintf(stderr, "%-8s %10.2f KiB RSS per idle session %8ld KiB RSS\n",
+                "sessions", per_session, result.max_rss);
+    else
+        fprintf(stderr, "%-8s %10s KiB RSS per idle session %8ld KiB RSS\n",
+                "sessions", "n/a", result.max_rss);
+}
+
+static unsigned long long parse_number(const char *value) {
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || *value == '-' ||
+            number == 0)
+        usage_exit();
+    return number;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc <= 0)
+        exit(EXIT_FAILURE);
+    program_name = argv[0];
+    if (argc == 4 && strcmp(argv[1], "--child") == 0)
+        return run_child(argv[2], strtoull(argv[3], NULL, 10));
+
+    int index = 1;
+    for (; index < argc && strncmp(argv[index], "--", 2) == 0; index++) {
+        const char *argument = argv[index];
+        if (strncmp(argument, "--size=", 7) == 0)
+            options.size = parse_number(&argument[7]) * 1024 * 1024;
+        else if (strncmp(argument, "--round-trips=", 14) == 0)
+            options.round_trips = (size_t) parse_number(&argument[14]);
+        else if (strncmp(argument, "--sessions=", 11) == 0)
+            options.sessions = (size_t) parse_number(&argument[11]);
+        else if (strcmp(argument, "--strace") == 0)
+            options.strace = true;
+        else
+            usage_exit();
+    }
+    if (index == argc)
+        usage_exit();
+    options.ptwrap_argv = &argv[index];
+    options.ptwrap_argc = argc - index;
+    signal(SIGPIPE, SIG_IGN);
+
+    bench_writer("bulk");
+    bench_writer("lines");
+    bench_writer("bursty");
+    bench_echo();
+    bench_sessions();
+    return EXIT_SUCCESS;
+}
+
+/* vim: set et sw=4 sts=4 tw=79: */
@@ -25,19 +25,110 @@ SOFTWARE.
 
 #define _XOPEN_SOURCE 600
 #define _DARWIN_C_SOURCE 1
+#define _GNU_SOURCE 1
+
+/* Select the event backend. Define PTWRAP_USE_PSELECT to force the portable
+ * pselect backend. */
+#if !defined(PTWRAP_USE_PSELECT)
+#if defined(__linux__)
+#define USE_EPOLL 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+        defined(__DragonFly__)
+#define USE_KQUEUE 1
+#endif
+#endif /* !defined(PTWRAP_USE_PSELECT) */
+#if defined(__linux__)
+#define USE_SPLICE 1
+#endif
+#if !defined(PTWRAP_NO_THREADS)
+#define USE_THREADS 1
+#endif
+#if defined(USE_EPOLL) && !defined(PTWRAP_NO_IO_URING)
+#define USE_IO_URING 1
+#endif
+/* Spawn the child with posix_spawn where the slave can become the
+ * controlling terminal without TIOCSCTTY. Define PTWRAP_NO_SPAWN to always
+ * fork. */
+#if defined(__linux__) && !defined(PTWRAP_NO_SPAWN)
+#define USE_SPAWN 1
+#endif
+/* Let --stream-zerocopy send with MSG_ZEROCOPY. Define PTWRAP_NO_ZEROCOPY
+ * to build without it. */
+#if defined(__linux__) && !defined(PTWRAP_NO_ZEROCOPY)
+#define USE_ZEROCOPY 1
+#endif
+/* Detect the exit of the command with a pidfd in the event loop rather than
+ * SIGCHLD. Define PTWRAP_NO_PIDFD to build without it. */
+#if defined(__linux__) && !defined(PTWRAP_NO_PIDFD)
+#define USE_PIDFD 1
+#endif
+/* Resolve the host of --stream with getaddrinfo. A static glibc would still
+ * load NSS modules at runtime for it, so PTWRAP_STATIC, which `make static'
+ * defines, accepts numeric addresses only. */
+#if !defined(PTWRAP_STATIC)
+#define USE_GETADDRINFO 1
+#endif
+
+#include <arpa/inet.h>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(USE_THREADS)
+#include <pthread.h>
+#endif
 #include <signal.h>
+#if defined(USE_SPAWN)
+#include <spawn.h>
+#endif
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h> /* Not defined in X/Open */
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#elif defined(USE_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+#if defined(USE_IO_URING)
+#include <linux/io_uring.h>
+#endif
+#if defined(USE_IO_URING) || defined(USE_PIDFD)
+#include <sys/syscall.h>
+#endif
+#if defined(USE_ZEROCOPY)
+#include <linux/errqueue.h>
+#endif
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(PTWRAP_USE_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(USE_ZEROCOPY) && !(defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY))
+#undef USE_ZEROCOPY
+#endif
+#if defined(USE_PIDFD) && !defined(SYS_pidfd_open)
+#undef USE_PIDFD
+#endif
 
 static const char *program_name;
 
@@ -52,47 +143,881 @@ static void errno_exit(const char *message) {
     exit(EXIT_FAILURE);
 }
 
+#define DEFAULT_BUFFER_SIZE (64 * 1024)
+#define MAX_BUFFER_SIZE (1024 * 1024 * 1024)
+#define DEFAULT_SCROLLBACK_SIZE (256 * 1024)
+#define DEFAULT_DETACH_CHAR 0x1c /* ^\ */
+#define STREAM_MAX_ID 255
+#define TRIGGER_EXIT_STATUS 1
+
+/* An action taken when the output of the command contains the pattern
+ * (--trigger) */
+struct trigger_T {
+    enum { TRIGGER_EVENT, TRIGGER_EXIT, TRIGGER_SEND, } action;
+    int exit_status; /* for TRIGGER_EXIT */
+    char *text, *pattern; /* text is sent by TRIGGER_SEND */
+    size_t text_length, pattern_length;
+};
+
+static struct options_T {
+    size_t buffer_size;
+    bool no_splice;
+    uint64_t coalesce_window; /* in microseconds; 0 disables coalescing */
+    size_t coalesce_budget;
+    enum { STATS_NONE, STATS_TEXT, STATS_JSON, } stats;
+    int stats_fd;
+    bool multiplex;
+    size_t threads;
+    const char *tee_path;
+    size_t tee_rotate; /* 0 disables rotation */
+    bool tee_direct;
+    bool io_uring;
+    size_t pool_low, pool_high; /* pool_high is 0 if there is no pool */
+    bool headless;
+    unsigned short columns, rows; /* 0 if not specified */
+    bool strip_ansi;
+    enum { TIMESTAMPS_NONE, TIMESTAMPS_MONO, TIMESTAMPS_WALL, } timestamps;
+    enum {
+        OVERFLOW_BLOCK, OVERFLOW_DROP_OLDEST, OVERFLOW_DROP_NEWEST,
+        OVERFLOW_SPILL,
+    } overflow;
+    const char *record_path;
+    bool record_compress;
+    bool replay;
+    uint64_t replay_seek; /* in microseconds */
+    double replay_speed; /* 0 replays without delay */
+    const char *cast_path;
+    bool low_latency;
+    uint64_t resize_debounce; /* in microseconds */
+    enum { PRIORITY_NORMAL, PRIORITY_FIFO, PRIORITY_NICE, } priority;
+    const char *host_path, *attach_path;
+    size_t scrollback_size;
+    int detach_char; /* -1 if input is never scanned for one */
+    const char *stream_address, *stream_id;
+    bool stream_zerocopy;
+    const char *screen_path;
+    bool screen_diff;
+    /* Rates are in bytes per second; 0 does not limit the channel. */
+    size_t max_rate, max_burst;
+    size_t max_input_rate, max_input_burst;
+    /* in microseconds; -1 forwards output until the end even after the
+     * command has exited */
+    int64_t drain_timeout;
+    struct trigger_T *triggers;
+    size_t trigger_count;
+    int trigger_fd; /* to which the events of triggers are written */
+    const char *control_path;
+} options = {
+    .buffer_size = DEFAULT_BUFFER_SIZE,
+    .stats_fd = STDERR_FILENO,
+    .replay_speed = 1,
+    .scrollback_size = DEFAULT_SCROLLBACK_SIZE,
+    .detach_char = DEFAULT_DETACH_CHAR,
+    .drain_timeout = -1,
+    .trigger_fd = STDERR_FILENO,
+};
+
+static void option_error(const char *message, const char *option) {
+    fprintf(stderr, "%s: %s: %s\n", program_name, option, message);
+    exit(EXIT_FAILURE);
+}
+
+/* Returns true if `argument' is option `name' with or without a value. The
+ * value following `=' is assigned to `*value', or NULL if there is none. */
+static bool match_option(
+        const char *argument, const char *name, const char **value) {
+    size_t length = strlen(name);
+    if (strncmp(argument, name, length) != 0)
+        return false;
+    switch (argument[length]) {
+    case '\0': *value = NULL;                 return true;
+    case '=':  *value = &argument[length + 1]; return true;
+    default:   return false;
+    }
+}
+
+static const char *require_value(const char *value, const char *option) {
+    if (value == NULL || *value == '\0')
+        option_error("value missing", option);
+    return value;
+}
+
+/* The scan functions parse the values of options and of the requests of
+ * the control socket. They return false if the value is invalid. */
+
+/* Scans a size with an optional k, m, or g suffix (powers of 1024). */
+static bool scan_size(const char *value, size_t *result) {
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *value == '-')
+        return false;
+    unsigned shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0' ||
+            size > (unsigned long long) (MAX_BUFFER_SIZE >> shift))
+        return false;
+    *result = (size_t) size << shift;
+    return true;
+}
+
+static size_t parse_size(const char *value, const char *option) {
+    size_t size;
+    if (!scan_size(value, &size))
+        option_error("invalid size", option);
+    return size;
+}
+
+/* Scans a duration with a us, ms, s, m, or h suffix in microseconds. */
+static bool scan_duration(const char *value, uint64_t *result) {
+    char *end;
+    errno = 0;
+    unsigned long long duration = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *value == '-' || duration > UINT32_MAX)
+        return false;
+    if (strcmp(end, "us") == 0)
+        *result = duration;
+    else if (strcmp(end, "ms") == 0)
+        *result = duration * 1000;
+    else if (strcmp(end, "s") == 0)
+        *result = duration * 1000000;
+    else if (strcmp(end, "m") == 0)
+        *result = duration * 60000000;
+    else if (strcmp(end, "h") == 0)
+        *result = duration * 3600000000;
+    else
+        return false;
+    return true;
+}
+
+static uint64_t parse_duration(const char *value, const char *option) {
+    uint64_t duration;
+    if (!scan_duration(value, &duration))
+        option_error("invalid duration", option);
+    return duration;
+}
+
+/* Copies the part of `value' before the first comma to `first', which has
+ * `size' bytes, and sets `*rest' to the part after it, or NULL if there is
+ * no comma. Returns false if the first part is too long. */
+static bool split_pair(const char *value, char *first, size_t size,
+        const char **rest) {
+    const char *comma = strchr(value, ',');
+    size_t length = comma != NULL ? (size_t) (comma - value) : strlen(value);
+    if (length >= size)
+        return false;
+    memcpy(first, value, length);
+    first[length] = '\0';
+    *rest = comma != NULL ? &comma[1] : NULL;
+    return true;
+}
+
+/* Scans the value of --coalesce, which is a duration optionally followed by
+ * a comma and a size. */
+static bool scan_coalesce(
+        const char *value, uint64_t *window, size_t *budget) {
+    char duration[32];
+    const char *rest;
+    if (!split_pair(value, duration, sizeof duration, &rest) ||
+            !scan_duration(duration, window))
+        return false;
+    *budget = SIZE_MAX;
+    if (rest != NULL && !scan_size(rest, budget))
+        return false;
+    return *window > 0 && *budget > 0;
+}
+
+static void parse_coalesce(const char *value, const char *option) {
+    if (!scan_coalesce(value, &options.coalesce_window,
+                &options.coalesce_budget))
+        option_error("invalid value", option);
+}
+
+/* Scans the value of --max-rate or --max-input-rate, which is a rate in
+ * bytes per second optionally followed by a comma and the burst size. The
+ * burst defaults to a second's worth of data. */
+static bool scan_rate(const char *value, size_t *rate, size_t *burst) {
+    char number[32];
+    const char *rest;
+    if (!split_pair(value, number, sizeof number, &rest) ||
+            !scan_size(number, rate))
+        return false;
+    *burst = *rate;
+    if (rest != NULL && !scan_size(rest, burst))
+        return false;
+    return *rate > 0 && *burst > 0;
+}
+
+static void parse_rate(const char *value, const char *option,
+        size_t *rate, size_t *burst) {
+    if (!scan_rate(value, rate, burst))
+        option_error("invalid rate", option);
+}
+
+/* Scans the number of columns or rows of the terminal. */
+static bool scan_dimension(const char *value, unsigned short *result) {
+    char *end;
+    errno = 0;
+    unsigned long dimension = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *value == '-' || *end != '\0' ||
+            dimension == 0 || dimension > USHRT_MAX)
+        return false;
+    *result = (unsigned short) dimension;
+    return true;
+}
+
+static unsigned short parse_dimension(const char *value, const char *option) {
+    unsigned short dimension;
+    if (!scan_dimension(value, &dimension))
+        option_error("invalid size", option);
+    return dimension;
+}
+
+#define MAX_POOL_SIZE 4096
+
+/* Parses the value of --pty-pool, which is the low and high watermarks
+ * separated by a comma. */
+static void parse_pool(const char *value, const char *option) {
+    char *end;
+    errno = 0;
+    unsigned long low = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *value == '-' || *end != ',')
+        option_error("invalid watermarks", option);
+    value = &end[1];
+    unsigned long high = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *value == '-' || *end != '\0' ||
+            high == 0 || low > high || high > MAX_POOL_SIZE)
+        option_error("invalid watermarks", option);
+    options.pool_low = low;
+    options.pool_high = high;
+}
+
+static int parse_fd(const char *value, const char *option) {
+    char *end;
+    errno = 0;
+    long fd = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || fd < 0 || fd > INT_MAX)
+        option_error("invalid file descriptor", option);
+    if (fcntl((int) fd, F_SETFD, FD_CLOEXEC) < 0)
+        option_error("file descriptor not open", option);
+    return (int) fd;
+}
+
+/* Parses a character as itself or in the caret notation (e.g. `^\'), or
+ * `none' for no character. */
+static int parse_char(const char *value, const char *option) {
+    if (strcmp(value, "none") == 0)
+        return -1;
+    if (value[0] == '^' && value[1] != '\0' && value[2] == '\0')
+        return value[1] == '?' ? 0x7f : (unsigned char) value[1] & 0x1f;
+    if (value[1] != '\0')
+        option_error("invalid character", option);
+    return (unsigned char) value[0];
+}
+
+/* Decodes `value' up to an unescaped `stop' character or the end of it into
+ * a new string assigned to `*result', and returns its length. `*end' is set
+ * to where decoding stopped. Backslash escapes `\\', `\:', `\e', `\n',
+ * `\r', `\t', and `\x' followed by two hexadecimal digits are decoded. */
+static size_t parse_escapes(const char *value, int stop, const char **end,
+        char **result, const char *option) {
+    char *data = malloc(strlen(value) + 1);
+    if (data == NULL)
+        errno_exit("cannot allocate memory");
+    size_t length = 0;
+    for (; *value != '\0' && *value != stop; value++) {
+        if (*value != '\\') {
+            data[length++] = *value;
+            continue;
+        }
+        switch (*++value) {
+        case '\\': data[length++] = '\\';   break;
+        case ':':  data[length++] = ':';    break;
+        case 'e':  data[length++] = '\033'; break;
+        case 'n':  data[length++] = '\n';   break;
+        case 'r':  data[length++] = '\r';   break;
+        case 't':  data[length++] = '\t';   break;
+        case 'x':
+            if (!isxdigit((unsigned char) value[1]) ||
+                    !isxdigit((unsigned char) value[2]))
+                option_error("invalid escape", option);
+            char digits[3] = { value[1], value[2], '\0', };
+            data[length++] = (char) strtol(digits, NULL, 16);
+            value += 2;
+            break;
+        default:
+            option_error("invalid escape", option);
+        }
+    }
+    *end = value;
+    *result = data;
+    return length;
+}
+
+/* Parses `<action>:<pattern>' and adds the trigger. */
+static void parse_trigger(const char *value, const char *option) {
+    struct trigger_T trigger = { .text = NULL, .text_length = 0, };
+    size_t length = strcspn(value, "=:");
+    const char *end = &value[length];
+    if (length == 5 && strncmp(value, "event", 5) == 0) {
+        trigger.action = TRIGGER_EVENT;
+    } else if (length == 4 && strncmp(value, "exit", 4) == 0) {
+        trigger.action = TRIGGER_EXIT;
+        trigger.exit_status = TRIGGER_EXIT_STATUS;
+        if (*end == '=') {
+            char *digits_end;
+            long status = strtol(&end[1], &digits_end, 10);
+            if (digits_end == &end[1] || *digits_end != ':' || status < 0 ||
+                    status > 255)
+                option_error("invalid exit status", option);
+            trigger.exit_status = (int) status;
+            end = digits_end;
+        }
+    } else if (length == 4 && strncmp(value, "send", 4) == 0 &&
+            *end == '=') {
+        trigger.action = TRIGGER_SEND;
+        trigger.text_length = parse_escapes(&end[1], ':', &end,
+                &trigger.text, option);
+    } else {
+        option_error("invalid action", option);
+    }
+    if (*end != ':')
+        option_error("pattern missing", option);
+    trigger.pattern_length = parse_escapes(&end[1], '\0', &end,
+            &trigger.pattern, option);
+    if (trigger.pattern_length == 0)
+        option_error("pattern missing", option);
+
+    struct trigger_T *triggers = realloc(options.triggers,
+            (options.trigger_count + 1) * sizeof *triggers);
+    if (triggers == NULL)
+        errno_exit("cannot allocate memory");
+    triggers[options.trigger_count++] = trigger;
+    options.triggers = triggers;
+}
+
+/* Parses options preceding the command and returns the index of the command
+ * operand. */
+static int parse_options(int argc, char *argv[]) {
+    int index = 1;
+    for (; index < argc; index++) {
+        const char *argument = argv[index], *value;
+        if (strcmp(argument, "--") == 0)
+            return index + 1;
+        if (strncmp(argument, "--", 2) != 0)
+            break;
+
+        if (match_option(argument, "--buffer-size", &value)) {
+            options.buffer_size =
+                parse_size(require_value(value, argument), argument);
+            if (options.buffer_size == 0)
+                option_error("invalid size", argument);
+        } else if (strcmp(argument, "--no-splice") == 0) {
+            options.no_splice = true;
+        } else if (match_option(argument, "--coalesce", &value)) {
+            parse_coalesce(require_value(value, argument), argument);
+        } else if (match_option(argument, "--max-rate", &value)) {
+            parse_rate(require_value(value, argument), argument,
+                    &options.max_rate, &options.max_burst);
+        } else if (match_option(argument, "--max-input-rate", &value)) {
+            parse_rate(require_value(value, argument), argument,
+                    &options.max_input_rate, &options.max_input_burst);
+        } else if (match_option(argument, "--stats", &value)) {
+            if (value == NULL || strcmp(value, "text") == 0)
+                options.stats = STATS_TEXT;
+            else if (strcmp(value, "json") == 0)
+                options.stats = STATS_JSON;
+            else
+                option_error("invalid format", argument);
+        } else if (strcmp(argument, "--multiplex") == 0) {
+            options.multiplex = true;
+        } else if (match_option(argument, "--threads", &value)) {
+#if defined(USE_THREADS)
+            char *end;
+            errno = 0;
+            long threads = strtol(require_value(value, argument), &end, 10);
+            if (errno != 0 || *end != '\0' || threads <= 0 || threads > 1024)
+                option_error("invalid number of threads", argument);
+            options.threads = (size_t) threads;
+#else
+            option_error("threads are not supported", argument);
+#endif /* defined(USE_THREADS) */
+        } else if (match_option(argument, "--tee", &value)) {
+            options.tee_path = require_value(value, argument);
+        } else if (match_option(argument, "--tee-rotate", &value)) {
+            options.tee_rotate =
+                parse_size(require_value(value, argument), argument);
+        } else if (strcmp(argument, "--tee-direct") == 0) {
+#if defined(O_DIRECT)
+            options.tee_direct = true;
+#else
+            option_error("direct IO is not supported", argument);
+#endif /* defined(O_DIRECT) */
+        } else if (strcmp(argument, "--io-uring") == 0) {
+#if defined(USE_IO_URING)
+            options.io_uring = true;
+#else
+            option_error("io_uring is not supported", argument);
+#endif /* defined(USE_IO_URING) */
+        } else if (match_option(argument, "--timestamps", &value)) {
+            if (value == NULL || strcmp(value, "mono") == 0)
+                options.timestamps = TIMESTAMPS_MONO;
+            else if (strcmp(value, "wall") == 0)
+                options.timestamps = TIMESTAMPS_WALL;
+            else
+                option_error("invalid clock", argument);
+        } else if (match_option(argument, "--overflow", &value)) {
+            value = require_value(value, argument);
+            if (strcmp(value, "block") == 0)
+                options.overflow = OVERFLOW_BLOCK;
+            else if (strcmp(value, "drop-oldest") == 0)
+                options.overflow = OVERFLOW_DROP_OLDEST;
+            else if (strcmp(value, "drop-newest") == 0)
+                options.overflow = OVERFLOW_DROP_NEWEST;
+            else if (strcmp(value, "spill") == 0)
+                options.overflow = OVERFLOW_SPILL;
+            else
+                option_error("invalid policy", argument);
+        } else if (match_option(argument, "--record", &value)) {
+            options.record_path = require_value(value, argument);
+        } else if (strcmp(argument, "--record-compress") == 0) {
+#if defined(PTWRAP_USE_ZSTD)
+            options.record_compress = true;
+#else
+            option_error("compression is not supported", argument);
+#endif /* defined(PTWRAP_USE_ZSTD) */
+        } else if (match_option(argument, "--asciicast", &value)) {
+            options.cast_path = require_value(value, argument);
+        } else if (strcmp(argument, "--replay") == 0) {
+            options.replay = true;
+        } else if (match_option(argument, "--seek", &value)) {
+            options.replay_seek =
+                parse_duration(require_value(value, argument), argument);
+        } else if (match_option(argument, "--speed", &value)) {
+            char *end;
+            errno = 0;
+            options.replay_speed = strtod(require_value(value, argument),
+                    &end);
+            if (errno != 0 || *end != '\0' || !(options.replay_speed >= 0))
+                option_error("invalid speed", argument);
+        } else if (match_option(argument, "--low-latency", &value)) {
+            options.low_latency = true;
+            if (value == NULL)
+                options.priority = PRIORITY_NORMAL;
+            else if (strcmp(value, "nice") == 0)
+                options.priority = PRIORITY_NICE;
+#if defined(USE_THREADS)
+            else if (strcmp(value, "fifo") == 0)
+                options.priority = PRIORITY_FIFO;
+#endif /* defined(USE_THREADS) */
+            else
+                option_error("invalid priority", argument);
+        } else if (match_option(argument, "--resize-debounce", &value)) {
+            options.resize_debounce =
+                parse_duration(require_value(value, argument), argument);
+        } else if (match_option(argument, "--drain-timeout", &value)) {
+            uint64_t duration =
+                parse_duration(require_value(value, argument), argument);
+            if (duration > INT64_MAX)
+                option_error("invalid duration", argument);
+            options.drain_timeout = (int64_t) duration;
+        } else if (match_option(argument, "--host", &value)) {
+            options.host_path = require_value(value, argument);
+        } else if (match_option(argument, "--attach", &value)) {
+            options.attach_path = require_value(value, argument);
+        } else if (match_option(argument, "--scrollback", &value)) {
+            options.scrollback_size =
+                parse_size(require_value(value, argument), argument);
+            if (options.scrollback_size == 0)
+                option_error("invalid size", argument);
+        } else if (match_option(argument, "--detach-char", &value)) {
+            options.detach_char =
+                parse_char(require_value(value, argument), argument);
+        } else if (match_option(argument, "--stream", &value)) {
+            options.stream_address = require_value(value, argument);
+        } else if (match_option(argument, "--stream-id", &value)) {
+            options.stream_id = require_value(value, argument);
+            if (strlen(options.stream_id) > STREAM_MAX_ID)
+                option_error("too long", argument);
+        } else if (strcmp(argument, "--stream-zerocopy") == 0) {
+#if defined(USE_ZEROCOPY)
+            options.stream_zerocopy = true;
+#else
+            option_error("zerocopy is not supported", argument);
+#endif /* defined(USE_ZEROCOPY) */
+        } else if (match_option(argument, "--screen", &value)) {
+            options.screen_path = require_value(value, argument);
+        } else if (strcmp(argument, "--screen-diff") == 0) {
+            options.screen_diff = true;
+        } else if (strcmp(argument, "--strip-ansi") == 0) {
+            options.strip_ansi = true;
+        } else if (strcmp(argument, "--headless") == 0) {
+            options.headless = true;
+        } else if (match_option(argument, "--cols", &value)) {
+            options.columns =
+                parse_dimension(require_value(value, argument), argument);
+        } else if (match_option(argument, "--rows", &value)) {
+            options.rows =
+                parse_dimension(require_value(value, argument), argument);
+        } else if (match_option(argument, "--pty-pool", &value)) {
+            parse_pool(require_value(value, argument), argument);
+        } else if (match_option(argument, "--trigger", &value)) {
+            parse_trigger(require_value(value, argument), argument);
+        } else if (match_option(argument, "--trigger-fd", &value)) {
+            options.trigger_fd =
+                parse_fd(require_value(value, argument), argument);
+        } else if (match_option(argument, "--control", &value)) {
+            options.control_path = require_value(value, argument);
+        } else if (match_option(argument, "--stats-fd", &value)) {
+            options.stats_fd =
+                parse_fd(require_value(value, argument), argument);
+        } else {
+            option_error("unknown option", argument);
+        }
+    }
+    return index;
+}
+
+/* Returns the current time of the monotonic clock in microseconds. */
+static uint64_t current_time(void) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+        errno_exit("cannot get current time");
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+#define LATENCY_BUCKETS 24
+
+struct channel_stats_T {
+    uint64_t bytes, reads, writes, short_writes, eagains, eintrs;
+    uint64_t blocked_time; /* in microseconds the buffer was full */
+    uint64_t overflows, dropped, spilled; /* see --overflow */
+    /* Bracketed pastes that have been written, with the bytes, writes, and
+     * microseconds they took from reading the start marker */
+    uint64_t pastes, paste_bytes, paste_writes, paste_time;
+};
+
+static struct stats_T {
+    uint64_t start_time, wakeups;
+    struct channel_stats_T incoming, outgoing;
+    /* Histogram of the delay between output arriving from the slave and it
+     * being written to stdout. Bucket i counts delays below 2^(i+1) us. */
+    uint64_t output_latency[LATENCY_BUCKETS];
+    /* Histogram of the time from waking up to waiting again in the event
+     * loop, which bounds how long input waits for the wrapper */
+    uint64_t loop_latency[LATENCY_BUCKETS];
+} stats;
+
+static void count_error(struct channel_stats_T *stats) {
+    switch (errno) {
+    case EAGAIN: stats->eagains++; break;
+    case EINTR:  stats->eintrs++;  break;
+    }
+}
+
+static void add_latency(uint64_t histogram[], uint64_t latency) {
+    size_t i = 0;
+    while (latency >= 2 && i < LATENCY_BUCKETS - 1)
+        latency >>= 1, i++;
+    histogram[i]++;
+}
+
+/* Returns the upper bound of the histogram bucket that contains the given
+ * percentile, or 0 if the histogram is empty. */
+static uint64_t latency_percentile(const uint64_t histogram[], double p) {
+    uint64_t total = 0, count = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+        total += histogram[i];
+    if (total == 0)
+        return 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        count += histogram[i];
+        if (count >= p * total)
+            return (uint64_t) 2 << i;
+    }
+    return (uint64_t) 2 << (LATENCY_BUCKETS - 1);
+}
+
+struct report_T {
+    char data[8192];
+    size_t length;
+};
+
+static void append_report(struct report_T *report, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int length = vsnprintf(&report->data[report->length],
+            sizeof report->data - report->length, format, ap);
+    va_end(ap);
+    if (length > 0)
+        report->length += (size_t) length;
+    if (report->length >= sizeof report->data)
+        report->length = sizeof report->data - 1;
+}
+
+static void append_channel_text(struct report_T *report,
+        const char *name, const struct channel_stats_T *stats) {
+    append_report(report,
+            "%s: %llu bytes, %llu reads, %llu writes (%.2f reads/write), "
+            "%llu short writes, %llu EAGAIN, %llu EINTR, "
+            "%.6f s blocked on full buffer, %llu overflows, "
+            "%llu bytes dropped, %llu bytes spilled\n", name,
+            (unsigned long long) stats->bytes,
+            (unsigned long long) stats->reads,
+            (unsigned long long) stats->writes,
+            stats->writes > 0 ? (double) stats->reads / stats->writes : 0.0,
+            (unsigned long long) stats->short_writes,
+            (unsigned long long) stats->eagains,
+            (unsigned long long) stats->eintrs,
+            stats->blocked_time / 1e6,
+            (unsigned long long) stats->overflows,
+            (unsigned long long) stats->dropped,
+            (unsigned long long) stats->spilled);
+}
+
+static void append_paste_text(
+        struct report_T *report, const struct channel_stats_T *stats) {
+    append_report(report,
+            "pastes: %llu, %llu bytes, %llu writes (%.2f writes/paste), "
+            "%.6f s\n",
+            (unsigned long long) stats->pastes,
+            (unsigned long long) stats->paste_bytes,
+            (unsigned long long) stats->paste_writes,
+            stats->pastes > 0 ?
+                (double) stats->paste_writes / stats->pastes : 0.0,
+            stats->paste_time / 1e6);
+}
+
+static void append_paste_json(
+        struct report_T *report, const struct channel_stats_T *stats) {
+    append_report(report,
+            "\"pastes\":{\"count\":%llu,\"bytes\":%llu,\"writes\":%llu,"
+            "\"writes_per_paste\":%.2f,\"time_us\":%llu},",
+            (unsigned long long) stats->pastes,
+            (unsigned long long) stats->paste_bytes,
+            (unsigned long long) stats->paste_writes,
+            stats->pastes > 0 ?
+                (double) stats->paste_writes / stats->pastes : 0.0,
+            (unsigned long long) stats->paste_time);
+}
+
+static void append_channel_json(struct report_T *report,
+        const char *name, const struct channel_stats_T *stats) {
+    append_report(report,
+            "\"%s\":{\"bytes\":%llu,\"reads\":%llu,\"writes\":%llu,"
+            "\"reads_per_write\":%.2f,\"short_writes\":%llu,"
+            "\"eagain\":%llu,\"eintr\":%llu,\"blocked_us\":%llu,"
+            "\"overflows\":%llu,\"dropped_bytes\":%llu,"
+            "\"spilled_bytes\":%llu},", name,
+            (unsigned long long) stats->bytes,
+            (unsigned long long) stats->reads,
+            (unsigned long long) stats->writes,
+            stats->writes > 0 ? (double) stats->reads / stats->writes : 0.0,
+            (unsigned long long) stats->short_writes,
+            (unsigned long long) stats->eagains,
+            (unsigned long long) stats->eintrs,
+            (unsigned long long) stats->blocked_time,
+            (unsigned long long) stats->overflows,
+            (unsigned long long) stats->dropped,
+            (unsigned long long) stats->spilled);
+}
+
+/* Returns false if a write failed with an error other than EINTR or
+ * EAGAIN. */
+static bool write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t size = write(fd, data, length);
+        if (size < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return false;
+        }
+        data += size, length -= size;
+    }
+    return true;
+}
+
+static void merge_channel_stats(struct channel_stats_T *to,
+        const struct channel_stats_T *from) {
+    to->bytes += from->bytes;
+    to->reads += from->reads;
+    to->writes += from->writes;
+    to->short_writes += from->short_writes;
+    to->eagains += from->eagains;
+    to->eintrs += from->eintrs;
+    to->blocked_time += from->blocked_time;
+    to->overflows += from->overflows;
+    to->dropped += from->dropped;
+    to->spilled += from->spilled;
+    to->pastes += from->pastes;
+    to->paste_bytes += from->paste_bytes;
+    to->paste_writes += from->paste_writes;
+    to->paste_time += from->paste_time;
+}
+
+/* Adds the counters of `from' to `to'. */
+static void merge_stats(struct stats_T *to, const struct stats_T *from) {
+    to->wakeups += from->wakeups;
+    merge_channel_stats(&to->incoming, &from->incoming);
+    merge_channel_stats(&to->outgoing, &from->outgoing);
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        to->output_latency[i] += from->output_latency[i];
+        to->loop_latency[i] += from->loop_latency[i];
+    }
+}
+
+static void append_latency_text(struct report_T *report,
+        const char *name, const uint64_t latency[]) {
+    append_report(report, "%s latency (us):", name);
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+        if (latency[i] > 0)
+            append_report(report, " <%llu:%llu",
+                    (unsigned long long) 2 << i,
+                    (unsigned long long) latency[i]);
+    append_report(report, "\n%s latency p50/p90/p99 (us): "
+            "<%llu/<%llu/<%llu\n", name,
+            (unsigned long long) latency_percentile(latency, 0.50),
+            (unsigned long long) latency_percentile(latency, 0.90),
+            (unsigned long long) latency_percentile(latency, 0.99));
+}
+
+static void append_latency_json(struct report_T *report,
+        const char *name, const uint64_t latency[]) {
+    append_report(report, "\"%s_latency_us\":{\"buckets\":[", name);
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+        append_report(report, "%s%llu", i > 0 ? "," : "",
+                (unsigned long long) latency[i]);
+    append_report(report, "],\"p50\":%llu,\"p90\":%llu,\"p99\":%llu}",
+            (unsigned long long) latency_percentile(latency, 0.50),
+            (unsigned long long) latency_percentile(latency, 0.90),
+            (unsigned long long) latency_percentile(latency, 0.99));
+}
+
+/* Writes the statistics to the stats fd. */
+static void report_stats(const struct stats_T *stats) {
+    struct report_T report = { .length = 0 };
+    uint64_t elapsed = current_time() - stats->start_time;
+
+    switch (options.stats) {
+    case STATS_NONE:
+        return;
+    case STATS_TEXT:
+        append_report(&report, "%s statistics\n", program_name);
+        append_report(&report, "elapsed: %.6f s\nwakeups: %llu\n",
+                elapsed / 1e6, (unsigned long long) stats->wakeups);
+        append_channel_text(&report, "incoming", &stats->incoming);
+        append_channel_text(&report, "outgoing", &stats->outgoing);
+        append_paste_text(&report, &stats->incoming);
+        append_latency_text(&report, "output", stats->output_latency);
+        append_latency_text(&report, "loop", stats->loop_latency);
+        break;
+    case STATS_JSON:
+        append_report(&report, "{\"elapsed_us\":%llu,\"wakeups\":%llu,",
+                (unsigned long long) elapsed,
+                (unsigned long long) stats->wakeups);
+        append_channel_json(&report, "incoming", &stats->incoming);
+        append_channel_json(&report, "outgoing", &stats->outgoing);
+        append_paste_json(&report, &stats->incoming);
+        append_latency_json(&report, "output", stats->output_latency);
+        append_report(&report, ",");
+        append_latency_json(&report, "loop", stats->loop_latency);
+        append_report(&report, "}\n");
+        break;
+    }
+
+    /* The terminal may be in the raw mode, in which a newline does not
+     * return the cursor. */
+    if (options.stats == STATS_TEXT && isatty(options.stats_fd)) {
+        for (size_t i = 0, start = 0; i < report.length; i++) {
+            if (report.data[i] == '\n') {
+                write_all(options.stats_fd, &report.data[start], i - start);
+                write_all(options.stats_fd, "\r\n", 2);
+                start = i + 1;
+            }
+        }
+    } else {
+        write_all(options.stats_fd, report.data, report.length);
+    }
+}
+
 static volatile sig_atomic_t should_set_terminal_size = false;
-static sigset_t original_mask;
+static volatile sig_atomic_t should_report_stats = false;
+static volatile sig_atomic_t should_reap_children = false;
+static volatile sig_atomic_t should_snapshot_screen = false;
+static sigset_t original_mask, handled_signals;
+
+/* Signals the event loop can receive. Only the members of handled_signals
+ * are actually handled. */
+static const int handled_signal_list[] = {
+#if defined(SIGWINCH)
+    SIGWINCH,
+#endif /* defined(SIGWINCH) */
+    SIGUSR1, SIGUSR2, SIGCHLD,
+};
+#define HANDLED_SIGNAL_COUNT \
+    (sizeof handled_signal_list / sizeof *handled_signal_list)
 
-static void receive_sigwinch(int sigwinch) {
-    should_set_terminal_size = true;
+static void receive_signal(int signum) {
+#if defined(SIGWINCH)
+    if (signum == SIGWINCH)
+        should_set_terminal_size = true;
+#endif /* defined(SIGWINCH) */
+    if (signum == SIGUSR1)
+        should_report_stats = true;
+    if (signum == SIGUSR2)
+        should_snapshot_screen = true;
+    if (signum == SIGCHLD)
+        should_reap_children = true;
 }
 
-static void install_sigwinch_handler(void) {
+static void install_signal_handlers(void) {
     struct sigaction action;
 
-    /* Block SIGWINCH and save original_mask */
-    if (sigemptyset(&action.sa_mask) < 0 || sigemptyset(&original_mask) < 0)
+    /* Block the handled signals and save original_mask */
+    if (sigemptyset(&handled_signals) < 0 || sigemptyset(&original_mask) < 0)
         errno_exit("sigemptyset");
 #if defined(SIGWINCH)
-    if (sigaddset(&action.sa_mask, SIGWINCH) < 0)
+    if (sigaddset(&handled_signals, SIGWINCH) < 0)
         errno_exit("sigaddset");
 #endif /* defined(SIGWINCH) */
-    if (sigprocmask(SIG_BLOCK, &action.sa_mask, &original_mask) < 0)
+    if (options.stats != STATS_NONE &&
+            sigaddset(&handled_signals, SIGUSR1) < 0)
+        errno_exit("sigaddset");
+    if (options.screen_path != NULL &&
+            sigaddset(&handled_signals, SIGUSR2) < 0)
+        errno_exit("sigaddset");
+    if ((options.multiplex || options.drain_timeout >= 0) &&
+            sigaddset(&handled_signals, SIGCHLD) < 0)
+        errno_exit("sigaddset");
+    if (sigprocmask(SIG_BLOCK, &handled_signals, &original_mask) < 0)
         errno_exit("sigprocmask");
 
-    /* Set signal handler for SIGWINCH */
-#if defined(SIGWINCH)
+    /* Set signal handlers used by the pselect backend */
+    action.sa_mask = handled_signals;
     action.sa_flags = 0;
-    action.sa_handler = receive_sigwinch;
-    if (sigaction(SIGWINCH, &action, NULL) < 0)
-        errno_exit("sigaction");
-#endif /* defined(SIGWINCH) */
+    action.sa_handler = receive_signal;
+    for (size_t i = 0; i < HANDLED_SIGNAL_COUNT; i++)
+        if (sigismember(&handled_signals, handled_signal_list[i]) == 1 &&
+                sigaction(handled_signal_list[i], &action, NULL) < 0)
+            errno_exit("sigaction");
 }
 
-static void restore_sigmask(void) {
-    if (sigprocmask(SIG_SETMASK, &original_mask, NULL) < 0)
-        errno_exit("sigprocmask");
+/* Keeps the fd from being inherited by child processes. Without this, a
+ * child in the multiplexed mode would keep other sessions' fds open. */
+static void set_cloexec(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0)
+        errno_exit("cannot set close-on-exec flag");
 }
 
-static void set_terminal_size(int fd) {
-    should_set_terminal_size = false;
-#if defined(TIOCGWINSZ) && defined(TIOCSWINSZ)
-    struct winsize size;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) >= 0)
-        ioctl(fd, TIOCSWINSZ, &size);
-#endif /* defined(TIOCGWINSZ) && defined(TIOCSWINSZ) */
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        errno_exit("cannot make file descriptor non-blocking");
 }
 
 static int prepare_master_pseudo_terminal(void) {
@@ -101,6 +1026,7 @@ static int prepare_master_pseudo_terminal(void) {
         errno_exit("cannot open master pseudo-terminal");
     if (fd <= STDERR_FILENO)
         error_exit("stdin/stdout/stderr are not open");
+    set_cloexec(fd);
 
     if (grantpt(fd) < 0)
         errno_exit("pseudo-terminal permission not granted");
@@ -122,6 +1048,7 @@ static int open_noctty(const char *pathname) {
     int fd = open(pathname, O_RDWR | O_NOCTTY);
     if (fd < 0)
         errno_exit("cannot open slave pseudo-terminal");
+    set_cloexec(fd);
     return fd;
 }
 
@@ -157,198 +1084,6501 @@ static void disable_canonical_io(void) {
         error_exit("atexit");
 }
 
-enum state_T { INACTIVE, READING, WRITING, };
-struct channel_T {
-    int from_fd, to_fd;
-    enum state_T state;
-    char buffer[BUFSIZ];
-    size_t buffer_position, buffer_length;
-};
+/* The flags of stdin and stdout before they were made non-blocking, or -1 */
+static int original_stdio_flags[2] = { -1, -1, };
 
-static void set_fd_set(
-        struct channel_T *channel, fd_set *read_fds, fd_set *write_fds) {
-    switch (channel->state) {
-    case INACTIVE: break;
-    case READING:  FD_SET(channel->from_fd, read_fds); break;
-    case WRITING:  FD_SET(channel->to_fd, write_fds);  break;
-    }
+static void restore_stdio_flags(void) {
+    if (is_child_process)
+        return;
+    for (int fd = STDIN_FILENO; fd <= STDOUT_FILENO; fd++)
+        if (original_stdio_flags[fd] >= 0)
+            fcntl(fd, F_SETFL, original_stdio_flags[fd]);
 }
 
-static void process_buffer(
-        struct channel_T *channel, fd_set *read_fds, fd_set *write_fds) {
-    ssize_t size;
-    switch (channel->state) {
-    case INACTIVE:
-        break;
-    case READING:
-        if (!FD_ISSET(channel->from_fd, read_fds))
-            break;
-        channel->buffer_position = 0;
-        size = read(channel->from_fd, channel->buffer, BUFSIZ);
-        if (size <= 0) {
-            channel->state = INACTIVE;
-        } else {
-            channel->state = WRITING;
-            channel->buffer_length = size;
-        }
-        break;
-    case WRITING:
-        if (!FD_ISSET(channel->to_fd, write_fds))
-            break;
-        assert(channel->buffer_position < channel->buffer_length);
-        size = write(channel->to_fd,
-                &channel->buffer[channel->buffer_position],
-                channel->buffer_length - channel->buffer_position);
-        if (size < 0)
-            break; /* ignore any error */
-        channel->buffer_position += size;
-        if (channel->buffer_position == channel->buffer_length)
-            channel->state = READING;
-        break;
-    }
+/* Makes stdin or stdout non-blocking until the wrapper exits. Other
+ * processes may share the open file description, so the original flags are
+ * restored. */
+static void make_stdio_nonblocking(int fd) {
+    if (original_stdio_flags[fd] >= 0)
+        return;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        errno_exit(fd == STDIN_FILENO ?
+                "cannot examine stdin" : "cannot examine stdout");
+    if (original_stdio_flags[STDIN_FILENO] < 0 &&
+            original_stdio_flags[STDOUT_FILENO] < 0 &&
+            atexit(restore_stdio_flags) != 0)
+        error_exit("atexit");
+    original_stdio_flags[fd] = flags;
+    set_nonblocking(fd);
 }
 
-static void forward_all_io(int master_fd) {
-    struct channel_T incoming, outgoing;
-    incoming.from_fd = STDIN_FILENO;
-    incoming.to_fd = master_fd;
-    outgoing.from_fd = master_fd;
-    outgoing.to_fd = STDOUT_FILENO;
-    incoming.state = outgoing.state = READING;
+static bool is_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && (flags & O_NONBLOCK);
+}
 
-    sigset_t mask_for_select = original_mask;
-#if defined(SIGWINCH)
-    if (sigdelset(&mask_for_select, SIGWINCH) < 0)
-        errno_exit("sigdelset");
-#endif /* defined(SIGWINCH) */
+enum { EVENT_READ = 1 << 0, EVENT_WRITE = 1 << 1, };
 
-    /* Loop until all output from the slave is forwarded, so that we don't
-     * miss any output. On the other hand, we don't know exactly how much
-     * input should be forwarded to the slave before the child process
-     * terminates, so we just keep forwarding the input. */
-    while (/* incoming.state != INACTIVE || */ outgoing.state != INACTIVE) {
-        /* await next IO */
-        fd_set read_fds, write_fds;
-        FD_ZERO(&read_fds);
-        FD_ZERO(&write_fds);
-        set_fd_set(&incoming, &read_fds, &write_fds);
-        set_fd_set(&outgoing, &read_fds, &write_fds);
-        if (pselect(master_fd + 1, &read_fds, &write_fds, NULL,
-                    NULL, &mask_for_select) < 0) {
-            if (errno != EINTR)
-                errno_exit("cannot find file descriptor to forward");
-            if (should_set_terminal_size)
-                set_terminal_size(master_fd);
-            continue;
-        }
+/* A file descriptor watched by the event loop. The interest is what the
+ * channels currently want; the backend registration is only updated when the
+ * interest differs from what has been registered. */
+struct watch_T {
+    int fd;
+    unsigned interest, registered, ready;
+    bool polled; /* false if the backend cannot poll the fd (always ready) */
+    /* If edge is true, the backend reports the fd only when it becomes
+     * ready, and the ready flags are kept across waits until the owner
+     * clears them, which it does when an operation would block. */
+    bool edge;
+    bool pending; /* in the list of unpolled watches with interest */
+    size_t index; /* in the list of all watches */
+    void *owner;
+};
 
-        /* read to or write from buffer */
-        process_buffer(&incoming, &read_fds, &write_fds);
-        process_buffer(&outgoing, &read_fds, &write_fds);
-    }
-}
+/* The number of events fetched from the backend at a time */
+#define MAX_EVENTS 64
 
-static int await_child(pid_t child_pid) {
-    int wait_status;
-    if (waitpid(child_pid, &wait_status, 0) != child_pid)
-        errno_exit("cannot await child process");
-    if (WIFEXITED(wait_status))
-        return WEXITSTATUS(wait_status);
-    if (WIFSIGNALED(wait_status))
-        return WTERMSIG(wait_status) | 0x80;
-    return EXIT_FAILURE;
-}
+struct event_loop_T {
+    struct watch_T **watches, **ready, **unpolled;
+    size_t watch_count, watch_capacity, ready_count, unpolled_count;
+#if defined(USE_EPOLL)
+    int epoll_fd, signal_fd;
+#elif defined(USE_KQUEUE)
+    int kqueue_fd;
+    struct kevent changes[MAX_EVENTS];
+    int change_count;
+#else
+    sigset_t wait_mask;
+#endif
+};
 
-static void become_session_leader(void) {
-    if (setsid() < 0)
-        errno_exit("cannot create new session");
+static void *xrealloc(void *pointer, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size)
+        error_exit("too many objects to allocate");
+    pointer = realloc(pointer, count * size);
+    if (pointer == NULL && count > 0)
+        errno_exit("cannot allocate memory");
+    return pointer;
 }
 
-static void prepare_slave_pseudo_terminal_fds(const char *slave_name) {
-    /* How to become the controlling process of a slave pseudo-terminal is
-     * implementation-dependent. We support two implementation schemes:
-     * (1) A process automatically becomes the controlling process when it
-     * first opens the terminal.
-     * (2) A process needs to use the TIOCSCTTY ioctl system call.
-     * There is a race condition in both schemes: an unrelated process could
-     * become the controlling process before we do, in which case the slave is
-     * not our controlling terminal and therefore we should abort. */
-
-    if (close(STDIN_FILENO) < 0)
-        errno_exit("cannot close old stdin");
-    int slave_fd = open(slave_name, O_RDWR);
-    if (slave_fd != STDIN_FILENO)
-        errno_exit("cannot open slave pseudo-terminal at stdin");
+/* Creates an event loop. If `signals' is true, the loop receives the handled
+ * signals. */
+static void open_event_loop(struct event_loop_T *loop, bool signals) {
+    loop->watches = loop->ready = loop->unpolled = NULL;
+    loop->watch_count = loop->watch_capacity = 0;
+    loop->ready_count = loop->unpolled_count = 0;
 
-    if (close(STDOUT_FILENO) < 0)
-        errno_exit("cannot close old stdout");
-    if (dup(slave_fd) != STDOUT_FILENO)
-        errno_exit("cannot open slave pseudo-terminal at stdout");
+#if defined(USE_EPOLL)
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+        errno_exit("cannot create epoll instance");
 
-    if (close(STDERR_FILENO) < 0)
-        errno_exit("cannot close old stderr");
-    if (dup(slave_fd) != STDERR_FILENO)
-        errno_exit("cannot open slave pseudo-terminal at stderr");
+    /* The handled signals are blocked, so they can be received from a
+     * signalfd. */
+    loop->signal_fd = -1;
+    if (!signals)
+        return;
+    loop->signal_fd =
+        signalfd(-1, &handled_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (loop->signal_fd < 0)
+        errno_exit("cannot create signalfd");
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->signal_fd, &event) < 0)
+        errno_exit("cannot watch signalfd");
+#elif defined(USE_KQUEUE)
+    loop->kqueue_fd = kqueue();
+    if (loop->kqueue_fd < 0)
+        errno_exit("cannot create kqueue");
+    loop->change_count = 0;
+    /* EVFILT_SIGNAL notices the signals even though they are blocked. */
+    for (size_t i = 0; signals && i < HANDLED_SIGNAL_COUNT; i++)
+        if (sigismember(&handled_signals, handled_signal_list[i]) == 1)
+            EV_SET(&loop->changes[loop->change_count++],
+                    handled_signal_list[i], EVFILT_SIGNAL, EV_ADD, 0, 0,
+                    NULL);
+#else
+    /* Other threads than the receiving one keep the signals blocked. */
+    if (sigprocmask(SIG_BLOCK, NULL, &loop->wait_mask) < 0)
+        errno_exit("sigprocmask");
+    if (signals)
+        loop->wait_mask = original_mask;
+    for (size_t i = 0; signals && i < HANDLED_SIGNAL_COUNT; i++)
+        if (sigismember(&handled_signals, handled_signal_list[i]) == 1 &&
+                sigdelset(&loop->wait_mask, handled_signal_list[i]) < 0)
+            errno_exit("sigdelset");
+#endif
+}
 
-#ifdef TIOCSCTTY
-    ioctl(slave_fd, TIOCSCTTY, NULL);
-#endif /* defined(TIOCSCTTY) */
+static void add_watch(struct event_loop_T *loop, struct watch_T *watch,
+        int fd, void *owner) {
+#if !defined(USE_EPOLL) && !defined(USE_KQUEUE)
+    if (fd >= FD_SETSIZE)
+        error_exit("file descriptor too large for pselect");
+#endif
+    if (loop->watch_count == loop->watch_capacity) {
+        size_t capacity = loop->watch_capacity * 2 + 8;
+        loop->watches =
+            xrealloc(loop->watches, capacity, sizeof *loop->watches);
+        loop->ready = xrealloc(loop->ready, capacity, sizeof *loop->ready);
+        loop->unpolled =
+            xrealloc(loop->unpolled, capacity, sizeof *loop->unpolled);
+        loop->watch_capacity = capacity;
+    }
+    watch->fd = fd;
+    watch->interest = watch->registered = watch->ready = 0;
+    watch->polled = true;
+    watch->edge = false;
+    watch->pending = false;
+    watch->owner = owner;
+    watch->index = loop->watch_count;
+    loop->watches[loop->watch_count++] = watch;
+}
 
-    if (tcgetpgrp(slave_fd) != getpgrp())
-        error_exit(
-                "cannot become controlling process of slave pseudo-terminal");
+#if defined(USE_KQUEUE)
+static void flush_changes(struct event_loop_T *loop) {
+    if (loop->change_count == 0)
+        return;
+    if (kevent(loop->kqueue_fd, loop->changes, loop->change_count,
+                NULL, 0, NULL) < 0)
+        errno_exit("cannot update kqueue");
+    loop->change_count = 0;
 }
 
-static void exec_command(char *argv[]) {
-    execvp(argv[0], argv);
-    errno_exit(argv[0]);
+static void change_filter(struct event_loop_T *loop, struct watch_T *watch,
+        short filter, unsigned event) {
+    bool wanted = watch->interest & event, registered =
+        watch->registered & event;
+    if (wanted == registered)
+        return;
+    if (loop->change_count == (int) (sizeof loop->changes /
+                sizeof *loop->changes))
+        flush_changes(loop);
+    EV_SET(&loop->changes[loop->change_count++], watch->fd, filter,
+            !wanted ? EV_DELETE : watch->edge ? EV_ADD | EV_CLEAR : EV_ADD,
+            0, 0, (void *) watch);
 }
+#endif /* defined(USE_KQUEUE) */
 
-int main(int argc, char *argv[]) {
-    if (argc <= 0)
-        exit(EXIT_FAILURE);
-    program_name = argv[0];
+/* Remembers a watch that cannot be polled so that it is reported ready
+ * whenever it has interest. */
+static void add_unpolled(struct event_loop_T *loop, struct watch_T *watch) {
+    watch->polled = false;
+    if (watch->interest != 0 && !watch->pending) {
+        watch->pending = true;
+        loop->unpolled[loop->unpolled_count++] = watch;
+    }
+}
 
-    /* Don't use getopt, because we don't want glibc's reordering extension.
-    if (getopt(argc, argv, "") != -1)
-        exit(EXIT_FAILURE);
-    */
-    optind = 1;
-    if (optind < argc && strcmp(argv[optind], "--") == 0)
-        optind++;
+/* Passes the interest of the watch on to the backend if it has changed. */
+static void apply_interest(struct event_loop_T *loop, struct watch_T *watch) {
+    if (!watch->polled) {
+        add_unpolled(loop, watch);
+        return;
+    }
+    if (watch->interest == watch->registered)
+        return;
 
-    if (optind == argc)
-        error_exit("operand missing");
+#if defined(USE_EPOLL)
+    struct epoll_event event = { .events = 0, .data.ptr = watch };
+    if (watch->interest & EVENT_READ)
+        event.events |= EPOLLIN;
+    if (watch->interest & EVENT_WRITE)
+        event.events |= EPOLLOUT;
+    if (watch->edge)
+        event.events |= EPOLLET;
+    /* Delete the fd rather than registering no events, because EPOLLHUP
+     * would be reported anyway. */
+    int op = watch->interest == 0 ? EPOLL_CTL_DEL :
+        watch->registered == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(loop->epoll_fd, op, watch->fd, &event) < 0) {
+        if (errno != EPERM)
+            errno_exit("cannot watch file descriptor");
+        /* Regular files cannot be polled, but they are always ready. */
+        add_unpolled(loop, watch);
+    }
+#elif defined(USE_KQUEUE)
+    change_filter(loop, watch, EVFILT_READ, EVENT_READ);
+    change_filter(loop, watch, EVFILT_WRITE, EVENT_WRITE);
+#endif
+    watch->registered = watch->interest;
+}
 
-    install_sigwinch_handler();
+/* Stops watching. This must be called before the fd is closed. */
+static void remove_watch(struct event_loop_T *loop, struct watch_T *watch) {
+    watch->interest = 0;
+    apply_interest(loop, watch);
+#if defined(USE_KQUEUE)
+    flush_changes(loop);
+#endif /* defined(USE_KQUEUE) */
 
-    int master_fd = prepare_master_pseudo_terminal();
-    const char *slave_name = slave_pseudo_terminal_name(master_fd);
-    int slave_fd = open_noctty(slave_name);
+    for (size_t i = 0; i < loop->ready_count; i++)
+        if (loop->ready[i] == watch)
+            loop->ready[i] = loop->ready[--loop->ready_count];
+    watch->ready = 0;
+    for (size_t i = 0; i < loop->unpolled_count; i++)
+        if (loop->unpolled[i] == watch)
+            loop->unpolled[i] = loop->unpolled[--loop->unpolled_count];
 
-    /* On Darwin, the slave must have been opened before setting the size. */
-    set_terminal_size(master_fd);
+    struct watch_T *last = loop->watches[--loop->watch_count];
+    last->index = watch->index;
+    loop->watches[watch->index] = last;
+}
 
-    disable_canonical_io();
+static void mark_ready(
+        struct event_loop_T *loop, struct watch_T *watch, unsigned events) {
+    events &= watch->interest;
+    if (events == 0)
+        return;
+    if (watch->ready == 0)
+        loop->ready[loop->ready_count++] = watch;
+    watch->ready |= events;
+}
 
-    pid_t child_pid = fork();
-    if (child_pid < 0)
-        errno_exit("cannot spawn child process");
-    if (child_pid > 0) {
-        /* parent process */
-        close(slave_fd);
-        forward_all_io(master_fd);
-        return await_child(child_pid);
-    } else {
-        /* child process */
-        is_child_process = true;
-        close(master_fd);
-        become_session_leader();
-        prepare_slave_pseudo_terminal_fds(slave_name);
-        close(slave_fd);
-        restore_sigmask();
-        exec_command(&argv[optind]);
+/* Waits until any of the watches becomes ready, sets their ready flags, and
+ * collects them in the ready list. The timeout is in microseconds; a
+ * negative timeout waits indefinitely. */
+static void await_events(struct event_loop_T *loop, int64_t timeout) {
+    /* Keep edge-triggered watches that are still ready */
+    size_t carried = 0;
+    for (size_t i = 0; i < loop->ready_count; i++) {
+        struct watch_T *watch = loop->ready[i];
+        watch->ready = watch->edge ? watch->ready & watch->interest : 0;
+        if (watch->ready != 0)
+            loop->ready[carried++] = watch;
     }
+    loop->ready_count = carried;
+    if (carried > 0)
+        timeout = 0;
+
+    /* Drop unpolled watches that have lost interest */
+    for (size_t i = 0; i < loop->unpolled_count; ) {
+        struct watch_T *watch = loop->unpolled[i];
+        if (watch->interest != 0 && !watch->polled) {
+            i++;
+        } else {
+            watch->pending = false;
+            loop->unpolled[i] = loop->unpolled[--loop->unpolled_count];
+        }
+    }
+    if (loop->unpolled_count > 0)
+        timeout = 0;
+#if !defined(USE_EPOLL)
+    struct timespec timeout_spec = {
+        .tv_sec = timeout / 1000000, .tv_nsec = timeout % 1000000 * 1000,
+    };
+#endif
+
+#if defined(USE_EPOLL)
+    struct epoll_event events[MAX_EVENTS];
+    /* in milliseconds, rounded up and limited to what an int can hold */
+    int milliseconds = timeout < 0 ? -1 :
+        timeout > (int64_t) INT_MAX * 1000 ? INT_MAX :
+        (int) ((timeout + 999) / 1000);
+    int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, milliseconds);
+    if (count < 0) {
+        if (errno != EINTR)
+            errno_exit("cannot find file descriptor to forward");
+        count = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        struct watch_T *watch = events[i].data.ptr;
+        if (watch == NULL) {
+            struct signalfd_siginfo info;
+            while (read(loop->signal_fd, &info, sizeof info) > 0)
+                receive_signal((int) info.ssi_signo);
+            continue;
+        }
+        /* Report a hang-up or error as readiness so that the following read
+         * or write detects it. */
+        unsigned ready = 0;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ready |= EVENT_READ;
+        if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            ready |= EVENT_WRITE;
+        mark_ready(loop, watch, ready);
+    }
+#elif defined(USE_KQUEUE)
+    struct kevent events[MAX_EVENTS];
+    int count = kevent(loop->kqueue_fd, loop->changes, loop->change_count,
+            events, MAX_EVENTS, timeout < 0 ? NULL : &timeout_spec);
+    if (count < 0) {
+        if (errno != EINTR)
+            errno_exit("cannot find file descriptor to forward");
+        count = 0;
+    }
+    loop->change_count = 0;
+    for (int i = 0; i < count; i++) {
+        struct watch_T *watch = events[i].udata;
+        if (events[i].filter == EVFILT_SIGNAL) {
+            receive_signal((int) events[i].ident);
+            continue;
+        }
+        if (events[i].flags & EV_ERROR) {
+            /* Treat file descriptors kqueue cannot handle as always ready. */
+            add_unpolled(loop, watch);
+            continue;
+        }
+        if (events[i].filter == EVFILT_READ)
+            mark_ready(loop, watch, EVENT_READ);
+        else if (events[i].filter == EVFILT_WRITE)
+            mark_ready(loop, watch, EVENT_WRITE);
+    }
+#else
+    fd_set read_fds, write_fds;
+    int max_fd = -1;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    for (size_t i = 0; i < loop->watch_count; i++) {
+        struct watch_T *watch = loop->watches[i];
+        if (watch->interest & EVENT_READ)
+            FD_SET(watch->fd, &read_fds);
+        if (watch->interest & EVENT_WRITE)
+            FD_SET(watch->fd, &write_fds);
+        if (watch->interest != 0 && watch->fd > max_fd)
+            max_fd = watch->fd;
+    }
+    if (pselect(max_fd + 1, &read_fds, &write_fds, NULL,
+                timeout < 0 ? NULL : &timeout_spec, &loop->wait_mask) < 0) {
+        if (errno != EINTR)
+            errno_exit("cannot find file descriptor to forward");
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+    }
+    for (size_t i = 0; i < loop->watch_count; i++) {
+        struct watch_T *watch = loop->watches[i];
+        unsigned ready = 0;
+        if (FD_ISSET(watch->fd, &read_fds))
+            ready |= EVENT_READ;
+        if (FD_ISSET(watch->fd, &write_fds))
+            ready |= EVENT_WRITE;
+        mark_ready(loop, watch, ready);
+    }
+#endif
+
+    for (size_t i = 0; i < loop->unpolled_count; i++)
+        mark_ready(loop, loop->unpolled[i], loop->unpolled[i]->interest);
+}
+
+/* A ring buffer. The head and tail are the total numbers of bytes that have
+ * been put into and taken out of the buffer, so head - tail is the number of
+ * bytes buffered. */
+struct ring_T {
+    char *data;
+    size_t size, head, tail;
+};
+
+static void init_ring(struct ring_T *ring, size_t size) {
+    ring->data = malloc(size);
+    if (ring->data == NULL)
+        errno_exit("cannot allocate buffer");
+    ring->size = size;
+    ring->head = ring->tail = 0;
+}
+
+static size_t ring_length(const struct ring_T *ring) {
+    return ring->head - ring->tail;
+}
+
+static size_t ring_space(const struct ring_T *ring) {
+    return ring->size - ring_length(ring);
+}
+
+/* Sets up to two iovecs that cover the free space of the ring starting at
+ * the head. Returns the number of iovecs set. */
+static int ring_space_iov(const struct ring_T *ring, struct iovec iov[2]) {
+    size_t space = ring_space(ring), start = ring->head % ring->size;
+    size_t first = ring->size - start < space ? ring->size - start : space;
+    iov[0].iov_base = &ring->data[start];
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = space - first;
+    return space - first > 0 ? 2 : 1;
+}
+
+/* Sets up to two iovecs that cover the buffered data of the ring starting
+ * at the tail. Returns the number of iovecs set. */
+static int ring_data_iov(const struct ring_T *ring, struct iovec iov[2]) {
+    size_t length = ring_length(ring), start = ring->tail % ring->size;
+    size_t first = ring->size - start < length ? ring->size - start : length;
+    iov[0].iov_base = &ring->data[start];
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = length - first;
+    return length - first > 0 ? 2 : 1;
+}
+
+/* Replaces the storage of the ring with `size' bytes, which must hold the
+ * buffered data. The positions of the data do not change. */
+static void resize_ring(struct ring_T *ring, size_t size) {
+    char *data = malloc(size);
+    if (data == NULL)
+        errno_exit("cannot allocate buffer");
+    for (size_t p = ring->tail; p != ring->head; ) {
+        size_t from = p % ring->size, to = p % size;
+        size_t part = ring->head - p;
+        if (ring->size - from < part)
+            part = ring->size - from;
+        if (size - to < part)
+            part = size - to;
+        memcpy(&data[to], &ring->data[from], part);
+        p += part;
+    }
+    free(ring->data);
+    ring->data = data;
+    ring->size = size;
+}
+
+/* Output capture (--tee). The forwarding loop copies the output into a
+ * queue, from which a writer thread writes it to the file, so that a slow
+ * disk never delays forwarding. The queue is a single-producer,
+ * single-consumer ring: only the forwarding loop advances the head and only
+ * the writer advances the tail, so neither needs a lock. The mutex and
+ * condition variable are only used to put the idle writer to sleep. */
+
+#if defined(USE_THREADS)
+/* Sequentially consistent accesses to the fields shared with the writer */
+#define load_shared(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define store_shared(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#else
+#define load_shared(p) (*(p))
+#define store_shared(p, v) ((void) (*(p) = (v)))
+#endif /* defined(USE_THREADS) */
+
+/* A queue hands data over from the forwarding thread to a writer thread,
+ * which consumes them by calling `drain', so that slow disk IO does not
+ * delay forwarding. The writer waits until `batch' bytes are queued or, if
+ * `interval' is non-zero, until that many microseconds have passed since
+ * data were queued. `drain' advances the tail up to `head'; if `final' is
+ * true, it is the last call. Without threads, the forwarding thread drains
+ * the queue whenever `batch' bytes are queued. */
+struct queue_T {
+    char *data;
+    size_t size, head, tail;
+    size_t batch;
+    uint64_t interval;
+    uint64_t dropped; /* bytes that did not fit in the queue */
+    void (*drain)(size_t head, bool final);
+#if defined(USE_THREADS)
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    bool waiting, closing;
+#endif /* defined(USE_THREADS) */
+};
+
+#if defined(USE_THREADS)
+
+/* Waits for the queue to change while `length' bytes are queued. Returns
+ * true if the interval has passed since data were queued. */
+static bool wait_queue(struct queue_T *queue, size_t length,
+        struct timespec *deadline) {
+    if (queue->interval == 0 || length == 0) {
+        pthread_cond_wait(&queue->wake, &queue->mutex);
+        return false;
+    }
+    if (deadline->tv_sec == 0) {
+        clock_gettime(CLOCK_REALTIME, deadline);
+        uint64_t nsec = (uint64_t) deadline->tv_nsec + queue->interval * 1000;
+        deadline->tv_sec += (time_t) (nsec / 1000000000);
+        deadline->tv_nsec = (long) (nsec % 1000000000);
+    }
+    return pthread_cond_timedwait(&queue->wake, &queue->mutex, deadline) ==
+        ETIMEDOUT;
+}
+
+static void *run_queue(void *argument) {
+    struct queue_T *queue = argument;
+    for (;;) {
+        size_t head;
+        bool closing, expired = false;
+        struct timespec deadline = { .tv_sec = 0, };
+        pthread_mutex_lock(&queue->mutex);
+        store_shared(&queue->waiting, true);
+        for (;;) {
+            closing = load_shared(&queue->closing);
+            head = load_shared(&queue->head);
+            size_t length = head - queue->tail;
+            if (closing || (length > 0 &&
+                        (expired || length >= load_shared(&queue->batch))))
+                break;
+            expired = wait_queue(queue, length, &deadline);
+        }
+        store_shared(&queue->waiting, false);
+        pthread_mutex_unlock(&queue->mutex);
+
+        queue->drain(head, closing);
+        if (closing)
+            return NULL;
+    }
+}
+
+#endif /* defined(USE_THREADS) */
+
+static void start_queue(struct queue_T *queue, size_t size, size_t alignment,
+        void (*drain)(size_t, bool)) {
+    void *data;
+    int error = posix_memalign(&data, alignment, size);
+    if (error != 0) {
+        errno = error;
+        errno_exit("cannot allocate buffer");
+    }
+    queue->data = data;
+    queue->size = size;
+    queue->head = queue->tail = 0;
+    queue->dropped = 0;
+    queue->drain = drain;
+
+#if defined(USE_THREADS)
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->wake, NULL);
+    queue->waiting = queue->closing = false;
+    error = pthread_create(&queue->thread, NULL, run_queue, queue);
+    if (error != 0) {
+        errno = error;
+        errno_exit("cannot create thread");
+    }
+#endif /* defined(USE_THREADS) */
+}
+
+/* Copies the first `length' bytes of the iovecs to the queue. The data are
+ * dropped rather than waiting for the writer if the queue is full. */
+static void append_queue(struct queue_T *queue,
+        const struct iovec iov[], int count, size_t length) {
+    size_t head = queue->head, tail = load_shared(&queue->tail);
+    if (length > queue->size - (head - tail)) {
+        queue->dropped += length;
+        return;
+    }
+    for (int i = 0; i < count && length > 0; i++) {
+        size_t part = iov[i].iov_len < length ? iov[i].iov_len : length;
+        const char *data = iov[i].iov_base;
+        size_t start = head % queue->size, end = queue->size - start;
+        size_t first = end < part ? end : part;
+        memcpy(&queue->data[start], data, first);
+        memcpy(queue->data, &data[first], part - first);
+        head += part, length -= part;
+    }
+    size_t previous_head = queue->head;
+    store_shared(&queue->head, head);
+
+#if defined(USE_THREADS)
+    /* Wake the writer if it found the queue empty, to start the interval,
+     * or if a batch is ready. The tail does not move while it waits. */
+    if (load_shared(&queue->waiting)) {
+        tail = load_shared(&queue->tail);
+        if (tail == previous_head ||
+                head - tail >= load_shared(&queue->batch)) {
+            pthread_mutex_lock(&queue->mutex);
+            pthread_cond_signal(&queue->wake);
+            pthread_mutex_unlock(&queue->mutex);
+        }
+    }
+#else
+    if (head - tail >= queue->batch)
+        queue->drain(head, false);
+#endif /* defined(USE_THREADS) */
+}
+
+/* Drains the rest of the queue and stops the writer. */
+static void stop_queue(struct queue_T *queue) {
+#if defined(USE_THREADS)
+    pthread_mutex_lock(&queue->mutex);
+    store_shared(&queue->closing, true);
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->mutex);
+    pthread_join(queue->thread, NULL);
+#else
+    queue->drain(queue->head, true);
+#endif /* defined(USE_THREADS) */
+    free(queue->data);
+}
+
+/* The alignment required by direct IO */
+#define TEE_ALIGNMENT 4096
+#define TEE_MIN_QUEUE_SIZE (4 * 1024 * 1024)
+
+static struct tee_T {
+    int fd;
+    char *rotated_path; /* the pathname the file is renamed to on rotation */
+    uint64_t file_size;
+    bool direct; /* the file is open with O_DIRECT */
+    bool failed; /* data are discarded after a write error */
+    struct queue_T queue;
+} tee_file;
+
+static size_t round_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+static int open_tee_file(void) {
+    int flags = O_WRONLY | O_CREAT | O_APPEND;
+#if defined(O_DIRECT)
+    if (tee_file.direct) {
+        int fd = open(options.tee_path, flags | O_DIRECT, 0666);
+        if (fd >= 0 || errno != EINVAL)
+            return fd;
+        tee_file.direct = false; /* the file system does not support it */
+    }
+#endif /* defined(O_DIRECT) */
+    return open(options.tee_path, flags, 0666);
+}
+
+static void disable_direct_io(void) {
+#if defined(O_DIRECT)
+    int flags = fcntl(tee_file.fd, F_GETFL);
+    if (flags >= 0)
+        fcntl(tee_file.fd, F_SETFL, flags & ~O_DIRECT);
+#endif /* defined(O_DIRECT) */
+    tee_file.direct = false;
+    store_shared(&tee_file.queue.batch, 1);
+}
+
+/* Renames the file and continues writing to a new one. */
+static void rotate_tee(void) {
+    close(tee_file.fd);
+    tee_file.fd = -1;
+    tee_file.file_size = 0;
+    if (rename(options.tee_path, tee_file.rotated_path) < 0 ||
+            (tee_file.fd = open_tee_file()) < 0) {
+        fprintf(stderr, "%s: cannot rotate %s: %s\n", program_name,
+                options.tee_path, strerror(errno));
+        tee_file.failed = true;
+        return;
+    }
+    set_cloexec(tee_file.fd);
+}
+
+/* Writes the queued data up to `head' to the file. In the direct mode,
+ * only whole blocks are written unless `final' is true. */
+static void drain_tee(size_t head, bool final) {
+    struct queue_T *queue = &tee_file.queue;
+    while (queue->tail != head) {
+        if (options.tee_rotate > 0 && !tee_file.failed &&
+                tee_file.file_size >= options.tee_rotate)
+            rotate_tee();
+
+        size_t length = head - queue->tail;
+        if (options.tee_rotate > 0 && !tee_file.failed &&
+                length > options.tee_rotate - tee_file.file_size)
+            length = options.tee_rotate - tee_file.file_size;
+        if (tee_file.direct && length % TEE_ALIGNMENT != 0) {
+            if (!final)
+                length -= length % TEE_ALIGNMENT;
+            else
+                disable_direct_io();
+        }
+        if (length == 0)
+            return;
+
+        struct ring_T queued = {
+            .data = queue->data, .size = queue->size,
+            .head = queue->tail + length, .tail = queue->tail,
+        };
+        struct iovec iov[2];
+        ssize_t size = tee_file.failed ? (ssize_t) length :
+            writev(tee_file.fd, iov, ring_data_iov(&queued, iov));
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && tee_file.direct) {
+                disable_direct_io();
+                continue;
+            }
+            fprintf(stderr, "%s: cannot write to %s: %s\n", program_name,
+                    options.tee_path, strerror(errno));
+            tee_file.failed = true;
+            continue;
+        }
+        tee_file.file_size += size;
+        store_shared(&queue->tail, queue->tail + size);
+    }
+}
+
+static void open_tee(void) {
+    tee_file.direct = options.tee_direct;
+    tee_file.fd = open_tee_file();
+    if (tee_file.fd < 0)
+        errno_exit(options.tee_path);
+    set_cloexec(tee_file.fd);
+    struct stat st;
+    if (fstat(tee_file.fd, &st) < 0)
+        errno_exit(options.tee_path);
+    tee_file.file_size = (uint64_t) st.st_size;
+    /* Appending at an unaligned offset is not possible with O_DIRECT. */
+    if (tee_file.direct && tee_file.file_size % TEE_ALIGNMENT != 0)
+        disable_direct_io();
+    if (tee_file.direct)
+        options.tee_rotate = round_up(options.tee_rotate, TEE_ALIGNMENT);
+
+    size_t length = strlen(options.tee_path);
+    tee_file.rotated_path = xrealloc(NULL, length + 3, 1);
+    memcpy(tee_file.rotated_path, options.tee_path, length);
+    memcpy(&tee_file.rotated_path[length], ".1", 3);
+
+    /* Wait for a whole block in the direct mode so that writes stay
+     * aligned. */
+    size_t size = options.buffer_size * 2 > TEE_MIN_QUEUE_SIZE ?
+        options.buffer_size * 2 : TEE_MIN_QUEUE_SIZE;
+    tee_file.queue.batch = tee_file.direct ? TEE_ALIGNMENT : 1;
+    tee_file.queue.interval = 0;
+    tee_file.failed = false;
+    start_queue(&tee_file.queue, round_up(size, TEE_ALIGNMENT),
+            TEE_ALIGNMENT, drain_tee);
+}
+
+static void append_tee(const struct iovec iov[], int count, size_t length) {
+    append_queue(&tee_file.queue, iov, count, length);
+}
+
+/* Writes the rest of the queue and closes the file. */
+static void close_tee(void) {
+    stop_queue(&tee_file.queue);
+    if (tee_file.fd >= 0)
+        close(tee_file.fd);
+    if (tee_file.queue.dropped > 0)
+        fprintf(stderr, "%s: %s: %llu bytes of output dropped\n",
+                program_name, options.tee_path,
+                (unsigned long long) tee_file.queue.dropped);
+}
+
+/* A recording (--record) is a header followed by blocks of records and an
+ * index of the blocks:
+ *
+ *   header:  "PTWREC01", wall-clock start time
+ *   block:   "PBLK", compression, 3 zero bytes, stored length, raw length,
+ *            time of the first record, time of the last record, records
+ *   record:  time, type, length, data
+ *   index:   offset, time of the first record, and time of the last record
+ *            of each block
+ *   trailer: offset of the index, number of blocks, "PTWRIDX1"
+ *
+ * Integers are little-endian. Lengths and the compression and type are 32
+ * and 8 bits; the others are 64 bits. Times are in microseconds, since the
+ * epoch in the header and since the start elsewhere. The file is written
+ * only by appending to it. The index is written when recording finishes;
+ * if the wrapper is killed before that, the index is rebuilt from the block
+ * headers and only the last block is lost. */
+#define RECORDING_MAGIC "PTWREC01"
+#define BLOCK_MAGIC "PBLK"
+#define INDEX_MAGIC "PTWRIDX1"
+#define FILE_HEADER_SIZE 16
+#define BLOCK_HEADER_SIZE 32
+#define RECORD_HEADER_SIZE 13
+#define INDEX_ENTRY_SIZE 24
+#define TRAILER_SIZE 24
+/* Records are buffered in a block of up to this size, and for up to this
+ * many microseconds */
+#define RECORD_BLOCK_SIZE (64 * 1024)
+#define RECORD_BLOCK_INTERVAL 1000000
+#define COMPRESSION_LEVEL 3
+
+enum { COMPRESSION_NONE = 0, COMPRESSION_ZSTD = 1, };
+enum { RECORD_OUTPUT = 'o', RECORD_INPUT = 'i', RECORD_RESIZE = 'r', };
+
+static void put_le(unsigned char *p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        p[i] = (unsigned char) (value >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes; i-- > 0; )
+        value = value << 8 | p[i];
+    return value;
+}
+
+static struct recorder_T {
+    int fd;
+    bool failed; /* records are discarded after a write error */
+    uint64_t start_time;
+    uint64_t offset; /* the end of the file */
+    /* The header of the current block followed by its records */
+    unsigned char *block;
+    size_t block_length, block_capacity; /* excluding the header */
+    uint64_t first_time, last_time;
+    unsigned char *index; /* in the format of the file */
+    size_t block_count, index_capacity;
+#if defined(PTWRAP_USE_ZSTD)
+    unsigned char *compressed;
+    size_t compressed_capacity;
+#endif /* defined(PTWRAP_USE_ZSTD) */
+} recorder;
+
+static void write_recording(const unsigned char *data, size_t length) {
+    if (recorder.failed)
+        return;
+    if (!write_all(recorder.fd, (const char *) data, length)) {
+        fprintf(stderr, "%s: cannot write to %s: %s\n", program_name,
+                options.record_path, strerror(errno));
+        recorder.failed = true;
+        return;
+    }
+    recorder.offset += length;
+}
+
+static void open_recording(void) {
+    recorder.fd = open(options.record_path,
+            O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (recorder.fd < 0)
+        errno_exit(options.record_path);
+    set_cloexec(recorder.fd);
+    recorder.failed = false;
+    recorder.offset = 0;
+    recorder.block_capacity = RECORD_BLOCK_SIZE;
+    recorder.block =
+        xrealloc(NULL, BLOCK_HEADER_SIZE + recorder.block_capacity, 1);
+    recorder.block_length = 0;
+    recorder.index = NULL;
+    recorder.block_count = recorder.index_capacity = 0;
+#if defined(PTWRAP_USE_ZSTD)
+    recorder.compressed = NULL;
+    recorder.compressed_capacity = 0;
+#endif /* defined(PTWRAP_USE_ZSTD) */
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned char header[FILE_HEADER_SIZE];
+    memcpy(header, RECORDING_MAGIC, 8);
+    put_le(&header[8], (uint64_t) now.tv_sec * 1000000 +
+            (uint64_t) now.tv_nsec / 1000, 8);
+    recorder.start_time = current_time();
+    write_recording(header, sizeof header);
+}
+
+/* Compresses the records of the current block if --record-compress is
+ * given and it makes the block smaller. Returns the block to be written,
+ * whose stored length is assigned to `*length'. */
+static unsigned char *compress_block(int *compression, size_t *length) {
+    *compression = COMPRESSION_NONE;
+    *length = recorder.block_length;
+#if defined(PTWRAP_USE_ZSTD)
+    if (options.record_compress) {
+        size_t bound = ZSTD_compressBound(recorder.block_length);
+        if (bound > recorder.compressed_capacity) {
+            recorder.compressed = xrealloc(recorder.compressed,
+                    BLOCK_HEADER_SIZE + bound, 1);
+            recorder.compressed_capacity = bound;
+        }
+        size_t size = ZSTD_compress(
+                &recorder.compressed[BLOCK_HEADER_SIZE], bound,
+                &recorder.block[BLOCK_HEADER_SIZE], recorder.block_length,
+                COMPRESSION_LEVEL);
+        if (!ZSTD_isError(size) && size < recorder.block_length) {
+            *compression = COMPRESSION_ZSTD;
+            *length = size;
+            return recorder.compressed;
+        }
+    }
+#endif /* defined(PTWRAP_USE_ZSTD) */
+    return recorder.block;
+}
+
+/* Writes the current block, if any, and adds it to the index. */
+static void flush_block(void) {
+    if (recorder.block_length == 0)
+        return;
+    int compression;
+    size_t length;
+    unsigned char *block = compress_block(&compression, &length);
+    memcpy(block, BLOCK_MAGIC, 4);
+    put_le(&block[4], (uint64_t) compression, 4);
+    put_le(&block[8], length, 4);
+    put_le(&block[12], recorder.block_length, 4);
+    put_le(&block[16], recorder.first_time, 8);
+    put_le(&block[24], recorder.last_time, 8);
+
+    if (recorder.block_count == recorder.index_capacity) {
+        recorder.index_capacity = recorder.index_capacity * 2 + 64;
+        recorder.index = xrealloc(recorder.index,
+                recorder.index_capacity, INDEX_ENTRY_SIZE);
+    }
+    unsigned char *entry =
+        &recorder.index[recorder.block_count * INDEX_ENTRY_SIZE];
+    put_le(entry, recorder.offset, 8);
+    put_le(&entry[8], recorder.first_time, 8);
+    put_le(&entry[16], recorder.last_time, 8);
+    write_recording(block, BLOCK_HEADER_SIZE + length);
+    if (!recorder.failed)
+        recorder.block_count++;
+    recorder.block_length = 0;
+}
+
+/* Appends a record of the first `length' bytes of the iovecs. */
+static void record_chunk(int type, const struct iovec iov[], int count,
+        size_t length, uint64_t now) {
+    if (recorder.failed)
+        return;
+    if (recorder.block_length > 0 && RECORD_HEADER_SIZE + length >
+            RECORD_BLOCK_SIZE - recorder.block_length)
+        flush_block();
+    if (RECORD_HEADER_SIZE + length > recorder.block_capacity) {
+        recorder.block_capacity = RECORD_HEADER_SIZE + length;
+        recorder.block = xrealloc(recorder.block,
+                BLOCK_HEADER_SIZE + recorder.block_capacity, 1);
+    }
+
+    uint64_t time = now > recorder.start_time ? now - recorder.start_time : 0;
+    if (recorder.block_length == 0)
+        recorder.first_time = time;
+    recorder.last_time = time;
+    unsigned char *p =
+        &recorder.block[BLOCK_HEADER_SIZE + recorder.block_length];
+    put_le(p, time, 8);
+    p[8] = (unsigned char) type;
+    put_le(&p[9], length, 4);
+    p += RECORD_HEADER_SIZE;
+    for (int i = 0; i < count && length > 0; i++) {
+        size_t part = iov[i].iov_len < length ? iov[i].iov_len : length;
+        memcpy(p, iov[i].iov_base, part);
+        p += part, length -= part;
+    }
+    recorder.block_length = (size_t) (p - recorder.block) - BLOCK_HEADER_SIZE;
+
+    if (time - recorder.first_time >= RECORD_BLOCK_INTERVAL)
+        flush_block();
+}
+
+static void record_resize(unsigned short columns, unsigned short rows) {
+    unsigned char size[4];
+    put_le(size, columns, 2);
+    put_le(&size[2], rows, 2);
+    struct iovec iov = { .iov_base = size, .iov_len = sizeof size };
+    record_chunk(RECORD_RESIZE, &iov, 1, sizeof size, current_time());
+}
+
+/* Writes the last block and the index and closes the file. */
+static void close_recording(void) {
+    flush_block();
+    size_t length = recorder.block_count * INDEX_ENTRY_SIZE;
+    unsigned char trailer[TRAILER_SIZE];
+    put_le(trailer, recorder.offset, 8);
+    put_le(&trailer[8], recorder.block_count, 8);
+    memcpy(&trailer[16], INDEX_MAGIC, 8);
+    if (length > 0)
+        write_recording(recorder.index, length);
+    write_recording(trailer, sizeof trailer);
+    close(recorder.fd);
+    free(recorder.block);
+    free(recorder.index);
+#if defined(PTWRAP_USE_ZSTD)
+    free(recorder.compressed);
+#endif /* defined(PTWRAP_USE_ZSTD) */
+}
+
+/* Asciicast v2 output (--asciicast). The forwarding thread only queues the
+ * raw events; the writer thread encodes them in JSON and writes them in
+ * batches of up to CAST_OUTPUT_SIZE bytes at most CAST_INTERVAL apart. */
+#define CAST_MIN_QUEUE_SIZE (4 * 1024 * 1024)
+#define CAST_OUTPUT_SIZE (256 * 1024)
+#define CAST_BATCH (64 * 1024)
+#define CAST_INTERVAL 100000
+
+/* An event in the queue, followed by its data */
+struct cast_event_T {
+    uint64_t time; /* since the start in microseconds */
+    uint32_t length;
+    char type; /* RECORD_OUTPUT or RECORD_RESIZE */
+};
+
+static struct cast_T {
+    bool started;
+    int fd;
+    bool failed; /* events are discarded after a write error */
+    uint64_t start_time;
+    char *output; /* encoded events to be written */
+    size_t output_length;
+    /* A UTF-8 sequence split between reads */
+    unsigned char partial[4];
+    size_t partial_length, partial_needed;
+    struct queue_T queue;
+} cast_file;
+
+static void flush_cast(void) {
+    if (!cast_file.failed && !write_all(cast_file.fd, cast_file.output,
+                cast_file.output_length)) {
+        fprintf(stderr, "%s: cannot write to %s: %s\n", program_name,
+                options.cast_path, strerror(errno));
+        cast_file.failed = true;
+    }
+    cast_file.output_length = 0;
+}
+
+/* Makes room for at least `length' bytes of output. */
+static char *reserve_cast(size_t length) {
+    if (length > CAST_OUTPUT_SIZE - cast_file.output_length)
+        flush_cast();
+    return &cast_file.output[cast_file.output_length];
+}
+
+static void put_cast(const void *data, size_t length) {
+    memcpy(reserve_cast(length), data, length);
+    cast_file.output_length += length;
+}
+
+/* Appends the bytes escaped as the contents of a JSON string. Invalid UTF-8
+ * is replaced with U+FFFD, since the string must be valid UTF-8. */
+static void encode_cast(const unsigned char *data, size_t length) {
+    static const char replacement[] = "\xEF\xBF\xBD";
+    while (length > 0) {
+        unsigned char c = *data;
+        if (cast_file.partial_needed > 0) {
+            /* Reject overlong forms, surrogates, and code points above
+             * U+10FFFF by the range of the second byte. */
+            unsigned char low = 0x80, high = 0xBF;
+            if (cast_file.partial_length == 1) {
+                switch (cast_file.partial[0]) {
+                case 0xE0: low = 0xA0;  break;
+                case 0xED: high = 0x9F; break;
+                case 0xF0: low = 0x90;  break;
+                case 0xF4: high = 0x8F; break;
+                }
+            }
+            if (c < low || c > high) {
+                put_cast(replacement, 3);
+                cast_file.partial_needed = 0;
+                continue; /* `c' may start another sequence */
+            }
+            cast_file.partial[cast_file.partial_length++] = c;
+            data++, length--;
+            if (cast_file.partial_length == cast_file.partial_needed) {
+                put_cast(cast_file.partial, cast_file.partial_length);
+                cast_file.partial_needed = 0;
+            }
+            continue;
+        }
+
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+            size_t run = 1;
+            while (run < length && data[run] >= 0x20 && data[run] < 0x80 &&
+                    data[run] != '"' && data[run] != '\\')
+                run++;
+            reserve_cast(1);
+            size_t space = CAST_OUTPUT_SIZE - cast_file.output_length;
+            if (run > space)
+                run = space;
+            put_cast(data, run);
+            data += run, length -= run;
+            continue;
+        }
+
+        data++, length--;
+        if (c >= 0x80) {
+            cast_file.partial[0] = c;
+            cast_file.partial_length = 1;
+            if (c >= 0xC2 && c <= 0xDF)
+                cast_file.partial_needed = 2;
+            else if (c >= 0xE0 && c <= 0xEF)
+                cast_file.partial_needed = 3;
+            else if (c >= 0xF0 && c <= 0xF4)
+                cast_file.partial_needed = 4;
+            else
+                put_cast(replacement, 3);
+            continue;
+        }
+        char escape[8];
+        switch (c) {
+        case '"':  put_cast("\\\"", 2); break;
+        case '\\': put_cast("\\\\", 2); break;
+        case '\b': put_cast("\\b", 2);  break;
+        case '\f': put_cast("\\f", 2);  break;
+        case '\n': put_cast("\\n", 2);  break;
+        case '\r': put_cast("\\r", 2);  break;
+        case '\t': put_cast("\\t", 2);  break;
+        default:
+            snprintf(escape, sizeof escape, "\\u%04x", c);
+            put_cast(escape, 6);
+            break;
+        }
+    }
+}
+
+/* Copies queued data starting at `position'. */
+static void copy_from_queue(const struct queue_T *queue, size_t position,
+        void *to, size_t length) {
+    size_t start = position % queue->size, end = queue->size - start;
+    size_t first = end < length ? end : length;
+    memcpy(to, &queue->data[start], first);
+    memcpy((char *) to + first, queue->data, length - first);
+}
+
+/* Encodes and writes the queued events up to `head'. */
+static void drain_cast(size_t head, bool final) {
+    struct queue_T *queue = &cast_file.queue;
+    size_t tail = queue->tail;
+    while (tail != head) {
+        struct cast_event_T event;
+        copy_from_queue(queue, tail, &event, sizeof event);
+        tail += sizeof event;
+
+        char prefix[48];
+        int length = snprintf(prefix, sizeof prefix, "[%.6f, \"%c\", \"",
+                (double) event.time / 1000000, event.type);
+        put_cast(prefix, (size_t) length);
+        size_t start = tail % queue->size, end = queue->size - start;
+        size_t first = end < event.length ? end : event.length;
+        encode_cast((unsigned char *) &queue->data[start], first);
+        encode_cast((unsigned char *) queue->data, event.length - first);
+        put_cast("\"]\n", 3);
+        tail += event.length;
+        store_shared(&queue->tail, tail);
+    }
+    (void) final;
+    flush_cast();
+}
+
+/* Creates the file and writes the header. The size of the pseudo-terminal
+ * must have been set. */
+static void open_cast(int master_fd) {
+    cast_file.fd = open(options.cast_path, O_WRONLY | O_CREAT | O_TRUNC,
+            0666);
+    if (cast_file.fd < 0)
+        errno_exit(options.cast_path);
+    set_cloexec(cast_file.fd);
+    cast_file.failed = false;
+    cast_file.output = xrealloc(NULL, CAST_OUTPUT_SIZE, 1);
+    cast_file.output_length = 0;
+    cast_file.partial_needed = 0;
+
+    unsigned width = 80, height = 24;
+#if defined(TIOCGWINSZ)
+    struct winsize size;
+    if (ioctl(master_fd, TIOCGWINSZ, &size) == 0 &&
+            size.ws_col > 0 && size.ws_row > 0)
+        width = size.ws_col, height = size.ws_row;
+#endif /* defined(TIOCGWINSZ) */
+    char header[128];
+    int length = snprintf(header, sizeof header,
+            "{\"version\": 2, \"width\": %u, \"height\": %u, "
+            "\"timestamp\": %lld}\n",
+            width, height, (long long) time(NULL));
+    put_cast(header, (size_t) length);
+    flush_cast();
+
+    size_t queue_size = options.buffer_size * 2 > CAST_MIN_QUEUE_SIZE ?
+        options.buffer_size * 2 : CAST_MIN_QUEUE_SIZE;
+    cast_file.queue.batch = CAST_BATCH;
+    cast_file.queue.interval = CAST_INTERVAL;
+    cast_file.start_time = current_time();
+    start_queue(&cast_file.queue, queue_size, sizeof (uint64_t), drain_cast);
+    cast_file.started = true;
+}
+
+/* Queues an event with the first `length' bytes of up to two iovecs. */
+static void append_cast(int type, const struct iovec iov[], int count,
+        size_t length, uint64_t now) {
+    assert(count <= 2);
+    if (length > UINT32_MAX)
+        return;
+    struct cast_event_T event = {
+        .time = now > cast_file.start_time ? now - cast_file.start_time : 0,
+        .length = (uint32_t) length,
+        .type = (char) type,
+    };
+    struct iovec parts[3] = {
+        { .iov_base = &event, .iov_len = sizeof event, },
+    };
+    for (int i = 0; i < count; i++)
+        parts[i + 1] = iov[i];
+    append_queue(&cast_file.queue, parts, count + 1, sizeof event + length);
+}
+
+static void cast_resize(unsigned short columns, unsigned short rows) {
+    char size[16];
+    int length = snprintf(size, sizeof size, "%ux%u", columns, rows);
+    struct iovec iov = { .iov_base = size, .iov_len = (size_t) length };
+    append_cast(RECORD_RESIZE, &iov, 1, (size_t) length, current_time());
+}
+
+/* Writes the rest of the events and closes the file. */
+static void close_cast(void) {
+    stop_queue(&cast_file.queue);
+    if (!cast_file.failed)
+        close(cast_file.fd);
+    free(cast_file.output);
+    if (cast_file.queue.dropped > 0)
+        fprintf(stderr, "%s: %s: %llu bytes of events dropped\n",
+                program_name, options.cast_path,
+                (unsigned long long) cast_file.queue.dropped);
+}
+
+/* Screen model (--screen). The output is parsed as by a VT100-compatible
+ * terminal into a grid of cells, so that what is on the screen can be
+ * written out on SIGUSR2 without replaying the output. As with --asciicast,
+ * the forwarding thread only queues the output, and a separate thread
+ * parses it, so that forwarding is never blocked: the model falls behind
+ * under load and catches up later. If the queue overflows, the output that
+ * did not fit is lost to the model until the screen is redrawn. A snapshot
+ * request is queued behind the output, so a snapshot shows the screen as of
+ * the request.
+ *
+ * The grid is a single array of code points, one per cell. Each row that
+ * changes is marked dirty, and a snapshot only renders the dirty rows
+ * again; the other rows are kept rendered as UTF-8 text. Every character is
+ * assumed to take a single cell. Attributes such as colors are not kept,
+ * and the alternate screen is modeled by clearing the screen. */
+#define SCREEN_MIN_QUEUE_SIZE (1024 * 1024)
+#define SCREEN_BATCH (16 * 1024)
+#define SCREEN_INTERVAL 20000
+#define SCREEN_MAX_PARAMS 16
+#define SCREEN_TAB_WIDTH 8
+
+enum { SCREEN_SNAPSHOT = 's', }; /* besides RECORD_OUTPUT and RECORD_RESIZE */
+
+/* An event in the queue, followed by its data */
+struct screen_event_T {
+    uint32_t length;
+    char type;
+};
+
+static struct screen_T {
+    bool started;
+    int diff_fd; /* the --screen-diff file, or -1 */
+    unsigned columns, rows;
+    uint32_t *codes; /* rows * columns code points */
+    bool *dirty; /* per row, since the last snapshot */
+    char *text; /* rows * columns * 4 bytes of rendered rows */
+    size_t *text_length; /* per row */
+    char *output; /* a snapshot being written */
+    unsigned x, y, saved_x, saved_y;
+    bool wrap_pending; /* the next character goes to the next line */
+    unsigned top, bottom; /* the scrolling region */
+    enum {
+        SCREEN_GROUND, SCREEN_ESCAPE, SCREEN_CHARSET, SCREEN_CSI,
+        SCREEN_STRING,
+    } state;
+    unsigned params[SCREEN_MAX_PARAMS];
+    size_t param_count;
+    char private_marker;
+    uint32_t code; /* of a UTF-8 sequence being decoded */
+    int needed; /* continuation bytes still expected */
+    struct queue_T queue;
+} screen;
+
+/* Sets the size of the grid, keeping the top left of what is on it. */
+static void resize_screen(unsigned columns, unsigned rows) {
+    if (columns == 0 || rows == 0)
+        return;
+    uint32_t *codes = xrealloc(NULL, (size_t) columns * rows, sizeof *codes);
+    for (size_t i = 0; i < (size_t) columns * rows; i++)
+        codes[i] = ' ';
+    for (unsigned y = 0; y < rows && y < screen.rows; y++)
+        memcpy(&codes[(size_t) y * columns],
+                &screen.codes[(size_t) y * screen.columns],
+                (columns < screen.columns ? columns : screen.columns) *
+                sizeof *codes);
+    free(screen.codes);
+    screen.codes = codes;
+    screen.columns = columns;
+    screen.rows = rows;
+
+    screen.dirty = xrealloc(screen.dirty, rows, sizeof *screen.dirty);
+    for (unsigned y = 0; y < rows; y++)
+        screen.dirty[y] = true;
+    screen.text = xrealloc(screen.text, (size_t) columns * rows, 4);
+    screen.text_length =
+        xrealloc(screen.text_length, rows, sizeof *screen.text_length);
+    screen.output = xrealloc(screen.output, ((size_t) columns * 4 + 16),
+            rows);
+    if (screen.x >= columns)
+        screen.x = columns - 1;
+    if (screen.y >= rows)
+        screen.y = rows - 1;
+    screen.saved_x = screen.saved_y = 0;
+    screen.wrap_pending = false;
+    screen.top = 0;
+    screen.bottom = rows - 1;
+}
+
+static uint32_t *screen_cell(unsigned x, unsigned y) {
+    return &screen.codes[(size_t) y * screen.columns + x];
+}
+
+/* Blanks the cells from x0 to x1 (exclusive) of row y. */
+static void erase_cells(unsigned y, unsigned x0, unsigned x1) {
+    if (x1 > screen.columns)
+        x1 = screen.columns;
+    for (unsigned x = x0; x < x1; x++)
+        *screen_cell(x, y) = ' ';
+    screen.dirty[y] = true;
+}
+
+static void erase_rows(unsigned y0, unsigned y1) {
+    for (unsigned y = y0; y < y1 && y < screen.rows; y++)
+        erase_cells(y, 0, screen.columns);
+}
+
+/* Scrolls rows y0 to bottom of the scrolling region up by n rows, or down
+ * if n is negative. */
+static void scroll_rows(unsigned y0, int n) {
+    unsigned bottom = screen.bottom + 1;
+    if (y0 >= bottom)
+        return;
+    unsigned count = (unsigned) (n < 0 ? -n : n);
+    if (count > bottom - y0)
+        count = bottom - y0;
+    size_t row = screen.columns * sizeof *screen.codes;
+    size_t moved = (size_t) (bottom - y0 - count) * row;
+    if (n > 0) {
+        memmove(screen_cell(0, y0), screen_cell(0, y0 + count), moved);
+        erase_rows(bottom - count, bottom);
+    } else {
+        memmove(screen_cell(0, y0 + count), screen_cell(0, y0), moved);
+        erase_rows(y0, y0 + count);
+    }
+    for (unsigned y = y0; y < bottom; y++)
+        screen.dirty[y] = true;
+}
+
+static void line_feed(void) {
+    screen.wrap_pending = false;
+    if (screen.y == screen.bottom)
+        scroll_rows(screen.top, 1);
+    else if (screen.y + 1 < screen.rows)
+        screen.y++;
+}
+
+static void reverse_line_feed(void) {
+    screen.wrap_pending = false;
+    if (screen.y == screen.top)
+        scroll_rows(screen.top, -1);
+    else if (screen.y > 0)
+        screen.y--;
+}
+
+static void put_screen_char(uint32_t code) {
+    if (screen.wrap_pending) {
+        screen.x = 0;
+        line_feed();
+    }
+    *screen_cell(screen.x, screen.y) = code;
+    screen.dirty[screen.y] = true;
+    if (screen.x + 1 < screen.columns)
+        screen.x++;
+    else
+        screen.wrap_pending = true;
+}
+
+/* Moves the cursor, keeping it on the screen. */
+static void move_cursor(long x, long y) {
+    screen.x = x < 0 ? 0 : x >= (long) screen.columns ?
+        screen.columns - 1 : (unsigned) x;
+    screen.y = y < 0 ? 0 : y >= (long) screen.rows ?
+        screen.rows - 1 : (unsigned) y;
+    screen.wrap_pending = false;
+}
+
+static void execute_control(unsigned char c) {
+    switch (c) {
+    case '\r':
+        move_cursor(0, screen.y);
+        break;
+    case '\n': case '\v': case '\f':
+        line_feed();
+        break;
+    case '\b':
+        if (screen.x > 0)
+            move_cursor(screen.x - 1, screen.y);
+        break;
+    case '\t':
+        move_cursor((screen.x / SCREEN_TAB_WIDTH + 1) * SCREEN_TAB_WIDTH,
+                screen.y);
+        break;
+    }
+}
+
+static void execute_escape(unsigned char c) {
+    screen.state = SCREEN_GROUND;
+    switch (c) {
+    case '[':
+        screen.state = SCREEN_CSI;
+        screen.param_count = 0;
+        screen.params[0] = 0;
+        screen.private_marker = '\0';
+        break;
+    case ']': case 'P': case 'X': case '^': case '_':
+        screen.state = SCREEN_STRING;
+        break;
+    case '(': case ')': case '*': case '+': case '#':
+        screen.state = SCREEN_CHARSET; /* ignore the next byte */
+        break;
+    case '7':
+        screen.saved_x = screen.x, screen.saved_y = screen.y;
+        break;
+    case '8':
+        move_cursor(screen.saved_x, screen.saved_y);
+        break;
+    case 'D':
+        line_feed();
+        break;
+    case 'E':
+        move_cursor(0, screen.y);
+        line_feed();
+        break;
+    case 'M':
+        reverse_line_feed();
+        break;
+    case 'c':
+        move_cursor(0, 0);
+        screen.top = 0;
+        screen.bottom = screen.rows - 1;
+        erase_rows(0, screen.rows);
+        break;
+    }
+}
+
+/* Returns parameter i, or `default_value' if it is missing or 0. */
+static unsigned screen_param(size_t i, unsigned default_value) {
+    return i < screen.param_count && screen.params[i] > 0 ?
+        screen.params[i] : default_value;
+}
+
+static void execute_csi(unsigned char c) {
+    screen.state = SCREEN_GROUND;
+    unsigned n = screen_param(0, 1);
+    long x = screen.x, y = screen.y;
+    if (screen.private_marker == '?') {
+        unsigned mode = screen_param(0, 0);
+        if ((c == 'h' || c == 'l') &&
+                (mode == 47 || mode == 1047 || mode == 1049)) {
+            if (mode == 1049 && c == 'h')
+                screen.saved_x = screen.x, screen.saved_y = screen.y;
+            erase_rows(0, screen.rows);
+            if (mode == 1049 && c == 'l')
+                move_cursor(screen.saved_x, screen.saved_y);
+        }
+        return;
+    }
+    if (screen.private_marker != '\0')
+        return;
+    switch (c) {
+    case 'A': move_cursor(x, y - n);                     break;
+    case 'B': case 'e': move_cursor(x, y + n);           break;
+    case 'C': case 'a': move_cursor(x + n, y);           break;
+    case 'D': move_cursor(x - n, y);                     break;
+    case 'E': move_cursor(0, y + n);                     break;
+    case 'F': move_cursor(0, y - n);                     break;
+    case 'G': case '`': move_cursor((long) n - 1, y);    break;
+    case 'd': move_cursor(x, (long) n - 1);              break;
+    case 'H': case 'f':
+        move_cursor((long) screen_param(1, 1) - 1, (long) n - 1);
+        break;
+    case 'J':
+        switch (screen_param(0, 0)) {
+        case 0:
+            erase_cells(screen.y, screen.x, screen.columns);
+            erase_rows(screen.y + 1, screen.rows);
+            break;
+        case 1:
+            erase_rows(0, screen.y);
+            erase_cells(screen.y, 0, screen.x + 1);
+            break;
+        default:
+            erase_rows(0, screen.rows);
+            break;
+        }
+        break;
+    case 'K':
+        switch (screen_param(0, 0)) {
+        case 0:  erase_cells(screen.y, screen.x, screen.columns); break;
+        case 1:  erase_cells(screen.y, 0, screen.x + 1);          break;
+        default: erase_cells(screen.y, 0, screen.columns);        break;
+        }
+        break;
+    case 'X':
+        erase_cells(screen.y, screen.x, screen.x + n);
+        break;
+    case '@': case 'P': {
+        /* Insert or delete characters, shifting the rest of the row */
+        unsigned count = screen.columns - screen.x;
+        if (n > count)
+            n = count;
+        uint32_t *cell = screen_cell(screen.x, screen.y);
+        if (c == '@')
+            memmove(&cell[n], cell, (count - n) * sizeof *cell);
+        else
+            memmove(cell, &cell[n], (count - n) * sizeof *cell);
+        erase_cells(screen.y, c == '@' ? screen.x : screen.columns - n,
+                c == '@' ? screen.x + n : screen.columns);
+        break;
+    }
+    case 'L': case 'M':
+        if (screen.y >= screen.top && screen.y <= screen.bottom)
+            scroll_rows(screen.y, c == 'L' ? -(int) n : (int) n);
+        break;
+    case 'S': scroll_rows(screen.top, (int) n);  break;
+    case 'T': scroll_rows(screen.top, -(int) n); break;
+    case 'r': {
+        unsigned top = screen_param(0, 1) - 1;
+        unsigned bottom = screen_param(1, screen.rows) - 1;
+        if (bottom >= screen.rows)
+            bottom = screen.rows - 1;
+        if (top < bottom) {
+            screen.top = top;
+            screen.bottom = bottom;
+            move_cursor(0, 0);
+        }
+        break;
+    }
+    case 's':
+        screen.saved_x = screen.x, screen.saved_y = screen.y;
+        break;
+    case 'u':
+        move_cursor(screen.saved_x, screen.saved_y);
+        break;
+    }
+}
+
+static void feed_screen(unsigned char c) {
+    switch (screen.state) {
+    case SCREEN_GROUND:
+        break;
+    case SCREEN_ESCAPE:
+        execute_escape(c);
+        return;
+    case SCREEN_CHARSET:
+        screen.state = SCREEN_GROUND;
+        return;
+    case SCREEN_CSI:
+        if (c >= '0' && c <= '9') {
+            if (screen.param_count == 0)
+                screen.param_count = 1;
+            unsigned *param = &screen.params[screen.param_count - 1];
+            if (*param < 10000)
+                *param = *param * 10 + (c - '0');
+        } else if (c == ';') {
+            if (screen.param_count == 0)
+                screen.param_count = 1;
+            if (screen.param_count < SCREEN_MAX_PARAMS)
+                screen.params[screen.param_count++] = 0;
+        } else if (c >= '<' && c <= '?') {
+            screen.private_marker = (char) c;
+        } else if (c >= 0x40 && c <= 0x7e) {
+            execute_csi(c);
+        } else if (c == 0x1b) {
+            screen.state = SCREEN_ESCAPE;
+        } else if (c < 0x20) {
+            execute_control(c);
+        }
+        return;
+    case SCREEN_STRING:
+        /* Ended by BEL or ST (ESC \), whose backslash is ignored */
+        if (c == 0x07)
+            screen.state = SCREEN_GROUND;
+        else if (c == 0x1b)
+            screen.state = SCREEN_ESCAPE;
+        return;
+    }
+
+    if (c >= 0x80) {
+        if (c >= 0xc0 || screen.needed == 0) {
+            /* The start of a sequence. A stray continuation byte is the
+             * replacement character. */
+            screen.needed = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+            screen.code = c & (0x3f >> screen.needed);
+            if (screen.needed == 0)
+                put_screen_char(0xfffd);
+        } else {
+            screen.code = screen.code << 6 | (c & 0x3f);
+            if (--screen.needed == 0)
+                put_screen_char(screen.code);
+        }
+        return;
+    }
+    screen.needed = 0;
+    if (c == 0x1b)
+        screen.state = SCREEN_ESCAPE;
+    else if (c < 0x20 || c == 0x7f)
+        execute_control(c);
+    else
+        put_screen_char(c);
+}
+
+static size_t put_utf8(char *p, uint32_t code) {
+    if (code < 0x80) {
+        p[0] = (char) code;
+        return 1;
+    }
+    if (code < 0x800) {
+        p[0] = (char) (0xc0 | code >> 6);
+        p[1] = (char) (0x80 | (code & 0x3f));
+        return 2;
+    }
+    if (code < 0x10000) {
+        p[0] = (char) (0xe0 | code >> 12);
+        p[1] = (char) (0x80 | (code >> 6 & 0x3f));
+        p[2] = (char) (0x80 | (code & 0x3f));
+        return 3;
+    }
+    p[0] = (char) (0xf0 | (code >> 18 & 0x07));
+    p[1] = (char) (0x80 | (code >> 12 & 0x3f));
+    p[2] = (char) (0x80 | (code >> 6 & 0x3f));
+    p[3] = (char) (0x80 | (code & 0x3f));
+    return 4;
+}
+
+/* Renders row y as UTF-8 text without trailing blanks. */
+static void render_row(unsigned y) {
+    char *text = &screen.text[(size_t) y * screen.columns * 4];
+    size_t length = 0, end = 0;
+    for (unsigned x = 0; x < screen.columns; x++) {
+        uint32_t code = *screen_cell(x, y);
+        length += put_utf8(&text[length], code);
+        if (code != ' ')
+            end = length;
+    }
+    screen.text_length[y] = end;
+}
+
+static void screen_error(const char *message) {
+    fprintf(stderr, "%s: %s: %s: %s\n", program_name, message,
+            options.screen_path, strerror(errno));
+}
+
+/* Writes what is on the screen. The whole screen replaces the --screen
+ * file, or the dirty rows are appended to it with --screen-diff. Only the
+ * dirty rows are rendered. */
+static void write_snapshot(void) {
+    size_t length = 0;
+    for (unsigned y = 0; y < screen.rows; y++) {
+        bool dirty = screen.dirty[y];
+        if (dirty) {
+            render_row(y);
+            screen.dirty[y] = false;
+        } else if (screen.diff_fd >= 0) {
+            continue;
+        }
+        if (screen.diff_fd >= 0)
+            length += (size_t) sprintf(&screen.output[length], "%u ", y + 1);
+        memcpy(&screen.output[length],
+                &screen.text[(size_t) y * screen.columns * 4],
+                screen.text_length[y]);
+        length += screen.text_length[y];
+        screen.output[length++] = '\n';
+    }
+
+    if (screen.diff_fd >= 0) {
+        screen.output[length++] = '\n';
+        if (!write_all(screen.diff_fd, screen.output, length))
+            screen_error("cannot write to");
+        return;
+    }
+    /* Replace the file at once so that no reader sees a partial
+     * snapshot. */
+    size_t path_length = strlen(options.screen_path);
+    char *temporary = xrealloc(NULL, path_length + 5, 1);
+    memcpy(temporary, options.screen_path, path_length);
+    strcpy(&temporary[path_length], ".tmp");
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0666);
+    if (fd < 0) {
+        screen_error("cannot create snapshot of");
+    } else {
+        bool written = write_all(fd, screen.output, length);
+        if (close(fd) < 0 || !written ||
+                rename(temporary, options.screen_path) < 0)
+            screen_error("cannot write to");
+    }
+    free(temporary);
+}
+
+/* Parses the queued output up to `head'. A final snapshot is written when
+ * the command has exited. */
+static void drain_screen(size_t head, bool final) {
+    struct queue_T *queue = &screen.queue;
+    size_t tail = queue->tail;
+    while (tail != head) {
+        struct screen_event_T event;
+        copy_from_queue(queue, tail, &event, sizeof event);
+        tail += sizeof event;
+        if (event.type == RECORD_OUTPUT) {
+            for (uint32_t i = 0; i < event.length; i++)
+                feed_screen((unsigned char)
+                        queue->data[(tail + i) % queue->size]);
+        } else if (event.type == RECORD_RESIZE) {
+            unsigned char size[4];
+            copy_from_queue(queue, tail, size, sizeof size);
+            resize_screen((unsigned) get_le(size, 2),
+                    (unsigned) get_le(&size[2], 2));
+        } else if (event.type == SCREEN_SNAPSHOT) {
+            write_snapshot();
+        }
+        tail += event.length;
+        store_shared(&queue->tail, tail);
+    }
+    if (final)
+        write_snapshot();
+}
+
+/* Starts the model with the size of the pseudo-terminal, which must have
+ * been set. */
+static void open_screen(int master_fd) {
+    screen.diff_fd = -1;
+    if (options.screen_diff) {
+        screen.diff_fd = open(options.screen_path,
+                O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+        if (screen.diff_fd < 0)
+            errno_exit(options.screen_path);
+        set_cloexec(screen.diff_fd);
+    }
+    unsigned width = 80, height = 24;
+#if defined(TIOCGWINSZ)
+    struct winsize size;
+    if (ioctl(master_fd, TIOCGWINSZ, &size) == 0 &&
+            size.ws_col > 0 && size.ws_row > 0)
+        width = size.ws_col, height = size.ws_row;
+#endif /* defined(TIOCGWINSZ) */
+    resize_screen(width, height);
+    move_cursor(0, 0);
+
+    size_t queue_size = options.buffer_size * 2 > SCREEN_MIN_QUEUE_SIZE ?
+        options.buffer_size * 2 : SCREEN_MIN_QUEUE_SIZE;
+    screen.queue.batch = SCREEN_BATCH;
+    screen.queue.interval = SCREEN_INTERVAL;
+    start_queue(&screen.queue, queue_size, sizeof (uint64_t), drain_screen);
+    screen.started = true;
+}
+
+/* Queues an event with the first `length' bytes of up to two iovecs.
+ * Returns false if it has been dropped. */
+static bool append_screen(int type, const struct iovec iov[], int count,
+        size_t length) {
+    assert(count <= 2);
+    if (length > UINT32_MAX)
+        return false;
+    struct screen_event_T event = {
+        .length = (uint32_t) length, .type = (char) type,
+    };
+    struct iovec parts[3] = {
+        { .iov_base = &event, .iov_len = sizeof event, },
+    };
+    for (int i = 0; i < count; i++)
+        parts[i + 1] = iov[i];
+    uint64_t dropped = screen.queue.dropped;
+    append_queue(&screen.queue, parts, count + 1, sizeof event + length);
+    return screen.queue.dropped == dropped;
+}
+
+static void screen_resize(unsigned short columns, unsigned short rows) {
+    unsigned char size[4];
+    put_le(size, columns, 2);
+    put_le(&size[2], rows, 2);
+    struct iovec iov = { .iov_base = size, .iov_len = sizeof size };
+    append_screen(RECORD_RESIZE, &iov, 1, sizeof size);
+}
+
+/* Requests a snapshot for SIGUSR2. If the queue is full, the request is
+ * retried in the next iteration. */
+static void request_snapshot(void) {
+    if (!append_screen(SCREEN_SNAPSHOT, NULL, 0, 0))
+        return;
+    should_snapshot_screen = false;
+#if !defined(USE_THREADS)
+    drain_screen(screen.queue.head, false);
+#endif /* !defined(USE_THREADS) */
+}
+
+/* Parses the rest of the output, writes the final snapshot, and frees the
+ * model. */
+static void close_screen(void) {
+    stop_queue(&screen.queue);
+    if (screen.diff_fd >= 0)
+        close(screen.diff_fd);
+    free(screen.codes);
+    free(screen.dirty);
+    free(screen.text);
+    free(screen.text_length);
+    free(screen.output);
+    if (screen.queue.dropped > 0)
+        fprintf(stderr, "%s: %s: %llu bytes of output dropped\n",
+                program_name, options.screen_path,
+                (unsigned long long) screen.queue.dropped);
+}
+
+#define DEFAULT_COLUMNS 80
+#define DEFAULT_ROWS 24
+
+/* The terminal whose window size the pseudo-terminal follows, or -1 if
+ * there is none, as in the headless mode and in --host while no client is
+ * attached. */
+static int terminal_fd = STDOUT_FILENO;
+
+/* Sets the window size of the pseudo-terminal to that of terminal_fd,
+ * overridden by --cols and --rows. Without terminal_fd, the size defaults
+ * to 80 by 24. */
+static void set_terminal_size(int fd) {
+#if defined(TIOCGWINSZ) && defined(TIOCSWINSZ)
+    struct winsize size;
+    if (terminal_fd < 0 || ioctl(terminal_fd, TIOCGWINSZ, &size) < 0) {
+        if (terminal_fd >= 0 && options.columns == 0 && options.rows == 0)
+            return;
+        memset(&size, 0, sizeof size);
+        size.ws_col = DEFAULT_COLUMNS;
+        size.ws_row = DEFAULT_ROWS;
+    }
+    if (options.columns > 0)
+        size.ws_col = options.columns;
+    if (options.rows > 0)
+        size.ws_row = options.rows;
+    /* Don't make the command redraw if the size has not changed. */
+    struct winsize current;
+    if (ioctl(fd, TIOCGWINSZ, &current) == 0 &&
+            current.ws_col == size.ws_col && current.ws_row == size.ws_row &&
+            current.ws_xpixel == size.ws_xpixel &&
+            current.ws_ypixel == size.ws_ypixel)
+        return;
+    ioctl(fd, TIOCSWINSZ, &size);
+    if (options.record_path != NULL)
+        record_resize(size.ws_col, size.ws_row);
+    if (cast_file.started)
+        cast_resize(size.ws_col, size.ws_row);
+    if (screen.started)
+        screen_resize(size.ws_col, size.ws_row);
+#endif /* defined(TIOCGWINSZ) && defined(TIOCSWINSZ) */
+}
+
+/* With --resize-debounce, a change of the window size is propagated at most
+ * once per window: immediately if the size has not been propagated within
+ * the window, or else at the end of the window with the latest size. */
+static bool resize_pending = false;
+static uint64_t resize_time; /* when the size was last propagated */
+
+/* Returns true if the window size should be propagated now. */
+static bool take_resize(uint64_t now) {
+    if (should_set_terminal_size) {
+        should_set_terminal_size = false;
+        resize_pending = true;
+    }
+    if (!resize_pending || now - resize_time < options.resize_debounce)
+        return false;
+    resize_pending = false;
+    resize_time = now;
+    return true;
+}
+
+/* Returns the time in microseconds until a pending resize is due, or -1 if
+ * there is none. */
+static int64_t resize_timeout(uint64_t now) {
+    if (!resize_pending)
+        return -1;
+    uint64_t due = resize_time + options.resize_debounce;
+    return due > now ? (int64_t) (due - now) : 0;
+}
+
+/* Returns the shorter of two timeouts, either of which may be -1. */
+static int64_t earlier_timeout(int64_t a, int64_t b) {
+    return a < 0 || (b >= 0 && b < a) ? b : a;
+}
+
+#define ARRIVAL_CAPACITY 32
+
+/* A channel forwards data from one file descriptor to another. It reads
+ * whenever the buffer has free space and writes whenever the buffer has
+ * data, so a slow writer does not hold back reading until the buffer is
+ * full. */
+struct channel_T {
+    struct watch_T *from, *to;
+    bool readable; /* false after the end of input */
+    int eof_char; /* written after the end of input, or -1 */
+    bool partial_line; /* the last byte buffered did not end a line */
+    struct ring_T buffer;
+    /* If buffer_limit is not 0, the buffer is elastic: it grows up to the
+     * limit while reads fill it and shrinks when it becomes empty. The peak
+     * is the most data buffered since it was last empty. */
+    size_t buffer_limit, peak;
+    /* When coalescing, buffered data are not written until the budget is
+     * reached or the window has passed since the oldest of them was read. */
+    uint64_t coalesce_window, flush_time;
+    size_t coalesce_budget;
+    bool flushing;
+    bool tee; /* whether output is copied to the --tee file */
+    /* If strip_ansi is true, escape sequences are removed from the data as
+     * they are read. The state persists between reads so that sequences
+     * split across reads are removed as well. */
+    bool strip_ansi;
+    /* If drain is true, both fds are non-blocking, and the channel reads and
+     * writes repeatedly until they would block or DRAIN_ROUNDS is reached,
+     * rather than once per wakeup. */
+    bool drain;
+    struct stamper_T *stamper; /* non-NULL if lines are timestamped */
+    struct paste_T *paste; /* non-NULL if bracketed pastes are tracked */
+    /* If detach_char is not negative, the channel stops reading at it, and
+     * it and the rest of the read are discarded. */
+    int detach_char;
+    int record; /* the type of records of the data read, or -1 */
+    bool cast; /* whether output is written to the --asciicast file */
+    bool screen; /* whether output is fed to the --screen model */
+    /* If trigger is true, the data are scanned for the --trigger patterns.
+     * The state of the matcher persists between reads so that patterns
+     * split across reads are found as well. */
+    bool trigger;
+    struct channel_T *reply; /* takes the text of send triggers, or NULL */
+    uint32_t trigger_state; /* the row of the state in the transitions */
+    uint64_t trigger_offset; /* the number of bytes scanned */
+    size_t write_limit; /* the most bytes written at a time */
+    /* If the rate is not 0, reads are limited by a token bucket: a byte
+     * read takes a token, and tokens are added at the rate up to the burst
+     * size. While there are too few tokens, the source is not read, so the
+     * writer is held back by the full pseudo-terminal or pipe. */
+    struct bucket_T {
+        size_t rate, burst, tokens;
+        uint64_t time; /* when tokens were last added */
+    } bucket;
+    int overflow; /* the policy when the buffer is full */
+    uint64_t dropped_pending; /* bytes dropped since the last marker */
+    struct spill_T {
+        int fd; /* -1 until the file is created */
+        char *map;
+        size_t map_size, head, tail; /* head - tail bytes are spilled */
+    } spill;
+    enum {
+        ANSI_GROUND, ANSI_ESCAPE, ANSI_INTERMEDIATE, ANSI_CSI, ANSI_STRING,
+        ANSI_STRING_ESCAPE,
+    } ansi_state;
+    struct channel_stats_T *stats;
+    uint64_t full_since; /* time the buffer became full, or 0 */
+    /* If latency is non-NULL, the arrival times of buffered chunks are
+     * recorded so that their latency can be added to the histogram when
+     * they have been written. Chunks are not sampled while the queue is
+     * full. */
+    uint64_t *latency;
+    struct arrival_T {
+        size_t position; /* the head of the buffer after the chunk */
+        uint64_t time;
+    } arrivals[ARRIVAL_CAPACITY];
+    size_t arrival_head, arrival_tail;
+#if defined(USE_SPLICE)
+    /* When splicing, data bypass the buffer. In the SPLICE_PIPE mode, data
+     * are spliced through an intermediate pipe. */
+    enum { SPLICE_NONE, SPLICE_DIRECT, SPLICE_PIPE, } splice;
+    bool splice_blocked; /* the destination pipe is full */
+    int pipe_fds[2];
+    size_t pipe_length, pipe_size;
+#endif /* defined(USE_SPLICE) */
+};
+
+static void init_channel(struct channel_T *channel,
+        struct watch_T *from, struct watch_T *to,
+        struct channel_stats_T *stats) {
+    channel->from = from;
+    channel->to = to;
+    channel->readable = true;
+    channel->eof_char = channel->detach_char = -1;
+    channel->partial_line = false;
+    init_ring(&channel->buffer, options.buffer_size);
+    channel->buffer_limit = channel->peak = 0;
+    channel->coalesce_window = 0;
+    channel->flushing = false;
+    channel->tee = false;
+    channel->strip_ansi = false;
+    channel->drain = false;
+    channel->stamper = NULL;
+    channel->paste = NULL;
+    channel->record = -1;
+    channel->cast = false;
+    channel->screen = false;
+    channel->trigger = false;
+    channel->reply = NULL;
+    channel->trigger_state = 0;
+    channel->trigger_offset = 0;
+    channel->write_limit = SIZE_MAX;
+    channel->bucket.rate = 0;
+    channel->overflow = OVERFLOW_BLOCK;
+    channel->dropped_pending = 0;
+    channel->spill.fd = -1;
+    channel->spill.map = NULL;
+    channel->spill.map_size = channel->spill.head = channel->spill.tail = 0;
+    channel->ansi_state = ANSI_GROUND;
+    channel->stats = stats;
+    channel->full_since = 0;
+    channel->latency = NULL;
+    channel->arrival_head = channel->arrival_tail = 0;
+#if defined(USE_SPLICE)
+    channel->splice = SPLICE_NONE;
+    channel->pipe_length = 0;
+#endif /* defined(USE_SPLICE) */
+}
+
+/* Elastic buffers. Most sessions are idle most of the time, so a full
+ * --buffer-size for each direction of each of them is mostly wasted. An
+ * elastic buffer starts small and doubles whenever a read fills it, up to
+ * --buffer-size. Whenever it becomes empty, it shrinks to twice the most
+ * it has held since it was last empty, so sustained transfers keep their
+ * buffer, while a session that has gone back to a prompt after a burst
+ * returns the memory to the allocator for other sessions to use. */
+
+#define ELASTIC_BUFFER_MIN (4 * 1024)
+
+/* Makes the buffer of a new channel elastic. */
+static void make_elastic(struct channel_T *channel) {
+    free(channel->buffer.data);
+    init_ring(&channel->buffer, options.buffer_size < ELASTIC_BUFFER_MIN ?
+            options.buffer_size : ELASTIC_BUFFER_MIN);
+    channel->buffer_limit = options.buffer_size;
+}
+
+/* Grows an elastic buffer that has become full. */
+static void grow_buffer(struct channel_T *channel) {
+    struct ring_T *buffer = &channel->buffer;
+    if (ring_length(buffer) > channel->peak)
+        channel->peak = ring_length(buffer);
+    if (buffer->size >= channel->buffer_limit || ring_space(buffer) > 0)
+        return;
+    resize_ring(buffer, buffer->size * 2 < channel->buffer_limit ?
+            buffer->size * 2 : channel->buffer_limit);
+}
+
+/* Shrinks an elastic buffer that has become empty. */
+static void shrink_buffer(struct channel_T *channel) {
+    struct ring_T *buffer = &channel->buffer;
+    size_t size = ELASTIC_BUFFER_MIN;
+    while (size < channel->peak * 2 && size < buffer->size)
+        size *= 2;
+    /* The limit may have been lowered over the control socket. */
+    if (size > channel->buffer_limit)
+        size = channel->buffer_limit;
+    if (size < buffer->size)
+        resize_ring(buffer, size);
+    channel->peak = 0;
+}
+
+#if defined(USE_SPLICE)
+
+/* Makes the channel splice data without copying them to user space if the
+ * destination is a pipe or socket. */
+static void enable_splice(struct channel_T *channel) {
+    struct stat st;
+    if (options.no_splice || options.io_uring ||
+            channel->coalesce_window > 0 || channel->tee ||
+            channel->strip_ansi || channel->stamper != NULL ||
+            channel->overflow != OVERFLOW_BLOCK || channel->record >= 0 ||
+            channel->cast || channel->screen || channel->trigger ||
+            channel->write_limit != SIZE_MAX || channel->bucket.rate > 0 ||
+            options.control_path != NULL || fstat(channel->to->fd, &st) < 0)
+        return;
+    if (S_ISFIFO(st.st_mode)) {
+        channel->splice = SPLICE_DIRECT;
+        channel->splice_blocked = false;
+    } else if (S_ISSOCK(st.st_mode)) {
+        if (pipe2(channel->pipe_fds, O_CLOEXEC) < 0)
+            return;
+        fcntl(channel->pipe_fds[1], F_SETPIPE_SZ, (int) options.buffer_size);
+        int size = fcntl(channel->pipe_fds[1], F_GETPIPE_SZ);
+        channel->pipe_size = size > 0 ? (size_t) size : PIPE_BUF;
+        channel->splice = SPLICE_PIPE;
+    }
+}
+
+/* Falls back to copying data if splicing is not supported for the fds. */
+static void disable_splice(struct channel_T *channel) {
+    if (channel->splice == SPLICE_PIPE) {
+        close(channel->pipe_fds[0]);
+        close(channel->pipe_fds[1]);
+    }
+    channel->splice = SPLICE_NONE;
+}
+
+static void add_splice_interest(struct channel_T *channel) {
+    switch (channel->splice) {
+    case SPLICE_NONE:
+        break;
+    case SPLICE_DIRECT:
+        if (channel->splice_blocked)
+            channel->to->interest |= EVENT_WRITE;
+        else if (channel->readable)
+            channel->from->interest |= EVENT_READ;
+        break;
+    case SPLICE_PIPE:
+        if (channel->readable && channel->pipe_length < channel->pipe_size)
+            channel->from->interest |= EVENT_READ;
+        if (channel->pipe_length > 0)
+            channel->to->interest |= EVENT_WRITE;
+        break;
+    }
+}
+
+/* Handles the result of splicing from the source. Returns false if splicing
+ * is not supported. */
+static bool check_splice_input(
+        struct channel_T *channel, ssize_t size, uint64_t now) {
+    if (size > 0) {
+        channel->stats->bytes += size;
+        channel->stats->reads++;
+        return true;
+    }
+    if (size == 0) {
+        channel->readable = false;
+        return true;
+    }
+    count_error(channel->stats);
+    switch (errno) {
+    case EINVAL:
+        return false;
+    case EAGAIN:
+        channel->splice_blocked = true;
+        channel->full_since = now;
+        break;
+    case EINTR:
+        break;
+    default:
+        channel->readable = false;
+        break;
+    }
+    return true;
+}
+
+/* Moves data by splicing. Returns false if the channel has fallen back to
+ * copying data. */
+static bool process_splice(struct channel_T *channel, uint64_t now) {
+    ssize_t size;
+    switch (channel->splice) {
+    case SPLICE_NONE:
+        return false;
+    case SPLICE_DIRECT:
+        if (channel->splice_blocked) {
+            if (channel->to->ready & EVENT_WRITE) {
+                channel->splice_blocked = false;
+                channel->stats->blocked_time += now - channel->full_since;
+            }
+            break;
+        }
+        if (!channel->readable || !(channel->from->ready & EVENT_READ))
+            break;
+        size = splice(channel->from->fd, NULL, channel->to->fd, NULL,
+                options.buffer_size, SPLICE_F_NONBLOCK);
+        if (!check_splice_input(channel, size, now)) {
+            disable_splice(channel);
+            return false;
+        }
+        if (size > 0)
+            channel->stats->writes++;
+        break;
+    case SPLICE_PIPE:
+        if (channel->readable && (channel->from->ready & EVENT_READ) &&
+                channel->pipe_length < channel->pipe_size) {
+            size = splice(channel->from->fd, NULL, channel->pipe_fds[1], NULL,
+                    channel->pipe_size - channel->pipe_length,
+                    SPLICE_F_NONBLOCK);
+            if (!check_splice_input(channel, size, now)) {
+                disable_splice(channel);
+                return false;
+            }
+            if (size > 0)
+                channel->pipe_length += size;
+        }
+        if ((channel->to->ready & EVENT_WRITE) && channel->pipe_length > 0) {
+            size = splice(channel->pipe_fds[0], NULL, channel->to->fd, NULL,
+                    channel->pipe_length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (size > 0) { /* ignore any error */
+                channel->stats->writes++;
+                if ((size_t) size < channel->pipe_length)
+                    channel->stats->short_writes++;
+                channel->pipe_length -= size;
+            } else if (size < 0) {
+                count_error(channel->stats);
+            }
+        }
+        break;
+    }
+    return true;
+}
+
+#endif /* defined(USE_SPLICE) */
+
+static bool is_active(const struct channel_T *channel) {
+#if defined(USE_SPLICE)
+    if (channel->pipe_length > 0)
+        return true;
+#endif /* defined(USE_SPLICE) */
+    return channel->readable || ring_length(&channel->buffer) > 0 ||
+        channel->spill.head != channel->spill.tail;
+}
+
+static void enable_coalescing(struct channel_T *channel) {
+    channel->coalesce_window = options.coalesce_window;
+    channel->coalesce_budget = options.coalesce_budget;
+}
+
+/* The least time in microseconds waited for tokens, so that a slow rate
+ * does not turn into a read of a few bytes at each wakeup. */
+#define RATE_QUANTUM 20000
+
+static void limit_rate(struct channel_T *channel,
+        size_t rate, size_t burst, uint64_t now) {
+    channel->bucket.rate = rate;
+    channel->bucket.burst = channel->bucket.tokens = burst;
+    channel->bucket.time = now;
+}
+
+/* Returns the tokens the bucket will have at time `now'. */
+static size_t bucket_tokens(const struct bucket_T *bucket, uint64_t now) {
+    size_t needed = bucket->burst - bucket->tokens;
+    uint64_t elapsed = now > bucket->time ? now - bucket->time : 0;
+    if (elapsed > (uint64_t) needed * 1000000 / bucket->rate)
+        return bucket->burst;
+    size_t added = (size_t) (elapsed * bucket->rate / 1000000);
+    return added < needed ? bucket->tokens + added : bucket->burst;
+}
+
+/* Returns the fewest tokens that are worth a read. */
+static size_t bucket_quantum(const struct bucket_T *bucket) {
+    size_t quantum = (size_t) ((uint64_t) bucket->rate * RATE_QUANTUM
+            / 1000000);
+    if (quantum == 0)
+        quantum = 1;
+    return quantum < bucket->burst ? quantum : bucket->burst;
+}
+
+/* Returns how many bytes the channel may read now: 0 while it is waiting
+ * for tokens, or SIZE_MAX if its rate is not limited. */
+static size_t read_allowance(const struct channel_T *channel, uint64_t now) {
+    const struct bucket_T *bucket = &channel->bucket;
+    if (bucket->rate == 0)
+        return SIZE_MAX;
+    size_t tokens = bucket_tokens(bucket, now);
+    return tokens >= bucket_quantum(bucket) ? tokens : 0;
+}
+
+/* Takes the tokens for `size' bytes read. The time advances only by as
+ * much as the tokens added are worth, so that no fraction of a token is
+ * lost. */
+static void take_tokens(struct bucket_T *bucket, size_t size, uint64_t now) {
+    if (bucket->rate == 0)
+        return;
+    size_t tokens = bucket_tokens(bucket, now);
+    if (tokens == bucket->burst)
+        bucket->time = now;
+    else
+        bucket->time += (uint64_t) (tokens - bucket->tokens) * 1000000 /
+            bucket->rate;
+    bucket->tokens = size < tokens ? tokens - size : 0;
+}
+
+/* Returns the time in microseconds until the channel may read again, or -1
+ * if it is not waiting for tokens. */
+static int64_t rate_timeout(const struct channel_T *channel, uint64_t now) {
+    const struct bucket_T *bucket = &channel->bucket;
+    if (bucket->rate == 0 || !channel->readable)
+        return -1;
+    size_t tokens = bucket_tokens(bucket, now);
+    size_t quantum = bucket_quantum(bucket);
+    /* A channel whose interest was set while it lacked tokens must be
+     * processed again once they have come in, as the multiplexed loop
+     * only updates the interest of the sessions it processes. */
+    if (tokens >= quantum)
+        return (channel->from->interest & EVENT_READ) ||
+            (ring_space(&channel->buffer) == 0 &&
+             channel->overflow == OVERFLOW_BLOCK) ? -1 : 0;
+    uint64_t wait = ((uint64_t) (quantum - tokens) * 1000000 +
+            bucket->rate - 1) / bucket->rate;
+    return (int64_t) wait;
+}
+
+/* Returns true if the buffered data should be written now. */
+static bool should_flush(struct channel_T *channel, uint64_t now) {
+    size_t length = ring_length(&channel->buffer);
+    if (length == 0)
+        return channel->flushing = false;
+    if (!channel->flushing)
+        channel->flushing = channel->coalesce_window == 0 ||
+            length >= channel->coalesce_budget ||
+            ring_space(&channel->buffer) == 0 || !channel->readable ||
+            now >= channel->flush_time;
+    return channel->flushing;
+}
+
+/* Returns the time in microseconds until the channel should be flushed or
+ * may read again, or -1 if the channel is waiting for neither the
+ * coalescing window to pass nor tokens. */
+static int64_t channel_timeout(const struct channel_T *channel, uint64_t now) {
+    int64_t timeout = rate_timeout(channel, now);
+    if (channel->coalesce_window == 0 || channel->flushing ||
+            ring_length(&channel->buffer) == 0)
+        return timeout;
+    return earlier_timeout(timeout, channel->flush_time > now ?
+            (int64_t) (channel->flush_time - now) : 0);
+}
+
+static void add_interest(struct channel_T *channel, uint64_t now) {
+#if defined(USE_SPLICE)
+    if (channel->splice != SPLICE_NONE) {
+        add_splice_interest(channel);
+        return;
+    }
+#endif /* defined(USE_SPLICE) */
+    if (channel->readable && (ring_space(&channel->buffer) > 0 ||
+                channel->overflow != OVERFLOW_BLOCK) &&
+            read_allowance(channel, now) > 0)
+        channel->from->interest |= EVENT_READ;
+    if (should_flush(channel, now))
+        channel->to->interest |= EVENT_WRITE;
+}
+
+static void record_arrival(struct channel_T *channel, uint64_t now) {
+    if (channel->latency == NULL ||
+            channel->arrival_head - channel->arrival_tail == ARRIVAL_CAPACITY)
+        return;
+    struct arrival_T *arrival =
+        &channel->arrivals[channel->arrival_head++ % ARRIVAL_CAPACITY];
+    arrival->position = channel->buffer.head;
+    arrival->time = now;
+}
+
+static void record_departure(struct channel_T *channel, uint64_t now) {
+    while (channel->arrival_tail != channel->arrival_head) {
+        struct arrival_T *arrival =
+            &channel->arrivals[channel->arrival_tail % ARRIVAL_CAPACITY];
+        if (arrival->position > channel->buffer.tail)
+            break;
+        add_latency(channel->latency, now - arrival->time);
+        channel->arrival_tail++;
+    }
+}
+
+/* Makes the channel send the VEOF character of the pseudo-terminal to it at
+ * the end of input, so that the end of input reaches the command as an end
+ * of file. */
+static void enable_eof_forwarding(struct channel_T *channel, int master_fd) {
+    struct termios termios;
+    channel->eof_char = '\004';
+    if (tcgetattr(master_fd, &termios) == 0 &&
+            termios.c_cc[VEOF] != _POSIX_VDISABLE)
+        channel->eof_char = (unsigned char) termios.c_cc[VEOF];
+}
+
+/* Puts the EOF character into the buffer. In the canonical mode, a VEOF
+ * after a partial line only ends the line, so another one follows it. */
+static void append_eof(struct channel_T *channel) {
+    struct ring_T *buffer = &channel->buffer;
+    for (int i = channel->partial_line ? 2 : 1;
+            i > 0 && ring_space(buffer) > 0; i--)
+        buffer->data[buffer->head++ % buffer->size] = (char) channel->eof_char;
+}
+
+/* Line timestamps (--timestamps). When data are read, the positions where
+ * lines start are recorded as marks together with the time of the read.
+ * When the data are written, the formatted time of each mark is inserted
+ * before its line by writev, so the data themselves are never copied. A
+ * line split across reads gets one mark, with the time its first byte was
+ * read. */
+
+#define MAX_WRITE_MARKS 256 /* keeps the iovecs below IOV_MAX */
+#define STAMP_SIZE 48
+
+struct mark_T {
+    size_t position; /* in the buffer */
+    uint64_t time; /* in microseconds */
+};
+
+struct stamper_T {
+    struct mark_T *marks;
+    size_t capacity, head, tail;
+    size_t prefix_written; /* bytes of the stamp of the first mark written */
+    bool line_start; /* the next byte read starts a line */
+    /* The formatted seconds of the last stamp, reused while the seconds
+     * remain the same */
+    uint64_t cached_second;
+    char cached[STAMP_SIZE];
+    size_t cached_length;
+};
+
+static struct stamper_T *new_stamper(void) {
+    struct stamper_T *stamper = xrealloc(NULL, 1, sizeof *stamper);
+    stamper->marks = NULL;
+    stamper->capacity = stamper->head = stamper->tail = 0;
+    stamper->prefix_written = 0;
+    stamper->line_start = true;
+    stamper->cached_second = UINT64_MAX;
+    return stamper;
+}
+
+static void push_mark(
+        struct stamper_T *stamper, size_t position, uint64_t time) {
+    if (stamper->head - stamper->tail == stamper->capacity) {
+        size_t capacity = stamper->capacity * 2 + 16;
+        struct mark_T *marks = xrealloc(NULL, capacity, sizeof *marks);
+        for (size_t i = stamper->tail; i != stamper->head; i++)
+            marks[i % capacity] = stamper->marks[i % stamper->capacity];
+        free(stamper->marks);
+        stamper->marks = marks;
+        stamper->capacity = capacity;
+    }
+    struct mark_T *mark = &stamper->marks[stamper->head++ % stamper->capacity];
+    mark->position = position;
+    mark->time = time;
+}
+
+/* Records the starts of lines in the `size' bytes that have just been read
+ * at the head of the buffer. */
+static void mark_lines(struct stamper_T *stamper, const struct ring_T *buffer,
+        size_t size, uint64_t now) {
+    uint64_t time = now;
+    if (options.timestamps == TIMESTAMPS_WALL) {
+        struct timespec wall;
+        if (clock_gettime(CLOCK_REALTIME, &wall) < 0)
+            errno_exit("cannot get current time");
+        time = (uint64_t) wall.tv_sec * 1000000 +
+            (uint64_t) wall.tv_nsec / 1000;
+    }
+
+    struct ring_T input = {
+        .data = buffer->data, .size = buffer->size,
+        .head = buffer->head + size, .tail = buffer->head,
+    };
+    struct iovec iov[2];
+    int count = ring_data_iov(&input, iov);
+    size_t position = buffer->head;
+    for (int i = 0; i < count; i++) {
+        const char *start = iov[i].iov_base, *end = &start[iov[i].iov_len];
+        for (const char *p = start; p < end; ) {
+            if (stamper->line_start) {
+                push_mark(stamper, position + (size_t) (p - start), time);
+                stamper->line_start = false;
+            }
+            const char *newline = memchr(p, '\n', (size_t) (end - p));
+            if (newline == NULL)
+                break;
+            p = &newline[1];
+            stamper->line_start = true;
+        }
+        position += iov[i].iov_len;
+    }
+}
+
+/* Formats the time of a mark followed by a space into `stamp' and returns
+ * its length. The monotonic time is relative to the start of the
+ * wrapper. */
+static size_t format_stamp(
+        struct stamper_T *stamper, uint64_t time, char stamp[]) {
+    if (options.timestamps == TIMESTAMPS_MONO)
+        time -= stats.start_time;
+    uint64_t second = time / 1000000;
+    unsigned microsecond = (unsigned) (time % 1000000);
+    if (second != stamper->cached_second) {
+        int length;
+        if (options.timestamps == TIMESTAMPS_WALL) {
+            time_t t = (time_t) second;
+            struct tm tm;
+            length = localtime_r(&t, &tm) == NULL ? -1 :
+                (int) strftime(stamper->cached, sizeof stamper->cached,
+                        "%Y-%m-%dT%H:%M:%S", &tm);
+        } else {
+            length = snprintf(stamper->cached, sizeof stamper->cached,
+                    "%llu", (unsigned long long) second);
+        }
+        stamper->cached_length = length > 0 ? (size_t) length : 0;
+        stamper->cached_second = second;
+    }
+
+    memcpy(stamp, stamper->cached, stamper->cached_length);
+    char *p = &stamp[stamper->cached_length];
+    *p++ = '.';
+    for (int i = 5; i >= 0; i--, microsecond /= 10)
+        p[i] = (char) ('0' + microsecond % 10);
+    p[6] = ' ';
+    return stamper->cached_length + 8;
+}
+
+/* Moves `length' bytes at `from' to the position `*to' of the ring, which
+ * must not be after the position of `from', and advances `*to'. */
+static void ring_move(struct ring_T *ring, size_t *to, const char *from,
+        size_t length) {
+    size_t start = *to % ring->size;
+    size_t first = ring->size - start < length ? ring->size - start : length;
+    if (&ring->data[start] != from) {
+        memmove(&ring->data[start], from, first);
+        memmove(ring->data, &from[first], length - first);
+    }
+    *to += length;
+}
+
+/* Puts data that were not read from the source at the head of the buffer,
+ * which must have enough space. */
+static void insert_data(struct channel_T *channel, const char *data,
+        size_t length, uint64_t now) {
+    struct ring_T *buffer = &channel->buffer;
+    size_t to = buffer->head;
+    ring_move(buffer, &to, data, length);
+    if (length > 0)
+        channel->partial_line = data[length - 1] != '\n';
+    if (channel->stamper != NULL)
+        mark_lines(channel->stamper, buffer, length, now);
+    if (ring_length(buffer) == 0)
+        channel->flush_time = now + channel->coalesce_window;
+    buffer->head = to;
+}
+
+/* Feeds a byte of an escape sequence to the state machine. Returns true if
+ * the byte is to be kept, which is the case for most control characters
+ * in the middle of a sequence. */
+static bool feed_escape(struct channel_T *channel, unsigned char c) {
+    if (c == 0x18 || c == 0x1a) { /* CAN and SUB cancel the sequence. */
+        channel->ansi_state = ANSI_GROUND;
+        return false;
+    }
+    switch (channel->ansi_state) {
+    case ANSI_GROUND:
+        break;
+    case ANSI_ESCAPE:
+        if (c == '[')
+            channel->ansi_state = ANSI_CSI;
+        else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+            channel->ansi_state = ANSI_STRING; /* OSC, DCS, SOS, PM, APC */
+        else if (c >= 0x20 && c <= 0x2f)
+            channel->ansi_state = ANSI_INTERMEDIATE;
+        else if (c >= 0x30 && c <= 0x7e)
+            channel->ansi_state = ANSI_GROUND;
+        else if (c != 0x1b)
+            return c < 0x20;
+        break;
+    case ANSI_INTERMEDIATE:
+    case ANSI_CSI:
+        if (c == 0x1b)
+            channel->ansi_state = ANSI_ESCAPE;
+        else if (c < 0x20)
+            return true;
+        else if (c >= 0x40 && c <= 0x7e)
+            channel->ansi_state = ANSI_GROUND;
+        else if (channel->ansi_state == ANSI_INTERMEDIATE && c >= 0x30)
+            channel->ansi_state = ANSI_GROUND;
+        break;
+    case ANSI_STRING:
+        /* A string is terminated by ST (ESC \) or, by convention, BEL. */
+        if (c == 0x07)
+            channel->ansi_state = ANSI_GROUND;
+        else if (c == 0x1b)
+            channel->ansi_state = ANSI_STRING_ESCAPE;
+        break;
+    case ANSI_STRING_ESCAPE:
+        if (c == '\\') {
+            channel->ansi_state = ANSI_GROUND;
+        } else if (c != 0x1b) {
+            /* The ESC started another sequence. */
+            channel->ansi_state = ANSI_ESCAPE;
+            return feed_escape(channel, c);
+        }
+        break;
+    }
+    return false;
+}
+
+/* Removes escape sequences from the `size' bytes that have just been read
+ * at the head of the buffer, moving the remaining bytes into place. Returns
+ * the number of bytes remaining. Runs of text between sequences are found
+ * with memchr, which is vectorized in common C libraries. */
+static size_t strip_escapes(struct channel_T *channel, size_t size) {
+    struct ring_T *buffer = &channel->buffer;
+    struct ring_T input = {
+        .data = buffer->data, .size = buffer->size,
+        .head = buffer->head + size, .tail = buffer->head,
+    };
+    struct iovec iov[2];
+    int count = ring_data_iov(&input, iov);
+    size_t to = buffer->head;
+
+    for (int i = 0; i < count; i++) {
+        const char *p = iov[i].iov_base, *end = &p[iov[i].iov_len];
+        while (p < end) {
+            if (channel->ansi_state == ANSI_GROUND) {
+                const char *escape = memchr(p, 0x1b, (size_t) (end - p));
+                const char *run_end = escape != NULL ? escape : end;
+                ring_move(buffer, &to, p, (size_t) (run_end - p));
+                if (escape == NULL)
+                    break;
+                channel->ansi_state = ANSI_ESCAPE;
+                p = &escape[1];
+                continue;
+            }
+            if (feed_escape(channel, (unsigned char) *p))
+                ring_move(buffer, &to, p, 1);
+            p++;
+        }
+    }
+    return to - buffer->head;
+}
+
+/* Returns the offset of the first `c' in the first `length' bytes covered
+ * by the iovecs, or `length' if there is none. */
+static size_t find_char(
+        const struct iovec iov[], int count, size_t length, int c) {
+    size_t offset = 0;
+    for (int i = 0; i < count && offset < length; i++) {
+        size_t part = length - offset < iov[i].iov_len ?
+            length - offset : iov[i].iov_len;
+        const char *found = memchr(iov[i].iov_base, c, part);
+        if (found != NULL)
+            return offset + (size_t) (found - (const char *) iov[i].iov_base);
+        offset += part;
+    }
+    return length;
+}
+
+/* Bracketed pastes. A terminal in the bracketed paste mode, which the
+ * command turns on, surrounds pasted text with these markers. The incoming
+ * channel tracks them to count the writes each paste takes to reach the
+ * command, and takes the detach character literally inside a paste. */
+#define PASTE_MARKER_LENGTH 6
+static const char paste_start_marker[] = "\033[200~";
+
+struct paste_T {
+    bool open; /* the start marker has been read but not the end marker */
+    bool ending; /* the marker being matched is the end marker */
+    size_t matched; /* bytes of a marker matched so far, across reads */
+    /* A paste is accounted when the end marker has been written: until
+     * then, `pending' is true and `end' is the position after it. */
+    bool pending;
+    size_t start, end; /* positions in the buffer */
+    uint64_t start_time, start_writes;
+};
+
+static struct paste_T *new_paste(void) {
+    struct paste_T *paste = xrealloc(NULL, 1, sizeof *paste);
+    paste->open = paste->pending = false;
+    paste->matched = 0;
+    return paste;
+}
+
+static void account_paste(struct channel_T *channel, uint64_t now) {
+    struct paste_T *paste = channel->paste;
+    channel->stats->pastes++;
+    channel->stats->paste_bytes += paste->end - paste->start;
+    channel->stats->paste_writes += channel->stats->writes -
+        paste->start_writes;
+    channel->stats->paste_time += now - paste->start_time;
+    paste->pending = false;
+}
+
+/* Handles a marker that ends at `position' in the buffer. */
+static void finish_marker(
+        struct channel_T *channel, size_t position, uint64_t now) {
+    struct paste_T *paste = channel->paste;
+    if (!paste->ending && !paste->open) {
+        if (paste->pending) /* the previous paste is still being written */
+            account_paste(channel, now);
+        paste->open = true;
+        paste->start = position - PASTE_MARKER_LENGTH;
+        paste->start_time = now;
+        paste->start_writes = channel->stats->writes;
+    } else if (paste->ending && paste->open) {
+        paste->open = false;
+        paste->pending = true;
+        paste->end = position;
+    }
+}
+
+/* Advances the matching of a marker by a byte. Returns false if the byte
+ * does not continue the marker, in which case it has not been consumed. */
+static bool match_marker(struct paste_T *paste, char c) {
+    if (paste->matched == 4 && (c == '0' || c == '1'))
+        paste->ending = c == '1';
+    else if (paste->matched == 4 || c != paste_start_marker[paste->matched])
+        return paste->matched = 0, false;
+    paste->matched++;
+    return true;
+}
+
+/* Scans the first `length' bytes read into the iovecs for paste markers and
+ * the detach character. Returns the offset of the detach character found
+ * outside a paste, or `length' if there is none. */
+static size_t scan_input(struct channel_T *channel,
+        const struct iovec iov[], int count, size_t length, uint64_t now) {
+    struct paste_T *paste = channel->paste;
+    if (paste == NULL)
+        return channel->detach_char < 0 ? length :
+            find_char(iov, count, length, channel->detach_char);
+
+    size_t offset = 0;
+    for (int i = 0; i < count && offset < length; i++) {
+        const char *data = iov[i].iov_base;
+        size_t part = length - offset < iov[i].iov_len ?
+            length - offset : iov[i].iov_len;
+        for (size_t j = 0; j < part; ) {
+            if (paste->matched > 0) {
+                if (!match_marker(paste, data[j]))
+                    continue;
+                j++;
+                if (paste->matched == PASTE_MARKER_LENGTH) {
+                    paste->matched = 0;
+                    finish_marker(channel,
+                            channel->buffer.head + offset + j, now);
+                }
+                continue;
+            }
+            const char *escape = memchr(&data[j], '\033', part - j);
+            size_t next = escape != NULL ?
+                (size_t) (escape - data) : part;
+            if (channel->detach_char >= 0 && !paste->open) {
+                const char *found =
+                    memchr(&data[j], channel->detach_char, next - j);
+                if (found != NULL)
+                    return offset + (size_t) (found - data);
+            }
+            if (escape != NULL)
+                paste->matched = 1;
+            j = escape != NULL ? next + 1 : part;
+        }
+        offset += part;
+    }
+    return length;
+}
+
+/* Output triggers (--trigger). All patterns are compiled into one
+ * Aho-Corasick automaton, a DFA whose state is the longest suffix of the
+ * output so far that is a prefix of some pattern, so that each byte of
+ * output is looked at once however many patterns there are. Bytes that
+ * occur in no pattern share a column of the transition table, which keeps
+ * the table small enough to stay in the cache. */
+
+static struct matcher_T {
+    unsigned char classes[256]; /* the column of each byte */
+    size_t class_count;
+    /* The transitions, a row of class_count for each state. Each is the
+     * offset of the row of the next state rather than its number, and the
+     * states at which a pattern ends are numbered last, from `accepting',
+     * so that the scanner needs no multiplication and a single comparison
+     * per byte. The root is state 0. */
+    uint32_t *next;
+    size_t accepting;
+    bool starts[256]; /* whether the byte leads out of the root */
+    size_t shortest; /* the length of the shortest pattern */
+    uint32_t *fail; /* the state of the longest proper suffix */
+    /* The state itself if a pattern ends at it, or the state of the
+     * longest suffix at which one does, or 0 if there is none */
+    uint32_t *report;
+    int32_t *ends; /* the first trigger whose pattern ends at the state */
+    int32_t *also; /* the next trigger with the same pattern as this one */
+} matcher;
+
+/* The status the wrapper exits with after a TRIGGER_EXIT, or -1 */
+static int trigger_exit_status = -1;
+
+static void *allocate_array(size_t count, size_t size) {
+    void *array = calloc(count, size);
+    if (array == NULL)
+        errno_exit("cannot allocate matcher");
+    return array;
+}
+
+static void compile_triggers(void) {
+    size_t state_limit = 1;
+    matcher.class_count = 1;
+    matcher.shortest = SIZE_MAX;
+    for (size_t i = 0; i < options.trigger_count; i++) {
+        const struct trigger_T *trigger = &options.triggers[i];
+        state_limit += trigger->pattern_length;
+        if (trigger->pattern_length < matcher.shortest)
+            matcher.shortest = trigger->pattern_length;
+        for (size_t j = 0; j < trigger->pattern_length; j++) {
+            unsigned char c = (unsigned char) trigger->pattern[j];
+            if (matcher.classes[c] == 0)
+                matcher.classes[c] = (unsigned char) matcher.class_count++;
+        }
+    }
+    size_t classes = matcher.class_count;
+    if (state_limit > UINT32_MAX / classes)
+        error_exit("too many --trigger patterns");
+    uint32_t *next = allocate_array(state_limit * classes, sizeof *next);
+    uint32_t *fail = allocate_array(state_limit, sizeof *fail);
+    uint32_t *report = allocate_array(state_limit, sizeof *report);
+    int32_t *ends = allocate_array(state_limit, sizeof *ends);
+    matcher.also = allocate_array(
+            options.trigger_count, sizeof *matcher.also);
+    for (size_t i = 0; i < state_limit; i++)
+        ends[i] = -1;
+
+    /* Build the trie of the patterns. No edge of it leads to the root, so
+     * 0 means that there is no edge yet. */
+    uint32_t state_count = 1;
+    for (size_t i = 0; i < options.trigger_count; i++) {
+        const struct trigger_T *trigger = &options.triggers[i];
+        uint32_t state = 0;
+        for (size_t j = 0; j < trigger->pattern_length; j++) {
+            uint32_t *edge = &next[state * classes +
+                matcher.classes[(unsigned char) trigger->pattern[j]]];
+            if (*edge == 0)
+                *edge = state_count++;
+            state = *edge;
+        }
+        matcher.also[i] = ends[state];
+        ends[state] = (int32_t) i;
+    }
+
+    /* Visit the states in breadth-first order, so that the suffixes of a
+     * state have been completed before it, and replace the missing edges
+     * with those of the longest proper suffix. */
+    uint32_t *queue = allocate_array(state_count, sizeof *queue);
+    size_t head = 0, tail = 0;
+    queue[head++] = 0;
+    while (tail < head) {
+        uint32_t state = queue[tail++];
+        for (size_t c = 0; c < classes; c++) {
+            uint32_t *edge = &next[state * classes + c];
+            uint32_t suffix = state == 0 ? 0 : next[fail[state] * classes + c];
+            if (*edge == 0) {
+                *edge = suffix;
+                continue;
+            }
+            uint32_t child = *edge;
+            fail[child] = suffix;
+            report[child] = ends[child] >= 0 ? child : report[suffix];
+            queue[head++] = child;
+        }
+    }
+
+    /* Renumber the states, reusing the queue for the new numbers. */
+    uint32_t number = 0;
+    for (uint32_t state = 0; state < state_count; state++)
+        if (report[state] == 0)
+            queue[state] = number++;
+    matcher.accepting = number * classes;
+    for (uint32_t state = 0; state < state_count; state++)
+        if (report[state] != 0)
+            queue[state] = number++;
+    matcher.next = allocate_array(
+            (size_t) state_count * classes, sizeof *matcher.next);
+    matcher.fail = allocate_array(state_count, sizeof *matcher.fail);
+    matcher.report = allocate_array(state_count, sizeof *matcher.report);
+    matcher.ends = allocate_array(state_count, sizeof *matcher.ends);
+    for (uint32_t state = 0; state < state_count; state++) {
+        uint32_t n = queue[state];
+        for (size_t c = 0; c < classes; c++)
+            matcher.next[n * classes + c] =
+                queue[next[state * classes + c]] * (uint32_t) classes;
+        matcher.fail[n] = queue[fail[state]];
+        matcher.report[n] = report[state] != 0 ? queue[report[state]] : 0;
+        matcher.ends[n] = ends[state];
+    }
+    for (int c = 0; c < 256; c++)
+        matcher.starts[c] = matcher.next[matcher.classes[c]] != 0;
+    free(queue);
+    free(next);
+    free(fail);
+    free(report);
+    free(ends);
+}
+
+/* Appends the string to the report as a JSON string. */
+static void append_json_string(
+        struct report_T *report, const char *data, size_t length) {
+    append_report(report, "\"");
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) data[i];
+        if (c == '"' || c == '\\')
+            append_report(report, "\\%c", c);
+        else if (c < 0x20 || c == 0x7f)
+            append_report(report, "\\u%04x", c);
+        else
+            append_report(report, "%c", c);
+    }
+    append_report(report, "\"");
+}
+
+/* Writes the event of the trigger matched after `offset' bytes of output
+ * to --trigger-fd as a line of JSON. */
+static void report_trigger(size_t index, uint64_t offset, uint64_t now) {
+    const struct trigger_T *trigger = &options.triggers[index];
+    struct report_T report = { .length = 0, };
+    append_report(&report, "{\"trigger\":%zu,\"pattern\":", index + 1);
+    append_json_string(&report, trigger->pattern, trigger->pattern_length);
+    append_report(&report, ",\"offset\":%llu,\"time_us\":%llu}\n",
+            (unsigned long long) offset,
+            (unsigned long long) (now - stats.start_time));
+    write_all(options.trigger_fd, report.data, report.length);
+}
+
+/* Puts the text of a send trigger into the input after what has already
+ * been buffered, so that it is written in order with typed input. The text
+ * is dropped if the buffer has no room for it. */
+static void send_trigger_text(struct channel_T *reply,
+        const struct trigger_T *trigger, uint64_t now) {
+    if (reply == NULL)
+        return;
+    if (ring_space(&reply->buffer) < trigger->text_length) {
+        reply->stats->dropped += trigger->text_length;
+        return;
+    }
+    insert_data(reply, trigger->text, trigger->text_length, now);
+}
+
+/* Takes the actions of the triggers whose patterns end at the state, which
+ * the matcher has reached after `offset' bytes of output. Returns true if
+ * the output is to end there. */
+static bool fire_triggers(struct channel_T *channel, uint32_t state,
+        uint64_t offset, uint64_t now) {
+    bool end = false;
+    for (uint32_t s = matcher.report[state]; s != 0;
+            s = matcher.report[matcher.fail[s]]) {
+        for (int32_t i = matcher.ends[s]; i >= 0; i = matcher.also[i]) {
+            const struct trigger_T *trigger = &options.triggers[i];
+            switch (trigger->action) {
+            case TRIGGER_EVENT:
+                report_trigger((size_t) i, offset, now);
+                break;
+            case TRIGGER_SEND:
+                send_trigger_text(channel->reply, trigger, now);
+                break;
+            case TRIGGER_EXIT:
+                if (trigger_exit_status < 0)
+                    trigger_exit_status = trigger->exit_status;
+                end = true;
+                break;
+            }
+        }
+    }
+    return end;
+}
+
+/* Scans `length' bytes at the head of the buffer for the patterns. Returns
+ * the number of bytes up to the end of a match whose trigger ends the
+ * output, or `length'. */
+static size_t scan_triggers(
+        struct channel_T *channel, size_t length, uint64_t now) {
+    const struct ring_T *buffer = &channel->buffer;
+    const uint32_t *next = matcher.next;
+    const unsigned char *classes = matcher.classes;
+    const bool *starts = matcher.starts;
+    size_t accepting = matcher.accepting, shortest = matcher.shortest;
+    uint32_t row = channel->trigger_state;
+    for (size_t scanned = 0; scanned < length; ) {
+        size_t start = (buffer->head + scanned) % buffer->size;
+        size_t part = buffer->size - start < length - scanned ?
+            buffer->size - start : length - scanned;
+        const unsigned char *data =
+            (const unsigned char *) &buffer->data[start];
+        for (size_t i = 0; i < part; i++) {
+            /* Most output does not start any pattern. At the root, no
+             * match starts in the next `shortest' bytes if the last of
+             * them is in no pattern, and the state after them is the root
+             * again. */
+            if (row == 0) {
+                while (part - i >= shortest &&
+                        classes[data[i + shortest - 1]] == 0)
+                    i += shortest;
+                if (i == part)
+                    break;
+                if (!starts[data[i]])
+                    continue;
+            }
+            row = next[row + classes[data[i]]];
+            if (row >= accepting && fire_triggers(channel,
+                        row / (uint32_t) matcher.class_count,
+                        channel->trigger_offset + scanned + i + 1, now)) {
+                channel->trigger_state = 0;
+                channel->trigger_offset += scanned + i + 1;
+                return scanned + i + 1;
+            }
+        }
+        scanned += part;
+    }
+    channel->trigger_state = row;
+    channel->trigger_offset += length;
+    return length;
+}
+
+/* Updates the channel after `size' bytes have been read into the free space
+ * covered by the iovecs. A negative size is an error indicated by errno. */
+static void finish_read(struct channel_T *channel, ssize_t size,
+        const struct iovec iov[], int count, uint64_t now) {
+    if (size <= 0) {
+        if (size < 0) {
+            count_error(channel->stats);
+            /* The source may be non-blocking, like the master. */
+            if (errno == EAGAIN)
+                channel->from->ready &= ~EVENT_READ;
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+        } else if (channel->eof_char >= 0) {
+            append_eof(channel);
+        }
+        channel->readable = false;
+        return;
+    }
+    channel->stats->bytes += size;
+    channel->stats->reads++;
+    take_tokens(&channel->bucket, (size_t) size, now);
+    if (channel->detach_char >= 0 || channel->paste != NULL) {
+        size_t offset = scan_input(channel, iov, count, (size_t) size, now);
+        if (offset < (size_t) size) {
+            channel->readable = false;
+            size = (ssize_t) offset;
+            if (size == 0)
+                return;
+        }
+    }
+    if (channel->record >= 0)
+        record_chunk(channel->record, iov, count, (size_t) size, now);
+    if (channel->cast)
+        append_cast(RECORD_OUTPUT, iov, count, (size_t) size, now);
+    if (channel->screen)
+        append_screen(RECORD_OUTPUT, iov, count, (size_t) size);
+    if (channel->strip_ansi) {
+        size = (ssize_t) strip_escapes(channel, (size_t) size);
+        if (size == 0)
+            return;
+    }
+    if (channel->trigger) {
+        size_t offset = scan_triggers(channel, (size_t) size, now);
+        if (offset < (size_t) size) {
+            channel->readable = false;
+            size = (ssize_t) offset;
+        }
+    }
+    if (channel->stamper != NULL)
+        mark_lines(channel->stamper, &channel->buffer, (size_t) size, now);
+    if (ring_length(&channel->buffer) == 0)
+        channel->flush_time = now + channel->coalesce_window;
+    channel->buffer.head += size;
+    if (size > 0)
+        channel->partial_line = channel->buffer.data[
+            (channel->buffer.head - 1) % channel->buffer.size] != '\n';
+    record_arrival(channel, now);
+    if (channel->tee)
+        append_tee(iov, count, (size_t) size);
+    /* The iovecs point into the old storage, so this comes last. */
+    if (channel->buffer_limit > 0)
+        grow_buffer(channel);
+    if (ring_space(&channel->buffer) == 0)
+        channel->full_since = now;
+}
+
+/* Updates the channel after `size' of `length' buffered bytes have been
+ * written. A negative size is an error indicated by errno. */
+static void finish_write(struct channel_T *channel, ssize_t size,
+        size_t length, uint64_t now) {
+    if (size > 0) { /* ignore any error */
+        channel->buffer.tail += size;
+        channel->stats->writes++;
+        if ((size_t) size < length)
+            channel->stats->short_writes++;
+        if (channel->full_since != 0) {
+            channel->stats->blocked_time += now - channel->full_since;
+            channel->full_since = 0;
+        }
+        record_departure(channel, now);
+        if (channel->paste != NULL && channel->paste->pending &&
+                channel->buffer.tail >= channel->paste->end)
+            account_paste(channel, now);
+        if (channel->buffer_limit > 0 && ring_length(&channel->buffer) == 0)
+            shrink_buffer(channel);
+    } else if (size < 0) {
+        count_error(channel->stats);
+        if (errno == EAGAIN)
+            channel->to->ready &= ~EVENT_WRITE;
+    }
+}
+
+/* Overflow policies (--overflow). With the block policy, the channel stops
+ * reading when the buffer is full, which eventually blocks the command. The
+ * other policies keep reading: drop-oldest discards the oldest buffered
+ * data to make room, drop-newest discards what is read until there is room
+ * again and then inserts a marker saying how much was lost, and spill
+ * appends what is read to a memory-mapped temporary file, from which the
+ * buffer is refilled in order. */
+
+/* Discards `length' bytes at the tail of the buffer. */
+static void discard_oldest(struct channel_T *channel, size_t length) {
+    channel->buffer.tail += length;
+    channel->stats->overflows++;
+    channel->stats->dropped += length;
+    while (channel->arrival_tail != channel->arrival_head &&
+            channel->arrivals[channel->arrival_tail % ARRIVAL_CAPACITY]
+                .position <= channel->buffer.tail)
+        channel->arrival_tail++;
+
+    struct stamper_T *stamper = channel->stamper;
+    while (stamper != NULL && stamper->tail != stamper->head &&
+            stamper->marks[stamper->tail % stamper->capacity].position <
+                channel->buffer.tail) {
+        stamper->tail++;
+        stamper->prefix_written = 0;
+    }
+}
+
+/* Inserts the marker for the data dropped so far if there is room. */
+static void insert_drop_marker(struct channel_T *channel, uint64_t now) {
+    char marker[128];
+    int length = snprintf(marker, sizeof marker,
+            "\r\n[%s: %llu bytes of output dropped]\r\n", program_name,
+            (unsigned long long) channel->dropped_pending);
+    if (length < 0 || (size_t) length >= sizeof marker)
+        length = (int) strlen(strcpy(marker, "\r\n[output dropped]\r\n"));
+    if (ring_space(&channel->buffer) < (size_t) length)
+        return;
+    insert_data(channel, marker, (size_t) length, now);
+    channel->dropped_pending = 0;
+}
+
+static void drop_newest(struct channel_T *channel, uint64_t now) {
+    /* on the stack, as the shards of --threads drop data concurrently */
+    char discarded[64 * 1024];
+    ssize_t size = read(channel->from->fd, discarded, sizeof discarded);
+    if (size <= 0) {
+        finish_read(channel, size, NULL, 0, now);
+        return;
+    }
+    if (channel->dropped_pending == 0)
+        channel->stats->overflows++;
+    channel->stats->bytes += size;
+    channel->stats->reads++;
+    channel->dropped_pending += size;
+    channel->stats->dropped += size;
+}
+
+static size_t page_size(void) {
+    long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? (size_t) size : 4096;
+}
+
+/* Makes room for `length' more bytes in the spill file. Returns false on
+ * failure. */
+static bool reserve_spill(struct spill_T *spill, size_t length) {
+    if (spill->fd < 0) {
+        const char *directory = getenv("TMPDIR");
+        char pathname[PATH_MAX];
+        if (directory == NULL || *directory == '\0')
+            directory = "/tmp";
+        if (snprintf(pathname, sizeof pathname, "%s/ptwrap-spill-XXXXXX",
+                    directory) >= (int) sizeof pathname) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        spill->fd = mkstemp(pathname);
+        if (spill->fd < 0)
+            return false;
+        unlink(pathname);
+        set_cloexec(spill->fd);
+    }
+
+    /* Move the unread data to the start of the file once most of the file
+     * has been read. */
+    if (spill->tail > spill->map_size / 2) {
+        memmove(spill->map, &spill->map[spill->tail],
+                spill->head - spill->tail);
+        spill->head -= spill->tail;
+        spill->tail = 0;
+    }
+    if (spill->head + length <= spill->map_size)
+        return true;
+
+    size_t size = spill->map_size * 2;
+    if (size < spill->head + length)
+        size = spill->head + length;
+    size = round_up(size, page_size());
+    if (ftruncate(spill->fd, (off_t) size) < 0)
+        return false;
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            spill->fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    if (spill->map != NULL)
+        munmap(spill->map, spill->map_size);
+    spill->map = map;
+    spill->map_size = size;
+    return true;
+}
+
+static void close_spill(struct spill_T *spill) {
+    if (spill->map != NULL)
+        munmap(spill->map, spill->map_size);
+    if (spill->fd >= 0)
+        close(spill->fd);
+}
+
+static void read_to_spill(struct channel_T *channel, uint64_t now) {
+    struct spill_T *spill = &channel->spill;
+    if (!reserve_spill(spill, options.buffer_size)) {
+        fprintf(stderr, "%s: cannot spill output: %s\n", program_name,
+                strerror(errno));
+        channel->overflow = OVERFLOW_BLOCK;
+        return;
+    }
+    ssize_t size = read(channel->from->fd, &spill->map[spill->head],
+            options.buffer_size);
+    if (size <= 0) {
+        finish_read(channel, size, NULL, 0, now);
+        return;
+    }
+    if (spill->head == spill->tail)
+        channel->stats->overflows++;
+    channel->stats->bytes += size;
+    channel->stats->reads++;
+    spill->head += size;
+    channel->stats->spilled += size;
+}
+
+/* Moves spilled data into the free space of the buffer as if they had just
+ * been read. */
+static void refill_from_spill(struct channel_T *channel, uint64_t now) {
+    struct spill_T *spill = &channel->spill;
+    size_t length = spill->head - spill->tail;
+    if (length == 0 || ring_space(&channel->buffer) == 0)
+        return;
+
+    struct iovec iov[2];
+    int count = ring_space_iov(&channel->buffer, iov);
+    size_t moved = 0;
+    for (int i = 0; i < count && moved < length; i++) {
+        size_t part = length - moved < iov[i].iov_len ?
+            length - moved : iov[i].iov_len;
+        memcpy(iov[i].iov_base, &spill->map[spill->tail + moved], part);
+        moved += part;
+    }
+    spill->tail += moved;
+    if (spill->tail == spill->head)
+        spill->head = spill->tail = 0;
+    /* The data have been counted when they were read into the file. */
+    channel->stats->bytes -= moved;
+    channel->stats->reads--;
+    finish_read(channel, (ssize_t) moved, iov, count, now);
+}
+
+/* Reads from the source when the policy says so even though the buffer is
+ * full, or while data are being dropped or spilled. */
+static void read_overflow(struct channel_T *channel, uint64_t now) {
+    switch (channel->overflow) {
+    case OVERFLOW_BLOCK:
+        break;
+    case OVERFLOW_DROP_OLDEST:
+        if (ring_space(&channel->buffer) == 0) {
+            size_t length = channel->buffer.size / 4;
+            discard_oldest(channel, length > 0 ? length : 1);
+        }
+        break;
+    case OVERFLOW_DROP_NEWEST:
+        drop_newest(channel, now);
+        break;
+    case OVERFLOW_SPILL:
+        read_to_spill(channel, now);
+        break;
+    }
+}
+
+/* Returns true if the next read does not go to the free space of the buffer
+ * as usual. */
+static bool is_overflowing(const struct channel_T *channel) {
+    return ring_space(&channel->buffer) == 0 ||
+        channel->dropped_pending > 0 ||
+        channel->spill.head != channel->spill.tail;
+}
+
+/* Writes the buffered data with the stamps of the marks inserted. */
+static void write_stamped(struct channel_T *channel, uint64_t now) {
+    struct stamper_T *stamper = channel->stamper;
+    const struct ring_T *buffer = &channel->buffer;
+    struct iovec iov[3 * MAX_WRITE_MARKS + 2];
+    bool is_stamp[3 * MAX_WRITE_MARKS + 2];
+    char stamps[MAX_WRITE_MARKS][STAMP_SIZE];
+    int count = 0;
+    size_t stamp_count = 0, length = 0;
+
+    /* Like limit_iov, stop adding data once the write limit is reached. */
+    size_t position = buffer->tail, mark = stamper->tail;
+    while (position != buffer->head && length < channel->write_limit) {
+        /* The first mark is at the tail until its stamp has been written. */
+        if (mark != stamper->head &&
+                stamper->marks[mark % stamper->capacity].position ==
+                    position) {
+            if (stamp_count == MAX_WRITE_MARKS)
+                break;
+            char *stamp = stamps[stamp_count++];
+            size_t stamp_length = format_stamp(stamper,
+                    stamper->marks[mark % stamper->capacity].time, stamp);
+            size_t skip = mark == stamper->tail ? stamper->prefix_written : 0;
+            iov[count].iov_base = &stamp[skip];
+            iov[count].iov_len = stamp_length - skip;
+            is_stamp[count++] = true;
+            mark++;
+        }
+
+        size_t end = mark != stamper->head ?
+            stamper->marks[mark % stamper->capacity].position : buffer->head;
+        size_t start = position % buffer->size, run = end - position;
+        if (run > channel->write_limit - length)
+            run = channel->write_limit - length;
+        end = position + run;
+        size_t first = buffer->size - start < run ? buffer->size - start : run;
+        iov[count].iov_base = &buffer->data[start];
+        iov[count].iov_len = first;
+        is_stamp[count++] = false;
+        if (run > first) {
+            iov[count].iov_base = buffer->data;
+            iov[count].iov_len = run - first;
+            is_stamp[count++] = false;
+        }
+        position = end;
+        length += run;
+    }
+
+    ssize_t size = writev(channel->to->fd, iov, count);
+    if (size < 0) {
+        finish_write(channel, size, length, now);
+        return;
+    }
+
+    /* Pass the written data on to finish_write and drop the marks whose
+     * stamps have been written. */
+    size_t remaining = (size_t) size, data_written = 0;
+    for (int i = 0; i < count && remaining > 0; i++) {
+        size_t part = iov[i].iov_len < remaining ? iov[i].iov_len : remaining;
+        remaining -= part;
+        if (!is_stamp[i]) {
+            data_written += part;
+        } else if (part == iov[i].iov_len) {
+            stamper->tail++;
+            stamper->prefix_written = 0;
+        } else {
+            stamper->prefix_written += part;
+        }
+    }
+    if (data_written > 0)
+        finish_write(channel, (ssize_t) data_written, length, now);
+}
+
+/* Shortens the iovecs to at most `limit' bytes and returns their length. */
+static size_t limit_iov(struct iovec iov[], int *count, size_t limit) {
+    size_t length = 0;
+    for (int i = 0; i < *count; i++) {
+        if (iov[i].iov_len >= limit - length) {
+            iov[i].iov_len = limit - length;
+            *count = i + 1;
+            return limit;
+        }
+        length += iov[i].iov_len;
+    }
+    return length;
+}
+
+/* The most times a draining channel reads and writes in an iteration of the
+ * event loop, so that it cannot starve the other channels */
+#define DRAIN_ROUNDS 8
+
+/* Reads and writes once if ready. */
+static void transfer(struct channel_T *channel, uint64_t now) {
+    struct iovec iov[2];
+    ssize_t size;
+
+    size_t allowance = read_allowance(channel, now);
+    if (channel->readable && (channel->from->ready & EVENT_READ) &&
+            allowance > 0 && channel->overflow != OVERFLOW_BLOCK &&
+            is_overflowing(channel)) {
+        read_overflow(channel, now);
+        allowance = read_allowance(channel, now);
+    }
+    if (channel->readable && (channel->from->ready & EVENT_READ) &&
+            allowance > 0 && !is_overflowing(channel)) {
+        int count = ring_space_iov(&channel->buffer, iov);
+        limit_iov(iov, &count, allowance);
+        size = readv(channel->from->fd, iov, count);
+        finish_read(channel, size, iov, count, now);
+    }
+
+    if ((channel->to->ready & EVENT_WRITE) &&
+            should_flush(channel, now) && channel->stamper != NULL) {
+        write_stamped(channel, now);
+    } else if ((channel->to->ready & EVENT_WRITE) &&
+            should_flush(channel, now)) {
+        int count = ring_data_iov(&channel->buffer, iov);
+        size_t length = limit_iov(iov, &count, channel->write_limit);
+        size = writev(channel->to->fd, iov, count);
+        finish_write(channel, size, length, now);
+    }
+
+    if (channel->dropped_pending > 0)
+        insert_drop_marker(channel, now);
+    refill_from_spill(channel, now);
+}
+
+static void process_buffer(struct channel_T *channel, uint64_t now) {
+#if defined(USE_SPLICE)
+    if (process_splice(channel, now))
+        return;
+#endif /* defined(USE_SPLICE) */
+
+    if (!channel->drain) {
+        transfer(channel, now);
+        return;
+    }
+    /* Stop when a round has moved nothing: the reads and writes would have
+     * blocked, or there is no room or nothing to write. */
+    const struct channel_stats_T *stats = channel->stats;
+    for (int round = 0; round < DRAIN_ROUNDS; round++) {
+        uint64_t moves = stats->reads + stats->writes;
+        transfer(channel, now);
+        if (stats->reads + stats->writes == moves)
+            break;
+    }
+}
+
+/* A session is a child process running in a pseudo-terminal together with
+ * the channels that forward its IO. In the multiplexed mode, sessions have
+ * no input and their output goes to a file or socket of their own. */
+struct shard_T;
+
+struct session_T {
+    struct session_T *prev, *next, *next_touched;
+    struct shard_T *shard;
+    bool touched; /* in the list of sessions to process */
+    const char *name;
+    pid_t child_pid;
+    bool child_exited;
+    int exit_status;
+    uint64_t exit_time; /* when the exit of the child was noticed */
+    /* With --drain-timeout, the forwarding loops watch a pidfd of the child
+     * if possible; fd is -1 if SIGCHLD is relied on instead. */
+    struct watch_T exit_watch;
+    int master_fd;
+    bool interactive; /* whether the incoming channel is used */
+    struct watch_T master_watch, input_watch, output_watch;
+    struct channel_T incoming, outgoing;
+};
+
+/* With --low-latency, output is written in pieces of at most this size, so
+ * that input is not held back by a long write to a slow terminal. */
+#define LOW_LATENCY_WRITE_LIMIT 4096
+#define LOW_LATENCY_NICE (-10)
+
+/* Applies the options that affect the output of a command. */
+static void configure_outgoing(
+        struct channel_T *channel, struct stats_T *stats) {
+    channel->latency = stats->output_latency;
+    enable_coalescing(channel);
+    channel->tee = options.tee_path != NULL;
+    channel->strip_ansi = options.strip_ansi;
+    channel->overflow = options.overflow;
+    if (options.timestamps != TIMESTAMPS_NONE)
+        channel->stamper = new_stamper();
+    if (options.record_path != NULL)
+        channel->record = RECORD_OUTPUT;
+    channel->cast = options.cast_path != NULL;
+    channel->screen = options.screen_path != NULL;
+    channel->trigger = options.trigger_count > 0;
+    if (options.low_latency)
+        channel->write_limit = LOW_LATENCY_WRITE_LIMIT;
+    if (options.max_rate > 0)
+        limit_rate(channel, options.max_rate, options.max_burst,
+                current_time());
+}
+
+static void init_session(struct session_T *session, struct event_loop_T *loop,
+        int master_fd, int input_fd, int output_fd, struct stats_T *stats) {
+    /* A write of a large paste to a blocking master would wait until the
+     * command has read all but the last line-discipline bufferful of it,
+     * and meanwhile no output would be read: if the command echoes the
+     * paste, both would wait for each other. Writes to a non-blocking
+     * master take what fits, and the rest waits in the buffer for the
+     * master to become writable again. io_uring does not poll the
+     * non-blocking fds it is given. */
+    if (!options.io_uring)
+        set_nonblocking(master_fd);
+    session->touched = false;
+    session->child_exited = false;
+    session->master_fd = master_fd;
+    session->interactive = input_fd >= 0;
+
+    add_watch(loop, &session->master_watch, master_fd, session);
+    add_watch(loop, &session->output_watch, output_fd, session);
+    if (session->interactive) {
+        add_watch(loop, &session->input_watch, input_fd, session);
+        init_channel(&session->incoming, &session->input_watch,
+                &session->master_watch, &stats->incoming);
+        if (options.headless)
+            enable_eof_forwarding(&session->incoming, master_fd);
+        if (options.record_path != NULL)
+            session->incoming.record = RECORD_INPUT;
+        if (options.max_input_rate > 0)
+            limit_rate(&session->incoming, options.max_input_rate,
+                    options.max_input_burst, current_time());
+        if (isatty(input_fd))
+            session->incoming.paste = new_paste();
+    }
+    init_channel(&session->outgoing, &session->master_watch,
+            &session->output_watch, &stats->outgoing);
+    configure_outgoing(&session->outgoing, stats);
+    if (session->interactive)
+        session->outgoing.reply = &session->incoming;
+    /* io_uring registers the buffers once, so they cannot move. */
+    if (!options.io_uring) {
+        if (session->interactive)
+            make_elastic(&session->incoming);
+        make_elastic(&session->outgoing);
+    }
+#if defined(USE_SPLICE)
+    enable_splice(&session->outgoing);
+#endif /* defined(USE_SPLICE) */
+
+    /* Channels whose fds are all non-blocking drain them at each wakeup,
+     * so their watches can be edge-triggered. A splicing channel moves its
+     * data by one splice per wakeup and stays level-triggered. */
+    bool master_nonblocking = is_nonblocking(master_fd);
+    session->outgoing.drain = master_nonblocking &&
+        is_nonblocking(output_fd);
+#if defined(USE_SPLICE)
+    if (session->outgoing.splice != SPLICE_NONE)
+        session->outgoing.drain = false;
+#endif /* defined(USE_SPLICE) */
+    session->output_watch.edge = session->outgoing.drain;
+    session->master_watch.edge = session->outgoing.drain;
+    if (session->interactive) {
+        session->incoming.drain = master_nonblocking &&
+            is_nonblocking(input_fd);
+        session->input_watch.edge = session->incoming.drain;
+        if (!session->incoming.drain)
+            session->master_watch.edge = false;
+    }
+}
+
+/* Updates the registrations if any channel of the session changed its
+ * interest. */
+static void update_session_interest(
+        struct event_loop_T *loop, struct session_T *session, uint64_t now) {
+    session->master_watch.interest = session->output_watch.interest = 0;
+    if (session->interactive) {
+        session->input_watch.interest = 0;
+        add_interest(&session->incoming, now);
+        apply_interest(loop, &session->input_watch);
+    }
+    add_interest(&session->outgoing, now);
+    apply_interest(loop, &session->output_watch);
+    apply_interest(loop, &session->master_watch);
+}
+
+/* Exit detection (--drain-timeout). Output is normally forwarded until the
+ * master reports the end of it, which does not come while another process,
+ * like a daemon started by the command, keeps the slave open. With a drain
+ * timeout, the session notices the exit of the child in the event loop,
+ * forwards output only for the timeout after that, and then stops reading
+ * it, so that the wrapper exits once the buffered output is written. */
+
+/* Starts watching for the exit of the child of the session. */
+static void watch_exit(
+        struct event_loop_T *loop, struct session_T *session, pid_t pid) {
+    session->child_pid = pid;
+    session->child_exited = false;
+    session->exit_watch.fd = -1;
+    if (options.drain_timeout < 0)
+        return;
+#if defined(USE_PIDFD)
+    int fd = (int) syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0)
+        return; /* before Linux 5.3 */
+    set_cloexec(fd);
+    add_watch(loop, &session->exit_watch, fd, session);
+    session->exit_watch.interest = EVENT_READ;
+    apply_interest(loop, &session->exit_watch);
+#else
+    (void) loop;
+#endif /* defined(USE_PIDFD) */
+}
+
+/* Checks if the child of the session has exited since the last wait. The
+ * child is not reaped, so that it can be awaited afterwards as usual. */
+static void check_exit(struct event_loop_T *loop, struct session_T *session,
+        uint64_t now) {
+    if (options.drain_timeout < 0 || session->child_exited)
+        return;
+    if (session->exit_watch.fd >= 0 ?
+            !(session->exit_watch.ready & EVENT_READ) :
+            !should_reap_children)
+        return;
+    should_reap_children = false;
+
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, (id_t) session->child_pid, &info,
+                WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0)
+        return;
+    session->child_exited = true;
+    session->exit_time = now;
+    if (session->exit_watch.fd >= 0) {
+        remove_watch(loop, &session->exit_watch);
+        close(session->exit_watch.fd);
+        session->exit_watch.fd = -1;
+    }
+}
+
+/* Returns the time in microseconds until the session stops reading the
+ * output of its exited child, or -1. */
+static int64_t drain_timeout(const struct session_T *session, uint64_t now) {
+    if (options.drain_timeout < 0 || !session->child_exited ||
+            !session->outgoing.readable)
+        return -1;
+    uint64_t deadline = session->exit_time + (uint64_t) options.drain_timeout;
+    return deadline > now ? (int64_t) (deadline - now) : 0;
+}
+
+/* Returns the time in microseconds until a channel of the session needs to
+ * be processed without an event, or -1. */
+static int64_t session_timeout(
+        const struct session_T *session, uint64_t now) {
+    int64_t timeout = earlier_timeout(
+            channel_timeout(&session->outgoing, now),
+            drain_timeout(session, now));
+    if (session->interactive)
+        timeout = earlier_timeout(timeout,
+                channel_timeout(&session->incoming, now));
+    return timeout;
+}
+
+/* Stops reading output when the drain timeout has passed. */
+static void end_drain(struct session_T *session, uint64_t now) {
+    if (drain_timeout(session, now) == 0)
+        session->outgoing.readable = false;
+}
+
+static void process_session(struct session_T *session, uint64_t now) {
+    end_drain(session, now);
+    if (session->interactive)
+        process_buffer(&session->incoming, now);
+    process_buffer(&session->outgoing, now);
+}
+
+/* Unix-domain sockets, which are used by --control and --host */
+
+static void warn_errno(const char *message, const char *argument) {
+    int saved_errno = errno;
+    fprintf(stderr, "%s: %s: %s: %s\n",
+            program_name, message, argument, strerror(saved_errno));
+}
+
+/* Sets the address of a Unix-domain socket. Returns false if the pathname
+ * is too long. */
+static bool set_socket_address(
+        struct sockaddr_un *address, const char *pathname) {
+    memset(address, 0, sizeof *address);
+    address->sun_family = AF_UNIX;
+    if (strlen(pathname) >= sizeof address->sun_path) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(address->sun_path, pathname);
+    return true;
+}
+
+/* Returns a stream socket connected to the Unix-domain socket, or -1 on
+ * error. */
+static int connect_socket(const char *pathname) {
+    struct sockaddr_un address;
+    if (!set_socket_address(&address, pathname))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &address, sizeof address) < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+static void socket_error(const char *message, const char *pathname) {
+    warn_errno(message, pathname);
+    exit(EXIT_FAILURE);
+}
+
+/* Creates a listening socket accessible only by the user, which `remove'
+ * removes at exit. A socket left behind by a process that is gone is
+ * replaced. */
+static int open_listener(const char *pathname, void (*remove)(void)) {
+    struct sockaddr_un address;
+    if (!set_socket_address(&address, pathname))
+        socket_error("cannot create socket", pathname);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        socket_error("cannot create socket", pathname);
+    struct stat st;
+    if (stat(pathname, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int stale_fd = connect_socket(pathname);
+        if (stale_fd >= 0)
+            error_exit("another process is listening on the socket");
+        if (errno == ECONNREFUSED)
+            unlink(pathname);
+    }
+
+    mode_t mask = umask(077);
+    int result = bind(fd, (struct sockaddr *) &address, sizeof address);
+    umask(mask);
+    if (result < 0)
+        socket_error("cannot create socket", pathname);
+    if (atexit(remove) != 0)
+        error_exit("atexit");
+    if (listen(fd, SOMAXCONN) < 0)
+        socket_error("cannot listen on socket", pathname);
+    set_cloexec(fd);
+    set_nonblocking(fd);
+    return fd;
+}
+
+/* The control socket (--control). A connection carries a single request,
+ * which is a line, and its reply, after which the wrapper closes it:
+ *
+ *   metrics            replies with the statistics in the text format of
+ *                      Prometheus
+ *   set <name> <value> changes an option of the running sessions, and
+ *                      replies with "ok" or "error: <message>"
+ *
+ * The options that can be set are buffer-size, max-rate, max-input-rate,
+ * coalesce, cols, and rows, which take the values of the command-line
+ * options. The rates and coalesce also take "none", and cols and rows take
+ * "auto" to follow the terminal again. A request that starts with "GET " is
+ * taken for HTTP, so that Prometheus can scrape /metrics directly.
+ *
+ * The socket is served in the event loop of the sessions after their IO.
+ * Each iteration spends at most CONTROL_BUDGET on it: clients get a read or
+ * a write in turn until the budget is spent, and the rest wait for the next
+ * iteration, so a scraper delays forwarding by a request at most. */
+
+#define CONTROL_MAX_CLIENTS 4
+#define CONTROL_BUDGET 200 /* in microseconds */
+#define CONTROL_IO_SIZE 4096 /* the most read or written at a time */
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0 /* SO_NOSIGPIPE is set instead */
+#endif
+
+struct control_client_T {
+    struct watch_T watch;
+    bool open;
+    char request[1024];
+    size_t request_length;
+    struct report_T reply;
+    size_t reply_written;
+};
+
+static struct control_T {
+    struct event_loop_T *loop; /* NULL until the socket is served */
+    struct watch_T listen_watch;
+    int listen_fd;
+    struct control_client_T clients[CONTROL_MAX_CLIENTS];
+    size_t client_count;
+    size_t next; /* the client served first in the next iteration */
+} control_socket = { .listen_fd = -1, };
+
+static void remove_control_socket(void) {
+    if (!is_child_process)
+        unlink(options.control_path);
+}
+
+static void open_control_socket(void) {
+    control_socket.listen_fd =
+        open_listener(options.control_path, remove_control_socket);
+}
+
+static void init_control_socket(struct event_loop_T *loop) {
+    control_socket.loop = loop;
+    add_watch(loop, &control_socket.listen_watch, control_socket.listen_fd,
+            &control_socket);
+    control_socket.listen_watch.interest = EVENT_READ;
+    apply_interest(loop, &control_socket.listen_watch);
+}
+
+static void accept_control_client(void) {
+    struct control_client_T *client = control_socket.clients;
+    while (client->open)
+        client++;
+    int fd = accept(control_socket.listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    set_cloexec(fd);
+    set_nonblocking(fd);
+#if defined(SO_NOSIGPIPE)
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof on);
+#endif /* defined(SO_NOSIGPIPE) */
+    add_watch(control_socket.loop, &client->watch, fd, &control_socket);
+    client->watch.interest = EVENT_READ;
+    apply_interest(control_socket.loop, &client->watch);
+    client->open = true;
+    client->request_length = 0;
+    client->reply.length = 0;
+    client->reply_written = 0;
+    control_socket.client_count++;
+}
+
+static void close_control_client(struct control_client_T *client) {
+    remove_watch(control_socket.loop, &client->watch);
+    close(client->watch.fd);
+    client->open = false;
+    control_socket.client_count--;
+}
+
+static void append_metric_header(struct report_T *report,
+        const char *name, const char *type, const char *help) {
+    append_report(report, "# HELP ptwrap_%s %s\n# TYPE ptwrap_%s %s\n",
+            name, help, name, type);
+}
+
+/* Appends a counter of the channels in both directions. */
+static void append_channel_metric(struct report_T *report,
+        const char *name, const char *help,
+        uint64_t incoming, uint64_t outgoing) {
+    append_metric_header(report, name, "counter", help);
+    append_report(report, "ptwrap_%s{direction=\"input\"} %llu\n"
+            "ptwrap_%s{direction=\"output\"} %llu\n",
+            name, (unsigned long long) incoming,
+            name, (unsigned long long) outgoing);
+}
+
+/* Appends a latency histogram. Bucket i counts delays below 2^(i+1) us,
+ * which are whole microseconds, so its upper bound is 2^(i+1) - 1. */
+static void append_histogram_metric(struct report_T *report,
+        const char *name, const char *help, const uint64_t histogram[]) {
+    append_metric_header(report, name, "histogram", help);
+    uint64_t count = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        count += histogram[i];
+        if (i < LATENCY_BUCKETS - 1)
+            append_report(report, "ptwrap_%s_bucket{le=\"%llu\"} %llu\n",
+                    name, ((unsigned long long) 2 << i) - 1,
+                    (unsigned long long) count);
+    }
+    append_report(report, "ptwrap_%s_bucket{le=\"+Inf\"} %llu\n"
+            "ptwrap_%s_count %llu\n", name, (unsigned long long) count,
+            name, (unsigned long long) count);
+}
+
+static void append_metrics(struct report_T *report,
+        const struct session_T *sessions, uint64_t now) {
+    const struct channel_stats_T *in = &stats.incoming, *out = &stats.outgoing;
+    append_metric_header(report, "uptime_seconds", "gauge",
+            "Seconds since the wrapper started.");
+    append_report(report, "ptwrap_uptime_seconds %.6f\n",
+            (double) (now - stats.start_time) / 1e6);
+    append_metric_header(report, "wakeups_total", "counter",
+            "Wakeups of the event loop.");
+    append_report(report, "ptwrap_wakeups_total %llu\n",
+            (unsigned long long) stats.wakeups);
+
+    append_channel_metric(report, "bytes_total", "Bytes forwarded.",
+            in->bytes, out->bytes);
+    append_channel_metric(report, "reads_total", "Reads from the source.",
+            in->reads, out->reads);
+    append_channel_metric(report, "writes_total",
+            "Writes to the destination.", in->writes, out->writes);
+    append_channel_metric(report, "short_writes_total",
+            "Writes that took only part of the data.",
+            in->short_writes, out->short_writes);
+    append_channel_metric(report, "eagain_total",
+            "Operations that failed with EAGAIN.", in->eagains, out->eagains);
+    append_channel_metric(report, "eintr_total",
+            "Operations that failed with EINTR.", in->eintrs, out->eintrs);
+    append_channel_metric(report, "overflows_total",
+            "Times the buffer overflowed (see --overflow).",
+            in->overflows, out->overflows);
+    append_channel_metric(report, "dropped_bytes_total",
+            "Bytes dropped on overflow.", in->dropped, out->dropped);
+    append_channel_metric(report, "spilled_bytes_total",
+            "Bytes spilled to a file on overflow.",
+            in->spilled, out->spilled);
+    append_metric_header(report, "blocked_seconds_total", "counter",
+            "Seconds the buffer was full.");
+    append_report(report,
+            "ptwrap_blocked_seconds_total{direction=\"input\"} %.6f\n"
+            "ptwrap_blocked_seconds_total{direction=\"output\"} %.6f\n",
+            (double) in->blocked_time / 1e6,
+            (double) out->blocked_time / 1e6);
+
+    size_t session_count = 0, buffered[2] = { 0, 0 }, capacity[2] = { 0, 0 };
+    for (const struct session_T *s = sessions; s != NULL; s = s->next) {
+        session_count++;
+        if (s->interactive) {
+            buffered[0] += ring_length(&s->incoming.buffer);
+            capacity[0] += s->incoming.buffer.size;
+        }
+        buffered[1] += ring_length(&s->outgoing.buffer);
+        capacity[1] += s->outgoing.buffer.size;
+    }
+    append_metric_header(report, "sessions", "gauge", "Running sessions.");
+    append_report(report, "ptwrap_sessions %zu\n", session_count);
+    append_metric_header(report, "buffered_bytes", "gauge",
+            "Bytes waiting in the buffers.");
+    append_report(report, "ptwrap_buffered_bytes{direction=\"input\"} %zu\n"
+            "ptwrap_buffered_bytes{direction=\"output\"} %zu\n",
+            buffered[0], buffered[1]);
+    append_metric_header(report, "buffer_capacity_bytes", "gauge",
+            "Bytes allocated to the buffers.");
+    append_report(report,
+            "ptwrap_buffer_capacity_bytes{direction=\"input\"} %zu\n"
+            "ptwrap_buffer_capacity_bytes{direction=\"output\"} %zu\n",
+            capacity[0], capacity[1]);
+
+    append_histogram_metric(report, "output_latency_microseconds",
+            "Delay from reading output to writing it.",
+            stats.output_latency);
+    append_histogram_metric(report, "loop_latency_microseconds",
+            "Time from waking up to waiting again.", stats.loop_latency);
+}
+
+/* Applies a new --buffer-size to an elastic buffer. A full buffer grows
+ * at once, and an empty one shrinks to the new limit. */
+static void set_buffer_limit(struct channel_T *channel) {
+    if (channel->buffer_limit == 0)
+        return;
+    channel->buffer_limit = options.buffer_size;
+    if (ring_length(&channel->buffer) == 0)
+        shrink_buffer(channel);
+    else
+        grow_buffer(channel);
+}
+
+/* Changes an option of the running sessions. Returns an error message, or
+ * NULL if the option has been set. */
+static const char *apply_setting(const char *name, const char *value,
+        struct session_T *sessions, uint64_t now) {
+    if (strcmp(name, "buffer-size") == 0) {
+        size_t size;
+        if (!scan_size(value, &size) || size == 0)
+            return "invalid size";
+        options.buffer_size = size;
+        for (struct session_T *s = sessions; s != NULL; s = s->next) {
+            if (s->interactive)
+                set_buffer_limit(&s->incoming);
+            set_buffer_limit(&s->outgoing);
+        }
+    } else if (strcmp(name, "max-rate") == 0 ||
+            strcmp(name, "max-input-rate") == 0) {
+        bool input = strcmp(name, "max-input-rate") == 0;
+        size_t rate = 0, burst = 0;
+        if (strcmp(value, "none") != 0 && !scan_rate(value, &rate, &burst))
+            return "invalid rate";
+        *(input ? &options.max_input_rate : &options.max_rate) = rate;
+        *(input ? &options.max_input_burst : &options.max_burst) = burst;
+        for (struct session_T *s = sessions; s != NULL; s = s->next)
+            if (!input || s->interactive)
+                limit_rate(input ? &s->incoming : &s->outgoing,
+                        rate, burst, now);
+    } else if (strcmp(name, "coalesce") == 0) {
+        uint64_t window = 0;
+        size_t budget = 0;
+        if (strcmp(value, "none") != 0 &&
+                !scan_coalesce(value, &window, &budget))
+            return "invalid value";
+        if (options.low_latency && window > 0)
+            return "cannot coalesce with --low-latency";
+        options.coalesce_window = window;
+        options.coalesce_budget = budget;
+        for (struct session_T *s = sessions; s != NULL; s = s->next)
+            enable_coalescing(&s->outgoing);
+    } else if (strcmp(name, "cols") == 0 || strcmp(name, "rows") == 0) {
+        unsigned short dimension = 0;
+        if (strcmp(value, "auto") != 0 && !scan_dimension(value, &dimension))
+            return "invalid size";
+        *(name[0] == 'c' ? &options.columns : &options.rows) = dimension;
+        /* as if the terminal had been resized */
+        should_set_terminal_size = true;
+    } else {
+        return "unknown option";
+    }
+    return NULL;
+}
+
+/* Answers an HTTP request for /metrics. */
+static void answer_http_request(struct control_client_T *client,
+        struct session_T *sessions, uint64_t now) {
+    const char *path = &client->request[4];
+    size_t length = strcspn(path, " \r\n");
+    if (length != 8 || strncmp(path, "/metrics", length) != 0) {
+        append_report(&client->reply, "HTTP/1.0 404 Not Found\r\n"
+                "Content-Type: text/plain\r\nContent-Length: 10\r\n\r\n"
+                "not found\n");
+        return;
+    }
+    struct report_T body = { .length = 0 };
+    append_metrics(&body, sessions, now);
+    append_report(&client->reply, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n\r\n%s", body.length, body.data);
+}
+
+static void answer_control_request(struct control_client_T *client,
+        struct session_T *sessions, uint64_t now) {
+    char *request = client->request;
+    if (strncmp(request, "GET ", 4) == 0) {
+        answer_http_request(client, sessions, now);
+        return;
+    }
+    request[strcspn(request, "\r\n")] = '\0';
+    char name[32], value[64];
+    int end = 0;
+    if (strcmp(request, "metrics") == 0) {
+        append_metrics(&client->reply, sessions, now);
+    } else if (sscanf(request, "set %31s %63s %n", name, value, &end) == 2 &&
+            request[end] == '\0') {
+        const char *error = apply_setting(name, value, sessions, now);
+        if (error != NULL)
+            append_report(&client->reply, "error: %s\n", error);
+        else
+            append_report(&client->reply, "ok\n");
+    } else {
+        append_report(&client->reply, "error: invalid request\n");
+    }
+}
+
+/* Returns true if the request has been received to its end, which is the
+ * end of the line or, for HTTP, the blank line after the headers. */
+static bool is_complete_request(const char *request) {
+    if (strncmp(request, "GET ", 4) == 0)
+        return strstr(request, "\n\r\n") != NULL ||
+            strstr(request, "\n\n") != NULL;
+    return strchr(request, '\n') != NULL;
+}
+
+/* Reads the request of a client and answers it once it is complete or the
+ * client has shut down its side of the connection. */
+static void read_control_request(struct control_client_T *client,
+        struct session_T *sessions, uint64_t now) {
+    size_t space = sizeof client->request - 1 - client->request_length;
+    ssize_t size = read(client->watch.fd,
+            &client->request[client->request_length],
+            space < CONTROL_IO_SIZE ? space : CONTROL_IO_SIZE);
+    if (size < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (size < 0 || (size == 0 && client->request_length == 0)) {
+        close_control_client(client);
+        return;
+    }
+    if (size > 0) {
+        client->request_length += (size_t) size;
+        client->request[client->request_length] = '\0';
+        if (!is_complete_request(client->request)) {
+            if (client->request_length < sizeof client->request - 1)
+                return;
+            append_report(&client->reply, "error: request too long\n");
+        }
+    }
+    if (client->reply.length == 0)
+        answer_control_request(client, sessions, now);
+    client->watch.interest = EVENT_WRITE;
+    apply_interest(control_socket.loop, &client->watch);
+}
+
+static void write_control_reply(struct control_client_T *client) {
+    size_t length = client->reply.length - client->reply_written;
+    ssize_t size = send(client->watch.fd,
+            &client->reply.data[client->reply_written],
+            length < CONTROL_IO_SIZE ? length : CONTROL_IO_SIZE,
+            MSG_NOSIGNAL);
+    if (size < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (size < 0) {
+        close_control_client(client);
+        return;
+    }
+    client->reply_written += (size_t) size;
+    if (client->reply_written < client->reply.length)
+        return;
+    /* Closing a socket with unread input resets the connection, which
+     * would discard the reply before the client has read it. */
+    while (read(client->watch.fd, client->request, sizeof client->request)
+            > 0)
+        continue;
+    close_control_client(client);
+}
+
+/* Serves the control socket within CONTROL_BUDGET. `sessions' is the list
+ * of sessions to which requests apply. */
+static void process_control_socket(
+        struct session_T *sessions, uint64_t now) {
+    uint64_t deadline = current_time() + CONTROL_BUDGET;
+    size_t first = control_socket.next;
+    control_socket.next = (first + 1) % CONTROL_MAX_CLIENTS;
+    for (size_t n = 0; n < CONTROL_MAX_CLIENTS; n++) {
+        size_t i = (first + n) % CONTROL_MAX_CLIENTS;
+        struct control_client_T *client = &control_socket.clients[i];
+        if (!client->open || client->watch.ready == 0)
+            continue;
+        if (current_time() >= deadline) {
+            control_socket.next = i;
+            return;
+        }
+        if (client->watch.ready & EVENT_READ)
+            read_control_request(client, sessions, now);
+        else
+            write_control_reply(client);
+    }
+
+    if ((control_socket.listen_watch.ready & EVENT_READ) &&
+            control_socket.client_count < CONTROL_MAX_CLIENTS &&
+            current_time() < deadline)
+        accept_control_client();
+    /* Connections wait in the backlog while all the clients are in use. */
+    control_socket.listen_watch.interest =
+        control_socket.client_count < CONTROL_MAX_CLIENTS ? EVENT_READ : 0;
+    apply_interest(control_socket.loop, &control_socket.listen_watch);
+}
+
+#if defined(USE_IO_URING)
+
+/* The io_uring forwarder (--io-uring). Instead of waiting for readiness
+ * and then reading or writing, reads and writes are submitted to the ring
+ * and the channels advance when they complete. Each channel has at most one
+ * read into the free space and one write from the buffered data in flight,
+ * which never overlap. All submissions and completions of an iteration are
+ * handled by a single io_uring_enter call. */
+
+#define URING_ENTRIES 8
+
+/* The user data of operations: the index of the channel times 2, plus 1
+ * for writes. URING_SIGNAL is a read from the signalfd. */
+enum { URING_READ = 0, URING_WRITE = 1, URING_SIGNAL = 4, };
+
+struct uring_T {
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    bool fixed; /* the buffers of the channels are registered */
+};
+
+struct uring_channel_T {
+    struct channel_T *channel;
+    bool reading, writing;
+    struct iovec target; /* the free space being read into */
+    size_t write_length;
+};
+
+static void close_uring(struct uring_T *ring) {
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/* Sets up the ring. Returns false if io_uring is not available, for
+ * example because the kernel is too old or a seccomp filter denies it. */
+static bool open_uring(struct uring_T *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return false;
+    ring->sq_ring = ring->cq_ring = ring->sqes = NULL;
+    if (!(params.features & IORING_FEAT_EXT_ARG) ||
+            !(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close_uring(ring);
+        return false;
+    }
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        close_uring(ring);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            close_uring(ring);
+            return false;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        close_uring(ring);
+        return false;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    ring->fixed = false;
+    return true;
+}
+
+/* Registers the buffers so that the kernel does not have to map them for
+ * every operation. Without this, the operations still work, just more
+ * slowly, so failure (e.g. due to RLIMIT_MEMLOCK) is ignored. */
+static void register_buffers(struct uring_T *ring,
+        struct uring_channel_T channels[], size_t count) {
+    struct iovec buffers[2];
+    for (size_t i = 0; i < count; i++) {
+        buffers[i].iov_base = channels[i].channel->buffer.data;
+        buffers[i].iov_len = channels[i].channel->buffer.size;
+    }
+    ring->fixed = syscall(__NR_io_uring_register, ring->fd,
+            IORING_REGISTER_BUFFERS, buffers, (unsigned) count) == 0;
+}
+
+/* Queues a read or write at the current file position. If `buffer' is
+ * non-negative, the address is in the registered buffer of that index. */
+static void submit_rw(struct uring_T *ring, int opcode, int fd,
+        const struct iovec *iov, int buffer, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = (uint8_t) opcode;
+    sqe->fd = fd;
+    sqe->off = (uint64_t) -1;
+    sqe->addr = (uint64_t) (uintptr_t) iov->iov_base;
+    sqe->len = iov->iov_len > UINT_MAX ? UINT_MAX : (unsigned) iov->iov_len;
+    if (buffer >= 0)
+        sqe->buf_index = (uint16_t) buffer;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+/* Submits the operations the channel is ready for. */
+static void submit_channel(struct uring_T *ring,
+        struct uring_channel_T *uc, size_t index, uint64_t now) {
+    struct channel_T *channel = uc->channel;
+    struct iovec iov[2];
+    int buffer = ring->fixed ? (int) index : -1;
+
+    if (!uc->reading && channel->readable &&
+            ring_space(&channel->buffer) > 0) {
+        ring_space_iov(&channel->buffer, iov);
+        uc->target = iov[0];
+        submit_rw(ring, ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                channel->from->fd, &iov[0], buffer, index * 2 + URING_READ);
+        uc->reading = true;
+    }
+    if (!uc->writing && should_flush(channel, now)) {
+        int count = ring_data_iov(&channel->buffer, iov);
+        limit_iov(iov, &count, channel->write_limit);
+        uc->write_length = iov[0].iov_len;
+        submit_rw(ring, ring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+                channel->to->fd, &iov[0], buffer, index * 2 + URING_WRITE);
+        uc->writing = true;
+    }
+}
+
+/* Submits the queued operations and waits for at least one completion or
+ * the timeout in microseconds (negative to wait indefinitely). */
+static void enter_uring(struct uring_T *ring, int64_t timeout) {
+    struct __kernel_timespec timeout_spec = {
+        .tv_sec = timeout / 1000000, .tv_nsec = timeout % 1000000 * 1000,
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = timeout < 0 ? 0 : (uint64_t) (uintptr_t) &timeout_spec,
+    };
+    long count = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+    if (count < 0) {
+        if (errno != EINTR && errno != ETIME && errno != EBUSY)
+            errno_exit("cannot find file descriptor to forward");
+        count = 0;
+    }
+    ring->to_submit -= (unsigned) count;
+}
+
+static void complete_channel(struct uring_channel_T *uc,
+        uint64_t user_data, int32_t result, uint64_t now) {
+    struct channel_T *channel = uc->channel;
+    if (result < 0)
+        errno = -result;
+    if ((user_data & 1) == URING_READ) {
+        uc->reading = false;
+        if (result == -EINTR || result == -EAGAIN)
+            count_error(channel->stats);
+        else
+            finish_read(channel, result, &uc->target, 1, now);
+    } else {
+        uc->writing = false;
+        finish_write(channel, result, uc->write_length, now);
+    }
+}
+
+/* Forwards IO like forward_all_io using io_uring. Returns false without
+ * doing anything if io_uring is not available. */
+static bool forward_all_io_uring(int master_fd) {
+    struct uring_T ring;
+    if (!open_uring(&ring))
+        return false;
+
+    struct event_loop_T loop;
+    struct session_T session;
+    open_event_loop(&loop, true);
+    init_session(&session, &loop, master_fd, STDIN_FILENO, STDOUT_FILENO,
+            &stats);
+    struct uring_channel_T channels[] = {
+        { .channel = &session.outgoing, },
+        { .channel = &session.incoming, },
+    };
+    size_t channel_count = sizeof channels / sizeof *channels;
+    register_buffers(&ring, channels, channel_count);
+
+    struct signalfd_siginfo info;
+    struct iovec signal_iov = { .iov_base = &info, .iov_len = sizeof info };
+    bool reading_signal = false;
+
+    while (is_active(&session.outgoing)) {
+        uint64_t now = current_time();
+        for (size_t i = 0; i < channel_count; i++)
+            submit_channel(&ring, &channels[i], i, now);
+        if (!reading_signal) {
+            submit_rw(&ring, IORING_OP_READ, loop.signal_fd, &signal_iov, -1,
+                    URING_SIGNAL);
+            reading_signal = true;
+        }
+
+        enter_uring(&ring, earlier_timeout(
+                    channel_timeout(&session.outgoing, now),
+                    resize_timeout(now)));
+        stats.wakeups++;
+
+        now = current_time();
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            if (cqe->user_data == URING_SIGNAL) {
+                reading_signal = false;
+                if (cqe->res == (int32_t) sizeof info)
+                    receive_signal((int) info.ssi_signo);
+            } else {
+                complete_channel(&channels[cqe->user_data / 2],
+                        cqe->user_data, cqe->res, now);
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        if (take_resize(now))
+            set_terminal_size(master_fd);
+        if (should_report_stats) {
+            should_report_stats = false;
+            report_stats(&stats);
+        }
+        if (should_snapshot_screen)
+            request_snapshot();
+        add_latency(stats.loop_latency, current_time() - now);
+    }
+
+    /* Closing the ring cancels the operations still in flight, such as a
+     * read from stdin. */
+    close_uring(&ring);
+    return true;
+}
+
+#endif /* defined(USE_IO_URING) */
+
+static void forward_all_io(int master_fd, pid_t child_pid) {
+#if defined(USE_IO_URING)
+    if (options.io_uring && forward_all_io_uring(master_fd))
+        return;
+    options.io_uring = false;
+#endif /* defined(USE_IO_URING) */
+
+    struct event_loop_T loop;
+    struct session_T session;
+    open_event_loop(&loop, true);
+    init_session(&session, &loop, master_fd, STDIN_FILENO, STDOUT_FILENO,
+            &stats);
+    watch_exit(&loop, &session, child_pid);
+    session.next = NULL;
+    if (options.control_path != NULL)
+        init_control_socket(&loop);
+
+    /* Loop until all output from the slave is forwarded, so that we don't
+     * miss any output. On the other hand, we don't know exactly how much
+     * input should be forwarded to the slave before the child process
+     * terminates, so we just keep forwarding the input. */
+    while (/* is_active(&session.incoming) || */
+            is_active(&session.outgoing)) {
+        uint64_t now = current_time();
+        update_session_interest(&loop, &session, now);
+
+        /* await next IO */
+        await_events(&loop, earlier_timeout(
+                    session_timeout(&session, now),
+                    resize_timeout(now)));
+        stats.wakeups++;
+        now = current_time();
+        if (take_resize(now))
+            set_terminal_size(master_fd);
+        if (should_report_stats) {
+            should_report_stats = false;
+            report_stats(&stats);
+        }
+        if (should_snapshot_screen)
+            request_snapshot();
+        check_exit(&loop, &session, now);
+
+        /* read to or write from buffer */
+        process_session(&session, now);
+        if (options.control_path != NULL)
+            process_control_socket(&session, now);
+        add_latency(stats.loop_latency, current_time() - now);
+    }
+}
+
+/* Raises the scheduling priority of the wrapper for --low-latency. This is
+ * done after the command has been started so that it does not inherit the
+ * priority. */
+static void raise_priority(void) {
+    int error = 0;
+    switch (options.priority) {
+    case PRIORITY_NORMAL:
+        return;
+    case PRIORITY_FIFO:
+#if defined(USE_THREADS)
+        {
+            struct sched_param param = {
+                .sched_priority = sched_get_priority_min(SCHED_FIFO),
+            };
+            error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        }
+#endif /* defined(USE_THREADS) */
+        break;
+    case PRIORITY_NICE:
+        if (setpriority(PRIO_PROCESS, 0, LOW_LATENCY_NICE) < 0)
+            error = errno;
+        break;
+    }
+    if (error != 0)
+        fprintf(stderr, "%s: cannot raise priority: %s\n", program_name,
+                strerror(error));
+}
+
+static int convert_wait_status(int wait_status) {
+    if (WIFEXITED(wait_status))
+        return WEXITSTATUS(wait_status);
+    if (WIFSIGNALED(wait_status))
+        return WTERMSIG(wait_status) | 0x80;
+    return EXIT_FAILURE;
+}
+
+static int await_child(pid_t child_pid) {
+    int wait_status;
+    if (waitpid(child_pid, &wait_status, 0) != child_pid)
+        errno_exit("cannot await child process");
+    return convert_wait_status(wait_status);
+}
+
+#if defined(USE_SPAWN)
+
+/* Spawns a child process that executes the command in the slave
+ * pseudo-terminal. Unlike fork, posix_spawn does not copy the page tables of
+ * the wrapper, which makes starting short commands much faster. The child
+ * becomes a session leader before the slave is opened at stdin, so on
+ * Linux the slave becomes its controlling terminal just by opening it
+ * without O_NOCTTY. The other fds are close-on-exec. */
+static pid_t spawn_child(const char *slave_name, char *argv[]) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    if (posix_spawn_file_actions_init(&actions) != 0 ||
+            posix_spawnattr_init(&attributes) != 0)
+        error_exit("cannot spawn child process");
+    if (posix_spawn_file_actions_addopen(
+                &actions, STDIN_FILENO, slave_name, O_RDWR, 0) != 0 ||
+            posix_spawn_file_actions_adddup2(
+                &actions, STDIN_FILENO, STDOUT_FILENO) != 0 ||
+            posix_spawn_file_actions_adddup2(
+                &actions, STDIN_FILENO, STDERR_FILENO) != 0 ||
+            posix_spawnattr_setflags(&attributes,
+                POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK) != 0 ||
+            posix_spawnattr_setsigmask(&attributes, &original_mask) != 0)
+        error_exit("cannot spawn child process");
+
+    pid_t child_pid;
+    int error = posix_spawnp(
+            &child_pid, argv[0], &actions, &attributes, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (error != 0) {
+        errno = error;
+        errno_exit(argv[0]);
+    }
+    return child_pid;
+}
+
+#else
+
+static void restore_sigmask(void) {
+    if (sigprocmask(SIG_SETMASK, &original_mask, NULL) < 0)
+        errno_exit("sigprocmask");
+}
+
+static void become_session_leader(void) {
+    if (setsid() < 0)
+        errno_exit("cannot create new session");
+}
+
+static void prepare_slave_pseudo_terminal_fds(const char *slave_name) {
+    /* How to become the controlling process of a slave pseudo-terminal is
+     * implementation-dependent. We support two implementation schemes:
+     * (1) A process automatically becomes the controlling process when it
+     * first opens the terminal.
+     * (2) A process needs to use the TIOCSCTTY ioctl system call.
+     * There is a race condition in both schemes: an unrelated process could
+     * become the controlling process before we do, in which case the slave is
+     * not our controlling terminal and therefore we should abort. */
+
+    if (close(STDIN_FILENO) < 0)
+        errno_exit("cannot close old stdin");
+    int slave_fd = open(slave_name, O_RDWR);
+    if (slave_fd != STDIN_FILENO)
+        errno_exit("cannot open slave pseudo-terminal at stdin");
+
+    if (close(STDOUT_FILENO) < 0)
+        errno_exit("cannot close old stdout");
+    if (dup(slave_fd) != STDOUT_FILENO)
+        errno_exit("cannot open slave pseudo-terminal at stdout");
+
+    if (close(STDERR_FILENO) < 0)
+        errno_exit("cannot close old stderr");
+    if (dup(slave_fd) != STDERR_FILENO)
+        errno_exit("cannot open slave pseudo-terminal at stderr");
+
+#ifdef TIOCSCTTY
+    ioctl(slave_fd, TIOCSCTTY, NULL);
+#endif /* defined(TIOCSCTTY) */
+
+    if (tcgetpgrp(slave_fd) != getpgrp())
+        error_exit(
+                "cannot become controlling process of slave pseudo-terminal");
+}
+
+static void exec_command(char *argv[]) {
+    execvp(argv[0], argv);
+    errno_exit(argv[0]);
+}
+
+#endif /* defined(USE_SPAWN) */
+
+/* Starts a child process that executes the command in the slave
+ * pseudo-terminal. Returns the process ID of the child. */
+static pid_t start_child(int master_fd, const char *slave_name, int slave_fd,
+        char *argv[]) {
+#if defined(USE_SPAWN)
+    (void) master_fd, (void) slave_fd;
+    return spawn_child(slave_name, argv);
+#else
+    pid_t child_pid = fork();
+    if (child_pid < 0)
+        errno_exit("cannot spawn child process");
+    if (child_pid == 0) {
+        /* child process */
+        is_child_process = true;
+        close(master_fd);
+        become_session_leader();
+        prepare_slave_pseudo_terminal_fds(slave_name);
+        close(slave_fd);
+        restore_sigmask();
+        exec_command(argv);
+    }
+    return child_pid;
+#endif /* defined(USE_SPAWN) */
+}
+
+/* The multiplexed mode */
+
+#define MAX_SPEC_LENGTH 16384
+
+/* A shard runs an event loop over a subset of the sessions. Without
+ * --threads, there is only one shard, which runs in the main thread. With
+ * --threads, each shard runs in a thread of its own and only communicates
+ * with the main thread through its inbox when sessions start and exit. */
+struct shard_T {
+    struct event_loop_T loop;
+    struct session_T *sessions, *touched;
+    struct stats_T *stats;
+    size_t load; /* number of children that have not exited */
+#if defined(USE_THREADS)
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    struct message_T *inbox_head, *inbox_tail;
+    int wake_fds[2];
+    struct watch_T wake_watch;
+    bool stopping;
+#endif /* defined(USE_THREADS) */
+};
+
+/* A pseudo-terminal whose slave has been opened */
+struct pty_T {
+    int master_fd, slave_fd;
+    char *slave_name;
+};
+
+static void open_pty(struct pty_T *pty) {
+    pty->master_fd = prepare_master_pseudo_terminal();
+    pty->slave_name = strdup(slave_pseudo_terminal_name(pty->master_fd));
+    if (pty->slave_name == NULL)
+        errno_exit("cannot allocate memory");
+    pty->slave_fd = open_noctty(pty->slave_name);
+}
+
+static void close_pty(struct pty_T *pty) {
+    close(pty->slave_fd);
+    close(pty->master_fd);
+    free(pty->slave_name);
+}
+
+struct server_T {
+    struct event_loop_T *main_loop;
+    struct shard_T *shards;
+    size_t shard_count;
+    bool threaded;
+    /* Session specifications are read from stdin, one per line. */
+    struct watch_T spec_watch;
+    bool reading_specs;
+    char spec_buffer[MAX_SPEC_LENGTH];
+    size_t spec_length;
+    /* Sessions whose child has not yet been reaped */
+    struct session_T **children;
+    size_t child_count, child_capacity;
+    /* Pseudo-terminals opened in advance (--pty-pool). When the pool falls
+     * below the low watermark, it is refilled up to the high watermark
+     * whenever the main loop has nothing else to do. */
+    struct pty_T *pool;
+    size_t pool_count;
+    bool refilling_pool;
+    int exit_status;
+#if defined(USE_THREADS)
+    struct event_loop_T loop; /* the main loop in the threaded mode */
+    pthread_mutex_t mutex; /* protects the fields below and stdout */
+    struct stats_T report;
+    size_t report_pending;
+#endif /* defined(USE_THREADS) */
+};
+
+/* Opens the output of a session. If the pathname names a socket, it is
+ * connected to. Otherwise, the file is created or truncated. */
+static int open_output(const char *pathname) {
+    struct stat st;
+    int fd;
+    if (stat(pathname, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        fd = connect_socket(pathname);
+        if (fd < 0)
+            return -1;
+    } else {
+        fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+            return -1;
+    }
+    set_cloexec(fd);
+    return fd;
+}
+
+static void lock_server(struct server_T *server) {
+#if defined(USE_THREADS)
+    if (server->threaded)
+        pthread_mutex_lock(&server->mutex);
+#else
+    (void) server;
+#endif /* defined(USE_THREADS) */
+}
+
+static void unlock_server(struct server_T *server) {
+#if defined(USE_THREADS)
+    if (server->threaded)
+        pthread_mutex_unlock(&server->mutex);
+#else
+    (void) server;
+#endif /* defined(USE_THREADS) */
+}
+
+/* Reports the exit status of a session on stdout. */
+static void report_session(
+        struct server_T *server, const char *name, int exit_status) {
+    char line[MAX_SPEC_LENGTH + 16];
+    int length = snprintf(line, sizeof line, "%d %s\n", exit_status, name);
+    lock_server(server);
+    if (length > 0)
+        write_all(STDOUT_FILENO, line,
+                (size_t) length < sizeof line ? (size_t) length : sizeof line);
+    if (exit_status > server->exit_status)
+        server->exit_status = exit_status;
+    unlock_server(server);
+}
+
+static void touch_session(struct shard_T *shard, struct session_T *session) {
+    if (session->touched)
+        return;
+    session->touched = true;
+    session->next_touched = shard->touched;
+    shard->touched = session;
+}
+
+/* Adds a session whose child has been started to the shard. This must be
+ * called in the thread of the shard. */
+static void adopt_session(
+        struct shard_T *shard, struct session_T *session, uint64_t now) {
+    init_session(session, &shard->loop, session->master_fd, -1,
+            session->output_watch.fd, shard->stats);
+    update_session_interest(&shard->loop, session, now);
+
+    session->prev = NULL;
+    session->next = shard->sessions;
+    if (shard->sessions != NULL)
+        shard->sessions->prev = session;
+    shard->sessions = session;
+}
+
+static void finish_session(struct server_T *server,
+        struct shard_T *shard, struct session_T *session) {
+    remove_watch(&shard->loop, &session->master_watch);
+    remove_watch(&shard->loop, &session->output_watch);
+#if defined(USE_SPLICE)
+    disable_splice(&session->outgoing);
+#endif /* defined(USE_SPLICE) */
+    close(session->master_fd);
+    close(session->output_watch.fd);
+    free(session->outgoing.buffer.data);
+    close_spill(&session->outgoing.spill);
+    if (session->outgoing.stamper != NULL) {
+        free(session->outgoing.stamper->marks);
+        free(session->outgoing.stamper);
+    }
+
+    report_session(server, session->name, session->exit_status);
+
+    if (session->prev != NULL)
+        session->prev->next = session->next;
+    else
+        shard->sessions = session->next;
+    if (session->next != NULL)
+        session->next->prev = session->prev;
+    free((char *) session->name);
+    free(session);
+}
+
+#if defined(USE_THREADS)
+
+struct message_T {
+    struct message_T *next;
+    enum { MESSAGE_START, MESSAGE_EXIT, MESSAGE_RESIZE, MESSAGE_REPORT,
+        MESSAGE_STOP, } type;
+    struct session_T *session;
+    int exit_status;
+};
+
+static void post_message(struct shard_T *shard, int type,
+        struct session_T *session, int exit_status) {
+    struct message_T *message = malloc(sizeof *message);
+    if (message == NULL)
+        errno_exit("cannot allocate message");
+    message->next = NULL;
+    message->type = type;
+    message->session = session;
+    message->exit_status = exit_status;
+
+    pthread_mutex_lock(&shard->mutex);
+    bool was_empty = shard->inbox_head == NULL;
+    if (was_empty)
+        shard->inbox_head = message;
+    else
+        shard->inbox_tail->next = message;
+    shard->inbox_tail = message;
+    pthread_mutex_unlock(&shard->mutex);
+
+    /* The shard drains the whole inbox when woken, so one byte in the pipe
+     * is enough. */
+    if (was_empty)
+        write_all(shard->wake_fds[1], "", 1);
+}
+
+/* Adds the statistics of the shard to the pending report and writes the
+ * report if this is the last shard to do so. */
+static void contribute_report(struct server_T *server, struct shard_T *shard) {
+    pthread_mutex_lock(&server->mutex);
+    merge_stats(&server->report, shard->stats);
+    if (--server->report_pending == 0)
+        report_stats(&server->report);
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static void receive_messages(struct server_T *server,
+        struct shard_T *shard, uint64_t now) {
+    char bytes[64];
+    while (read(shard->wake_fds[0], bytes, sizeof bytes) == sizeof bytes)
+        ;
+
+    pthread_mutex_lock(&shard->mutex);
+    struct message_T *message = shard->inbox_head;
+    shard->inbox_head = shard->inbox_tail = NULL;
+    pthread_mutex_unlock(&shard->mutex);
+
+    while (message != NULL) {
+        struct message_T *next = message->next;
+        switch (message->type) {
+        case MESSAGE_START:
+            adopt_session(shard, message->session, now);
+            break;
+        case MESSAGE_EXIT:
+            message->session->child_exited = true;
+            message->session->exit_status = message->exit_status;
+            message->session->exit_time = now;
+            touch_session(shard, message->session);
+            break;
+        case MESSAGE_RESIZE:
+            for (struct session_T *s = shard->sessions; s != NULL;
+                    s = s->next)
+                set_terminal_size(s->master_fd);
+            break;
+        case MESSAGE_REPORT:
+            contribute_report(server, shard);
+            break;
+        case MESSAGE_STOP:
+            shard->stopping = true;
+            break;
+        }
+        free(message);
+        message = next;
+    }
+}
+
+#endif /* defined(USE_THREADS) */
+
+static void add_child(struct server_T *server, struct session_T *session) {
+    if (server->child_count == server->child_capacity) {
+        server->child_capacity = server->child_capacity * 2 + 8;
+        server->children = xrealloc(server->children,
+                server->child_capacity, sizeof *server->children);
+    }
+    server->children[server->child_count++] = session;
+    session->shard->load++;
+}
+
+/* Returns the shard with the fewest running children. */
+static struct shard_T *least_loaded_shard(struct server_T *server) {
+    struct shard_T *shard = &server->shards[0];
+    for (size_t i = 1; i < server->shard_count; i++)
+        if (server->shards[i].load < shard->load)
+            shard = &server->shards[i];
+    return shard;
+}
+
+/* Gets a pseudo-terminal from the pool, or opens a new one if the pool is
+ * empty. */
+static void take_pty(struct server_T *server, struct pty_T *pty) {
+    if (server->pool_count == 0) {
+        open_pty(pty);
+    } else {
+        *pty = server->pool[--server->pool_count];
+    }
+    if (server->pool_count < options.pool_low)
+        server->refilling_pool = true;
+}
+
+static void refill_pool(struct server_T *server) {
+    open_pty(&server->pool[server->pool_count++]);
+    if (server->pool_count >= options.pool_high)
+        server->refilling_pool = false;
+}
+
+/* Starts a session from a specification line, which consists of the
+ * pathname of the output and a command line for sh separated by a space. */
+static void start_session(struct server_T *server, char *spec, uint64_t now) {
+    char *command = strchr(spec, ' ');
+    if (command == NULL || command == spec) {
+        fprintf(stderr, "%s: invalid session: %s\n", program_name, spec);
+        return;
+    }
+    *command++ = '\0';
+
+    int output_fd = open_output(spec);
+    if (output_fd < 0) {
+        warn_errno("cannot open output", spec);
+        report_session(server, spec, 126);
+        return;
+    }
+    /* The overflow policies only take effect if writing does not block. */
+    if (options.overflow != OVERFLOW_BLOCK)
+        set_nonblocking(output_fd);
+
+    struct session_T *session = malloc(sizeof *session);
+    char *name = strdup(spec);
+    if (session == NULL || name == NULL)
+        errno_exit("cannot allocate session");
+    session->name = name;
+    session->output_watch.fd = output_fd;
+
+    struct pty_T pty;
+    take_pty(server, &pty);
+    set_terminal_size(pty.master_fd);
+    char *argv[] = { "sh", "-c", command, NULL, };
+    session->master_fd = pty.master_fd;
+    session->child_pid =
+        start_child(pty.master_fd, pty.slave_name, pty.slave_fd, argv);
+    close(pty.slave_fd);
+    free(pty.slave_name);
+
+    session->shard = least_loaded_shard(server);
+    add_child(server, session);
+#if defined(USE_THREADS)
+    if (server->threaded) {
+        post_message(session->shard, MESSAGE_START, session, 0);
+        return;
+    }
+#endif /* defined(USE_THREADS) */
+    adopt_session(session->shard, session, now);
+}
+
+static void read_specs(struct server_T *server, uint64_t now) {
+    ssize_t size = read(server->spec_watch.fd,
+            &server->spec_buffer[server->spec_length],
+            sizeof server->spec_buffer - server->spec_length);
+    if (size < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (size <= 0) {
+        server->reading_specs = false;
+        return;
+    }
+    server->spec_length += size;
+
+    char *start = server->spec_buffer, *newline;
+    while ((newline = memchr(start, '\n',
+                    &server->spec_buffer[server->spec_length] - start))
+            != NULL) {
+        *newline = '\0';
+        if (newline > start)
+            start_session(server, start, now);
+        start = newline + 1;
+    }
+    server->spec_length -= start - server->spec_buffer;
+    memmove(server->spec_buffer, start, server->spec_length);
+    if (server->spec_length == sizeof server->spec_buffer)
+        error_exit("session specification too long");
+}
+
+static void reap_children(struct server_T *server) {
+    should_reap_children = false;
+    for (;;) {
+        int wait_status;
+        pid_t pid = waitpid(-1, &wait_status, WNOHANG);
+        if (pid <= 0)
+            break;
+        for (size_t i = 0; i < server->child_count; i++) {
+            struct session_T *session = server->children[i];
+            if (session->child_pid != pid)
+                continue;
+            server->children[i] = server->children[--server->child_count];
+            session->shard->load--;
+            int exit_status = convert_wait_status(wait_status);
+#if defined(USE_THREADS)
+            if (server->threaded) {
+                post_message(session->shard, MESSAGE_EXIT, session,
+                        exit_status);
+                break;
+            }
+#endif /* defined(USE_THREADS) */
+            session->child_exited = true;
+            session->exit_status = exit_status;
+            session->exit_time = current_time();
+            touch_session(session->shard, session);
+            break;
+        }
+    }
+}
+
+/* Returns true if sessions may need to be processed without an event. */
+static bool has_session_timeouts(void) {
+    return options.coalesce_window > 0 || options.max_rate > 0 ||
+        options.drain_timeout >= 0;
+}
+
+static int64_t shard_timeout(struct shard_T *shard, uint64_t now) {
+    int64_t timeout = -1;
+    if (!has_session_timeouts())
+        return timeout;
+    for (struct session_T *s = shard->sessions; s != NULL; s = s->next) {
+        int64_t t = session_timeout(s, now);
+        if (t >= 0 && (timeout < 0 || t < timeout))
+            timeout = t;
+    }
+    return timeout;
+}
+
+/* Handles the watches of the shard that have become ready and processes
+ * the sessions that need it. */
+static void process_shard(
+        struct server_T *server, struct shard_T *shard, uint64_t now) {
+    for (size_t i = 0; i < shard->loop.ready_count; i++) {
+        struct watch_T *watch = shard->loop.ready[i];
+        if (watch == &server->spec_watch)
+            read_specs(server, now);
+#if defined(USE_THREADS)
+        else if (watch == &shard->wake_watch)
+            receive_messages(server, shard, now);
+#endif /* defined(USE_THREADS) */
+        else if (watch->owner != &control_socket)
+            touch_session(shard, watch->owner);
+    }
+    if (has_session_timeouts())
+        for (struct session_T *s = shard->sessions; s != NULL; s = s->next)
+            if (session_timeout(s, now) == 0)
+                touch_session(shard, s);
+
+    while (shard->touched != NULL) {
+        struct session_T *session = shard->touched;
+        shard->touched = session->next_touched;
+        session->touched = false;
+        process_session(session, now);
+        if (session->child_exited && !is_active(&session->outgoing))
+            finish_session(server, shard, session);
+        else
+            update_session_interest(&shard->loop, session, now);
+    }
+}
+
+#if defined(USE_THREADS)
+
+struct shard_start_T {
+    struct server_T *server;
+    struct shard_T *shard;
+};
+
+static void *run_shard(void *argument) {
+    struct shard_start_T *start = argument;
+    struct server_T *server = start->server;
+    struct shard_T *shard = start->shard;
+    free(start);
+
+    while (!shard->stopping || shard->sessions != NULL) {
+        uint64_t now = current_time();
+        await_events(&shard->loop, shard_timeout(shard, now));
+        shard->stats->wakeups++;
+        process_shard(server, shard, current_time());
+    }
+    return NULL;
+}
+
+static void start_shard_thread(
+        struct server_T *server, struct shard_T *shard) {
+    if (pipe(shard->wake_fds) < 0)
+        errno_exit("cannot create pipe");
+    set_cloexec(shard->wake_fds[0]);
+    set_cloexec(shard->wake_fds[1]);
+    set_nonblocking(shard->wake_fds[0]);
+    add_watch(&shard->loop, &shard->wake_watch, shard->wake_fds[0], NULL);
+    shard->wake_watch.interest = EVENT_READ;
+    apply_interest(&shard->loop, &shard->wake_watch);
+
+    pthread_mutex_init(&shard->mutex, NULL);
+    shard->inbox_head = shard->inbox_tail = NULL;
+    shard->stopping = false;
+    shard->stats = calloc(1, sizeof *shard->stats);
+    struct shard_start_T *start = malloc(sizeof *start);
+    if (shard->stats == NULL || start == NULL)
+        errno_exit("cannot allocate shard");
+    start->server = server;
+    start->shard = shard;
+    int error = pthread_create(&shard->thread, NULL, run_shard, start);
+    if (error != 0) {
+        errno = error;
+        errno_exit("cannot create thread");
+    }
+}
+
+#endif /* defined(USE_THREADS) */
+
+/* Runs sessions specified on stdin until stdin reaches the end and all the
+ * sessions have finished. Returns the greatest exit status of the
+ * sessions. */
+static int serve_sessions(void) {
+    struct server_T server;
+    server.threaded = options.threads > 0;
+    server.shard_count = server.threaded ? options.threads : 1;
+    server.shards = xrealloc(NULL, server.shard_count, sizeof *server.shards);
+    server.reading_specs = true;
+    server.spec_length = 0;
+    server.children = NULL;
+    server.child_count = server.child_capacity = 0;
+    server.pool = xrealloc(NULL, options.pool_high, sizeof *server.pool);
+    server.pool_count = 0;
+    server.refilling_pool = false;
+    server.exit_status = EXIT_SUCCESS;
+    while (server.pool_count < options.pool_high)
+        refill_pool(&server);
+
+    for (size_t i = 0; i < server.shard_count; i++) {
+        struct shard_T *shard = &server.shards[i];
+        /* In the threaded mode, the main loop receives the signals. */
+        open_event_loop(&shard->loop, !server.threaded);
+        shard->sessions = shard->touched = NULL;
+        shard->stats = &stats;
+        shard->load = 0;
+    }
+    server.main_loop = &server.shards[0].loop;
+#if defined(USE_THREADS)
+    if (server.threaded) {
+        pthread_mutex_init(&server.mutex, NULL);
+        open_event_loop(&server.loop, true);
+        server.main_loop = &server.loop;
+        for (size_t i = 0; i < server.shard_count; i++)
+            start_shard_thread(&server, &server.shards[i]);
+    }
+#endif /* defined(USE_THREADS) */
+    add_watch(server.main_loop, &server.spec_watch, STDIN_FILENO, NULL);
+    if (options.control_path != NULL)
+        init_control_socket(server.main_loop);
+
+    while (server.reading_specs || server.child_count > 0 ||
+            (!server.threaded && server.shards[0].sessions != NULL)) {
+        uint64_t now = current_time();
+        server.spec_watch.interest = server.reading_specs ? EVENT_READ : 0;
+        apply_interest(server.main_loop, &server.spec_watch);
+
+        await_events(server.main_loop, server.refilling_pool ? 0 :
+                earlier_timeout(server.threaded ? -1 :
+                    shard_timeout(&server.shards[0], now),
+                    resize_timeout(now)));
+        stats.wakeups++;
+        if (should_reap_children)
+            reap_children(&server);
+        if (take_resize(current_time())) {
+#if defined(USE_THREADS)
+            for (size_t i = 0; server.threaded && i < server.shard_count; i++)
+                post_message(&server.shards[i], MESSAGE_RESIZE, NULL, 0);
+#endif /* defined(USE_THREADS) */
+            if (!server.threaded)
+                for (struct session_T *s = server.shards[0].sessions;
+                        s != NULL; s = s->next)
+                    set_terminal_size(s->master_fd);
+        }
+        if (should_report_stats) {
+            should_report_stats = false;
+#if defined(USE_THREADS)
+            if (server.threaded) {
+                pthread_mutex_lock(&server.mutex);
+                server.report = stats;
+                server.report_pending = server.shard_count;
+                pthread_mutex_unlock(&server.mutex);
+                for (size_t i = 0; i < server.shard_count; i++)
+                    post_message(&server.shards[i], MESSAGE_REPORT, NULL, 0);
+            }
+#endif /* defined(USE_THREADS) */
+            if (!server.threaded)
+                report_stats(&stats);
+        }
+
+        now = current_time();
+        if (server.threaded) {
+            for (size_t i = 0; i < server.main_loop->ready_count; i++)
+                if (server.main_loop->ready[i] == &server.spec_watch)
+                    read_specs(&server, now);
+        } else {
+            process_shard(&server, &server.shards[0], now);
+            if (options.control_path != NULL)
+                process_control_socket(server.shards[0].sessions, now);
+        }
+        if (server.refilling_pool && server.main_loop->ready_count == 0)
+            refill_pool(&server);
+    }
+    while (server.pool_count > 0)
+        close_pty(&server.pool[--server.pool_count]);
+    free(server.pool);
+
+#if defined(USE_THREADS)
+    if (server.threaded) {
+        for (size_t i = 0; i < server.shard_count; i++)
+            post_message(&server.shards[i], MESSAGE_STOP, NULL, 0);
+        for (size_t i = 0; i < server.shard_count; i++) {
+            pthread_join(server.shards[i].thread, NULL);
+            merge_stats(&stats, server.shards[i].stats);
+        }
+    }
+#endif /* defined(USE_THREADS) */
+    return server.exit_status;
+}
+
+/* Detachable sessions (--host and --attach). The host runs the command with
+ * no terminal of its own and keeps its latest output in a scrollback ring,
+ * which is the buffer of the outgoing channel. A client attaches by passing
+ * its stdin and stdout over the Unix-domain socket, so that the host
+ * forwards IO between the pseudo-terminal and the client's terminal
+ * directly and the socket only carries control messages. On attach, the
+ * whole scrollback is written to the terminal with a single writev. While
+ * no client is attached, output is read as it comes and overwrites the
+ * oldest scrollback. */
+
+/* Messages on the socket. A client sends HOST_ATTACH with its stdin and
+ * stdout, then HOST_RESIZE whenever its window size changes. The host sends
+ * HOST_DETACHED when it has stopped using the client's terminal, or
+ * HOST_EXITED followed by a byte of the exit status when the command has
+ * exited. */
+enum {
+    HOST_ATTACH = 'a', HOST_RESIZE = 'w', HOST_DETACHED = 'd',
+    HOST_EXITED = 'x',
+};
+
+static struct host_T {
+    struct event_loop_T loop;
+    struct session_T session; /* interactive while a client is attached */
+    struct watch_T listen_watch, pending_watch, client_watch;
+    bool pending; /* a connection has been accepted but not attached */
+} host;
+
+static void remove_host_socket(void) {
+    if (!is_child_process)
+        unlink(options.host_path);
+}
+
+static void init_host(int master_fd, int listen_fd) {
+    struct session_T *session = &host.session;
+    open_event_loop(&host.loop, true);
+    add_watch(&host.loop, &host.listen_watch, listen_fd, NULL);
+    host.listen_watch.interest = EVENT_READ;
+    apply_interest(&host.loop, &host.listen_watch);
+    host.pending = false;
+
+    session->touched = false;
+    session->master_fd = master_fd;
+    session->interactive = false;
+    add_watch(&host.loop, &session->master_watch, master_fd, session);
+    init_channel(&session->incoming, &session->input_watch,
+            &session->master_watch, &stats.incoming);
+    session->incoming.detach_char = options.detach_char;
+    if (options.record_path != NULL)
+        session->incoming.record = RECORD_INPUT;
+    if (options.max_input_rate > 0)
+        limit_rate(&session->incoming, options.max_input_rate,
+                options.max_input_burst, current_time());
+    session->incoming.paste = new_paste();
+    make_elastic(&session->incoming);
+    set_nonblocking(master_fd);
+    init_channel(&session->outgoing, &session->master_watch,
+            &session->output_watch, &stats.outgoing);
+    free(session->outgoing.buffer.data);
+    init_ring(&session->outgoing.buffer, options.scrollback_size);
+    configure_outgoing(&session->outgoing, &stats);
+    session->outgoing.reply = &session->incoming;
+
+    /* Neither the end of the original terminal nor a client that has gone
+     * away should kill the host. The command has been started, so it does
+     * not inherit these. */
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/* Forgets the output buffered while no client is attached. It remains in the
+ * scrollback. */
+static void skip_output(struct channel_T *channel) {
+    channel->buffer.tail = channel->buffer.head;
+    channel->arrival_tail = channel->arrival_head;
+    channel->full_since = 0;
+}
+
+/* Stops using the terminal of the attached client and sends the message to
+ * it. */
+static void detach_client(const char *message, size_t length) {
+    struct session_T *session = &host.session;
+    remove_watch(&host.loop, &session->input_watch);
+    remove_watch(&host.loop, &session->output_watch);
+    remove_watch(&host.loop, &host.client_watch);
+    close(session->input_watch.fd);
+    close(session->output_watch.fd);
+    write_all(host.client_watch.fd, message, length);
+    close(host.client_watch.fd);
+    session->interactive = false;
+    terminal_fd = -1;
+    skip_output(&session->outgoing);
+}
+
+static void attach_client(int socket_fd, int input_fd, int output_fd) {
+    struct session_T *session = &host.session;
+    if (session->interactive) {
+        char message = HOST_DETACHED;
+        detach_client(&message, 1);
+    }
+    add_watch(&host.loop, &host.client_watch, socket_fd, NULL);
+    host.client_watch.interest = EVENT_READ;
+    apply_interest(&host.loop, &host.client_watch);
+    add_watch(&host.loop, &session->input_watch, input_fd, session);
+    add_watch(&host.loop, &session->output_watch, output_fd, session);
+    session->interactive = true;
+    session->incoming.readable = true;
+    session->incoming.buffer.tail = session->incoming.buffer.head;
+
+    /* Rewind to the oldest output retained, so that the scrollback is
+     * written before new output is read. */
+    struct ring_T *scrollback = &session->outgoing.buffer;
+    scrollback->tail = scrollback->head < scrollback->size ? 0 :
+        scrollback->head - scrollback->size;
+
+    terminal_fd = output_fd;
+    set_terminal_size(session->master_fd);
+}
+
+static void accept_client(void) {
+    int fd = accept(host.listen_watch.fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    set_cloexec(fd);
+    set_nonblocking(fd);
+    /* A connection that has not sent its terminal yet is superseded. */
+    if (host.pending) {
+        remove_watch(&host.loop, &host.pending_watch);
+        close(host.pending_watch.fd);
+    }
+    add_watch(&host.loop, &host.pending_watch, fd, NULL);
+    host.pending_watch.interest = EVENT_READ;
+    apply_interest(&host.loop, &host.pending_watch);
+    host.pending = true;
+}
+
+/* Receives the attach message of the pending connection. */
+static void receive_client(void) {
+    char message;
+    struct iovec iov = { .iov_base = &message, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(2 * sizeof (int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof control.buffer,
+    };
+    int fd = host.pending_watch.fd;
+    ssize_t size = recvmsg(fd, &msg, 0);
+    if (size < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    remove_watch(&host.loop, &host.pending_watch);
+    host.pending = false;
+
+    int fds[2];
+    size_t fd_count = 0;
+    for (struct cmsghdr *header = size > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+            header != NULL; header = CMSG_NXTHDR(&msg, header)) {
+        if (header->cmsg_level != SOL_SOCKET ||
+                header->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+        for (size_t i = 0; i < count; i++) {
+            int received;
+            memcpy(&received, &CMSG_DATA(header)[i * sizeof (int)],
+                    sizeof received);
+            if (fd_count < 2)
+                fds[fd_count++] = received;
+            else
+                close(received);
+        }
+    }
+    if (size == 1 && message == HOST_ATTACH && fd_count == 2) {
+        set_cloexec(fds[0]);
+        set_cloexec(fds[1]);
+        attach_client(fd, fds[0], fds[1]);
+        return;
+    }
+    while (fd_count > 0)
+        close(fds[--fd_count]);
+    close(fd);
+}
+
+static void read_control(void) {
+    char messages[64];
+    ssize_t size = read(host.client_watch.fd, messages, sizeof messages);
+    if (size < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (size <= 0) {
+        detach_client(NULL, 0);
+        return;
+    }
+    for (ssize_t i = 0; i < size; i++)
+        if (messages[i] == HOST_RESIZE)
+            should_set_terminal_size = true;
+}
+
+/* Forwards IO until all output of the command has been read, and written
+ * if a client is attached. */
+/* Writes as much of the buffered input as the non-blocking master takes. */
+static void write_input_now(struct session_T *session, uint64_t now) {
+    struct channel_T *incoming = &session->incoming;
+    size_t length = ring_length(&incoming->buffer);
+    if (length == 0)
+        return;
+    struct iovec iov[2];
+    int count = ring_data_iov(&incoming->buffer, iov);
+    finish_write(incoming, writev(session->master_fd, iov, count), length,
+            now);
+}
+
+static void serve_host(int master_fd, int listen_fd, pid_t child_pid) {
+    struct session_T *session = &host.session;
+    init_host(master_fd, listen_fd);
+    watch_exit(&host.loop, session, child_pid);
+
+    while (is_active(&session->outgoing)) {
+        uint64_t now = current_time();
+        update_session_interest(&host.loop, session, now);
+
+        await_events(&host.loop, earlier_timeout(
+                    session_timeout(session, now),
+                    resize_timeout(now)));
+        stats.wakeups++;
+        now = current_time();
+        if (take_resize(now))
+            set_terminal_size(master_fd);
+        if (should_report_stats) {
+            should_report_stats = false;
+            report_stats(&stats);
+        }
+        if (should_snapshot_screen)
+            request_snapshot();
+
+        if (host.listen_watch.ready & EVENT_READ)
+            accept_client();
+        if (host.pending && (host.pending_watch.ready & EVENT_READ))
+            receive_client();
+        if (session->interactive && (host.client_watch.ready & EVENT_READ))
+            read_control();
+        check_exit(&host.loop, session, now);
+
+        process_session(session, now);
+        /* The detach character or the end of the client's input. What was
+         * typed before it is passed on if the master takes it now, which
+         * it does without blocking. */
+        if (session->interactive && !session->incoming.readable) {
+            write_input_now(session, now);
+            char message = HOST_DETACHED;
+            detach_client(&message, 1);
+        }
+        /* Without a client, only send triggers put input in the buffer. */
+        if (!session->interactive) {
+            write_input_now(session, now);
+            skip_output(&session->outgoing);
+        }
+        add_latency(stats.loop_latency, current_time() - now);
+    }
+}
+
+/* Sends the exit status to the attached client, if any, and removes the
+ * socket. */
+static void close_host(int exit_status) {
+    remove_host_socket();
+    if (host.session.interactive) {
+        char message[] = { HOST_EXITED, (char) exit_status, };
+        detach_client(message, sizeof message);
+    }
+    if (host.pending)
+        close(host.pending_watch.fd);
+    close(host.listen_watch.fd);
+}
+
+/* Runs --attach. Returns the exit status of the command if it exits while
+ * attached. */
+static int attach_host(void) {
+    int fd = connect_socket(options.attach_path);
+    if (fd < 0) {
+        warn_errno("cannot connect to socket", options.attach_path);
+        return EXIT_FAILURE;
+    }
+    set_cloexec(fd);
+    disable_canonical_io();
+    make_stdio_nonblocking(STDOUT_FILENO);
+    install_signal_handlers();
+    signal(SIGPIPE, SIG_IGN);
+
+    char message = HOST_ATTACH;
+    int fds[] = { STDIN_FILENO, STDOUT_FILENO, };
+    struct iovec iov = { .iov_base = &message, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof fds)];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof control.buffer,
+    };
+    struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(header), fds, sizeof fds);
+    if (sendmsg(fd, &msg, 0) < 0) {
+        warn_errno("cannot attach", options.attach_path);
+        return EXIT_FAILURE;
+    }
+
+    struct event_loop_T loop;
+    struct watch_T watch;
+    open_event_loop(&loop, true);
+    add_watch(&loop, &watch, fd, NULL);
+    watch.interest = EVENT_READ;
+    apply_interest(&loop, &watch);
+
+    bool exited = false;
+    for (;;) {
+        await_events(&loop, -1);
+        if (should_set_terminal_size) {
+            should_set_terminal_size = false;
+            message = HOST_RESIZE;
+            write_all(fd, &message, 1);
+        }
+        if (!(watch.ready & EVENT_READ))
+            continue;
+
+        char messages[64];
+        ssize_t size = read(fd, messages, sizeof messages);
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            break;
+        for (ssize_t i = 0; i < size; i++) {
+            if (exited)
+                return (unsigned char) messages[i];
+            if (messages[i] == HOST_DETACHED) {
+                enable_canonical_io();
+                fprintf(stderr, "%s: detached from %s\n",
+                        program_name, options.attach_path);
+                return EXIT_SUCCESS;
+            }
+            exited = messages[i] == HOST_EXITED;
+        }
+    }
+    enable_canonical_io();
+    fprintf(stderr, "%s: %s: connection closed by host\n",
+            program_name, options.attach_path);
+    return EXIT_FAILURE;
+}
+
+/* Network streaming (--stream). The wrapper connects to a collector over
+ * TCP and exchanges frames with it, each of a one-byte type and a four-byte
+ * little-endian payload length followed by the payload. The output of the
+ * command is sent in STREAM_DATA frames, each of which covers the buffered
+ * output up to STREAM_MAX_FRAME bytes and is sent together with its header
+ * in a single sendmsg. Output is numbered by its byte offset since the
+ * command started. On connecting, the wrapper sends STREAM_HELLO with the
+ * protocol version and its id, and the collector answers with STREAM_RESUME
+ * and the offset it has received up to. The wrapper resumes from there if
+ * that output is still in the scrollback, or else from the oldest output
+ * retained, and sends STREAM_OFFSET with where it resumes so that the
+ * collector can tell a gap. While disconnected, the output overwrites the
+ * oldest scrollback as in --host, and the wrapper reconnects with
+ * exponential backoff. The collector sends input in STREAM_INPUT frames and
+ * window sizes in STREAM_WINDOW frames. When the command has exited,
+ * STREAM_EXIT carries its exit status. */
+
+enum {
+    STREAM_HELLO = 'H', STREAM_OFFSET = 'O', STREAM_DATA = 'D',
+    STREAM_EXIT = 'X', /* from the wrapper */
+    STREAM_RESUME = 'R', STREAM_INPUT = 'I', STREAM_WINDOW = 'W',
+};
+
+#define STREAM_VERSION 1
+#define STREAM_HEADER_SIZE 5
+#define STREAM_MAX_FRAME (64 * 1024)
+#define STREAM_RETRY_MIN 100000 /* microseconds */
+#define STREAM_RETRY_MAX 5000000
+#if defined(USE_ZEROCOPY)
+/* Smaller sends are cheaper to copy than to pin and complete. */
+#define ZEROCOPY_MIN (16 * 1024)
+#define ZEROCOPY_CAPACITY 64 /* a power of 2 */
+#endif /* defined(USE_ZEROCOPY) */
+
+static struct stream_T {
+    struct addrinfo *addresses, *address; /* the next address to try */
+    char id[STREAM_MAX_ID + 1];
+    enum {
+        STREAM_DISCONNECTED, STREAM_CONNECTING, STREAM_HANDSHAKE,
+        STREAM_RUNNING,
+    } state;
+    uint64_t retry_time, retry_delay;
+    struct event_loop_T loop;
+    /* The output watch of the session is the socket. The incoming channel
+     * only writes; the input is put into it as it is unframed. */
+    struct session_T session;
+    unsigned char header[STREAM_HEADER_SIZE]; /* of the current frame */
+    size_t header_written, frame_left; /* frame_left is of the payload */
+    unsigned char input[STREAM_HEADER_SIZE + STREAM_MAX_FRAME];
+    size_t input_length;
+#if defined(USE_ZEROCOPY)
+    /* Sends with MSG_ZEROCOPY pin the output in the ring until the kernel
+     * reports their completion on the error queue of the socket. The
+     * kernel numbers them from 0 on each socket. */
+    struct zerocopy_T {
+        size_t start; /* what the send pins begins here */
+        bool done;
+    } sends[ZEROCOPY_CAPACITY];
+    uint32_t send_head, send_tail;
+#endif /* defined(USE_ZEROCOPY) */
+} stream;
+
+/* Resolves the address of --stream, given as <host>:<port>, where an IPv6
+ * address is enclosed in brackets. */
+#if !defined(USE_GETADDRINFO)
+
+/* Returns the address of a numeric host and port, or NULL if either is not
+ * numeric. */
+static struct addrinfo *parse_numeric_address(
+        const char *host, const char *port) {
+    static struct sockaddr_storage address;
+    static struct addrinfo info;
+    char *end;
+    errno = 0;
+    unsigned long number = strtoul(port, &end, 10);
+    if (errno != 0 || end == port || *port == '-' || *end != '\0' ||
+            number > 65535)
+        return NULL;
+
+    memset(&address, 0, sizeof address);
+    memset(&info, 0, sizeof info);
+    struct sockaddr_in *in = (struct sockaddr_in *) &address;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &address;
+    if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t) number);
+        info.ai_addrlen = sizeof *in;
+    } else if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons((uint16_t) number);
+        info.ai_addrlen = sizeof *in6;
+    } else {
+        return NULL;
+    }
+    info.ai_family = address.ss_family;
+    info.ai_socktype = SOCK_STREAM;
+    info.ai_addr = (struct sockaddr *) &address;
+    info.ai_next = NULL;
+    return &info;
+}
+
+#endif /* !defined(USE_GETADDRINFO) */
+
+static void resolve_stream_address(void) {
+    const char *colon = strrchr(options.stream_address, ':');
+    if (colon == NULL || colon[1] == '\0')
+        error_exit("--stream requires <host>:<port>");
+    const char *host = options.stream_address;
+    size_t host_length = (size_t) (colon - host);
+    if (host_length >= 2 && host[0] == '[' && host[host_length - 1] == ']')
+        host++, host_length -= 2;
+    char *name = xrealloc(NULL, host_length + 1, 1);
+    memcpy(name, host, host_length);
+    name[host_length] = '\0';
+
+#if defined(USE_GETADDRINFO)
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM,
+    };
+    int error = getaddrinfo(name, &colon[1], &hints, &stream.addresses);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s: %s\n", program_name,
+                options.stream_address, gai_strerror(error));
+        exit(EXIT_FAILURE);
+    }
+#else
+    stream.addresses = parse_numeric_address(name, &colon[1]);
+    if (stream.addresses == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", program_name,
+                options.stream_address,
+                "numeric address required in a static build");
+        exit(EXIT_FAILURE);
+    }
+#endif /* defined(USE_GETADDRINFO) */
+    free(name);
+    stream.address = stream.addresses;
+}
+
+static void send_frame(int type, const void *payload, size_t length) {
+    unsigned char frame[STREAM_HEADER_SIZE + STREAM_MAX_ID + 1];
+    assert(length <= sizeof frame - STREAM_HEADER_SIZE);
+    frame[0] = (unsigned char) type;
+    put_le(&frame[1], length, 4);
+    memcpy(&frame[STREAM_HEADER_SIZE], payload, length);
+    write_all(stream.session.output_watch.fd, (const char *) frame,
+            STREAM_HEADER_SIZE + length);
+}
+
+static void disconnect_stream(uint64_t now) {
+    remove_watch(&stream.loop, &stream.session.output_watch);
+    close(stream.session.output_watch.fd);
+    stream.state = STREAM_DISCONNECTED;
+    stream.retry_time = now + stream.retry_delay;
+    stream.retry_delay = stream.retry_delay * 2 < STREAM_RETRY_MAX ?
+        stream.retry_delay * 2 : STREAM_RETRY_MAX;
+    stream.frame_left = stream.input_length = 0;
+#if defined(USE_ZEROCOPY)
+    stream.send_head = stream.send_tail = 0;
+#endif /* defined(USE_ZEROCOPY) */
+}
+
+/* Starts connecting to the next address of the collector. */
+static void connect_stream(uint64_t now) {
+    struct addrinfo *address = stream.address;
+    stream.address = address->ai_next != NULL ?
+        address->ai_next : stream.addresses;
+
+    int fd = socket(address->ai_family, address->ai_socktype,
+            address->ai_protocol);
+    if (fd < 0) {
+        stream.retry_time = now + stream.retry_delay;
+        return;
+    }
+    set_cloexec(fd);
+    set_nonblocking(fd);
+    int on = 1;
+    /* Frames are already batched, so Nagle's algorithm would only delay
+     * echoes of the input. */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+#if defined(USE_ZEROCOPY)
+    stream.send_head = stream.send_tail = 0;
+    if (options.stream_zerocopy &&
+            setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on) < 0)
+        options.stream_zerocopy = false;
+#endif /* defined(USE_ZEROCOPY) */
+
+    add_watch(&stream.loop, &stream.session.output_watch, fd, NULL);
+    stream.state = STREAM_CONNECTING;
+    if (connect(fd, address->ai_addr, address->ai_addrlen) < 0 &&
+            errno != EINPROGRESS)
+        disconnect_stream(now);
+}
+
+static void finish_connect(uint64_t now) {
+    int error;
+    socklen_t length = sizeof error;
+    if (getsockopt(stream.session.output_watch.fd, SOL_SOCKET, SO_ERROR,
+                &error, &length) < 0 || error != 0) {
+        disconnect_stream(now);
+        return;
+    }
+    unsigned char hello[1 + STREAM_MAX_ID];
+    size_t id_length = strlen(stream.id);
+    hello[0] = STREAM_VERSION;
+    memcpy(&hello[1], stream.id, id_length);
+    send_frame(STREAM_HELLO, hello, 1 + id_length);
+    stream.state = STREAM_HANDSHAKE;
+}
+
+/* Resumes sending the output from the offset the collector has received
+ * up to, or the nearest output retained. */
+static void resume_stream(uint64_t offset) {
+    struct ring_T *scrollback = &stream.session.outgoing.buffer;
+    size_t oldest = scrollback->head < scrollback->size ? 0 :
+        scrollback->head - scrollback->size;
+    if (offset < oldest)
+        offset = oldest;
+    if (offset > scrollback->head)
+        offset = scrollback->head;
+    scrollback->tail = (size_t) offset;
+
+    unsigned char payload[8];
+    put_le(payload, offset, 8);
+    send_frame(STREAM_OFFSET, payload, sizeof payload);
+    stream.state = STREAM_RUNNING;
+    stream.retry_delay = STREAM_RETRY_MIN;
+}
+
+/* Handles a frame from the collector. Returns false if it has to wait
+ * until there is room for the input. */
+static bool handle_frame(int type, const unsigned char *payload,
+        size_t length, uint64_t now) {
+    struct channel_T *incoming = &stream.session.incoming;
+    switch (type) {
+    case STREAM_RESUME:
+        if (stream.state == STREAM_HANDSHAKE && length == 8)
+            resume_stream(get_le(payload, 8));
+        break;
+    case STREAM_INPUT:
+        if (ring_space(&incoming->buffer) < length)
+            return false;
+        insert_data(incoming, (const char *) payload, length, now);
+        incoming->stats->bytes += length;
+        incoming->stats->reads++;
+        break;
+    case STREAM_WINDOW:
+        /* The collector's size takes the place of --cols and --rows. */
+        if (length == 4) {
+            options.columns = (unsigned short) get_le(payload, 2);
+            options.rows = (unsigned short) get_le(&payload[2], 2);
+            should_set_terminal_size = true;
+        }
+        break;
+    }
+    return true;
+}
+
+/* Handles the complete frames received. */
+static void process_input(uint64_t now) {
+    size_t start = 0;
+    while (stream.input_length - start >= STREAM_HEADER_SIZE) {
+        const unsigned char *frame = &stream.input[start];
+        size_t length = get_le(&frame[1], 4);
+        if (length > STREAM_MAX_FRAME) {
+            disconnect_stream(now);
+            return;
+        }
+        if (stream.input_length - start < STREAM_HEADER_SIZE + length ||
+                !handle_frame(frame[0], &frame[STREAM_HEADER_SIZE], length,
+                    now))
+            break;
+        start += STREAM_HEADER_SIZE + length;
+    }
+    stream.input_length -= start;
+    memmove(stream.input, &stream.input[start], stream.input_length);
+}
+
+static void read_stream(uint64_t now) {
+    ssize_t size = read(stream.session.output_watch.fd,
+            &stream.input[stream.input_length],
+            sizeof stream.input - stream.input_length);
+    if (size < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (size <= 0) {
+        disconnect_stream(now);
+        return;
+    }
+    stream.input_length += (size_t) size;
+    process_input(now);
+}
+
+#if defined(USE_ZEROCOPY)
+
+/* Collects the completions of zerocopy sends. */
+static void reap_zerocopy(void) {
+    for (;;) {
+        union {
+            struct cmsghdr header;
+            char buffer[CMSG_SPACE(sizeof (struct sock_extended_err) +
+                    sizeof (struct sockaddr_in6))];
+        } control;
+        struct msghdr msg = {
+            .msg_control = control.buffer,
+            .msg_controllen = sizeof control.buffer,
+        };
+        if (recvmsg(stream.session.output_watch.fd, &msg, MSG_ERRQUEUE) < 0)
+            break;
+        for (struct cmsghdr *header = CMSG_FIRSTHDR(&msg); header != NULL;
+                header = CMSG_NXTHDR(&msg, header)) {
+            if (!(header->cmsg_level == IPPROTO_IP &&
+                        header->cmsg_type == IP_RECVERR) &&
+                    !(header->cmsg_level == IPPROTO_IPV6 &&
+                        header->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(header), sizeof error);
+            if (error.ee_errno != 0 ||
+                    error.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* The sends from ee_info to ee_data have completed. */
+            for (uint32_t id = error.ee_info;
+                    id - error.ee_info <= error.ee_data - error.ee_info;
+                    id++)
+                if (id - stream.send_tail <
+                        stream.send_head - stream.send_tail)
+                    stream.sends[id % ZEROCOPY_CAPACITY].done = true;
+        }
+    }
+    while (stream.send_tail != stream.send_head &&
+            stream.sends[stream.send_tail % ZEROCOPY_CAPACITY].done)
+        stream.send_tail++;
+}
+
+#endif /* defined(USE_ZEROCOPY) */
+
+/* Returns the position in the ring from which on the output must be kept:
+ * what has not been sent, and what zerocopy sends still pin. */
+static size_t output_floor(void) {
+    size_t floor = stream.session.outgoing.buffer.tail;
+#if defined(USE_ZEROCOPY)
+    if (stream.send_tail != stream.send_head) {
+        size_t start = stream.sends[stream.send_tail % ZEROCOPY_CAPACITY]
+            .start;
+        if (start < floor)
+            floor = start;
+    }
+#endif /* defined(USE_ZEROCOPY) */
+    return floor;
+}
+
+static size_t output_space(void) {
+    const struct ring_T *scrollback = &stream.session.outgoing.buffer;
+    return scrollback->size - (scrollback->head - output_floor());
+}
+
+static void read_output(uint64_t now) {
+    struct channel_T *channel = &stream.session.outgoing;
+    struct ring_T view = channel->buffer;
+    struct iovec iov[2];
+    view.tail = output_floor();
+    int count = ring_space_iov(&view, iov);
+    limit_iov(iov, &count, read_allowance(channel, now));
+    ssize_t size = readv(channel->from->fd, iov, count);
+    finish_read(channel, size, iov, count, now);
+}
+
+/* Sends the buffered output, continuing the current frame or starting a
+ * new one. */
+static void write_output(uint64_t now) {
+    struct channel_T *channel = &stream.session.outgoing;
+    size_t length = ring_length(&channel->buffer);
+    if (stream.frame_left == 0) {
+        stream.frame_left =
+            length < STREAM_MAX_FRAME ? length : STREAM_MAX_FRAME;
+        stream.header[0] = STREAM_DATA;
+        put_le(&stream.header[1], stream.frame_left, 4);
+        stream.header_written = 0;
+    }
+
+    struct iovec iov[3];
+    iov[0].iov_base = &stream.header[stream.header_written];
+    iov[0].iov_len = STREAM_HEADER_SIZE - stream.header_written;
+    int count = ring_data_iov(&channel->buffer, &iov[1]);
+    size_t data_length = limit_iov(&iov[1], &count,
+            stream.frame_left < channel->write_limit ?
+            stream.frame_left : channel->write_limit);
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count + 1, };
+    int flags = 0;
+#if defined(MSG_MORE)
+    /* Let the kernel fill segments while more output is to follow. */
+    if (length > data_length)
+        flags |= MSG_MORE;
+#endif /* defined(MSG_MORE) */
+#if defined(USE_ZEROCOPY)
+    if (options.stream_zerocopy && data_length >= ZEROCOPY_MIN &&
+            stream.send_head - stream.send_tail < ZEROCOPY_CAPACITY) {
+        if (iov[0].iov_len > 0) {
+            /* Send the header by itself so that only the ring is pinned */
+            msg.msg_iovlen = 1;
+            flags |= MSG_MORE;
+            data_length = 0;
+        } else {
+            msg.msg_iov = &iov[1];
+            msg.msg_iovlen = count;
+            flags |= MSG_ZEROCOPY;
+        }
+    }
+#endif /* defined(USE_ZEROCOPY) */
+
+    ssize_t size = sendmsg(channel->to->fd, &msg, flags);
+    if (size < 0) {
+        finish_write(channel, size, data_length, now);
+        if (errno != EAGAIN && errno != EINTR)
+            disconnect_stream(now);
+        return;
+    }
+#if defined(USE_ZEROCOPY)
+    if (flags & MSG_ZEROCOPY)
+        stream.sends[stream.send_head++ % ZEROCOPY_CAPACITY] =
+            (struct zerocopy_T) { .start = channel->buffer.tail, };
+#endif /* defined(USE_ZEROCOPY) */
+    size_t header_part = (size_t) size < iov[0].iov_len ?
+        (size_t) size : iov[0].iov_len;
+    if (msg.msg_iov == iov) {
+        stream.header_written += header_part;
+        size -= (ssize_t) header_part;
+    }
+    stream.frame_left -= (size_t) size;
+    finish_write(channel, size, data_length, now);
+}
+
+static void init_stream(int master_fd) {
+    struct session_T *session = &stream.session;
+    if (options.stream_id != NULL) {
+        strcpy(stream.id, options.stream_id);
+    } else {
+        char hostname[STREAM_MAX_ID - 16];
+        if (gethostname(hostname, sizeof hostname) < 0)
+            strcpy(hostname, "localhost");
+        hostname[sizeof hostname - 1] = '\0';
+        sprintf(stream.id, "%s:%ld", hostname, (long) getpid());
+    }
+    stream.state = STREAM_DISCONNECTED;
+    stream.retry_time = 0;
+    stream.retry_delay = STREAM_RETRY_MIN;
+    stream.frame_left = stream.input_length = 0;
+    open_event_loop(&stream.loop, true);
+
+    session->touched = false;
+    session->master_fd = master_fd;
+    session->interactive = true;
+    add_watch(&stream.loop, &session->master_watch, master_fd, session);
+    init_channel(&session->incoming, &session->input_watch,
+            &session->master_watch, &stats.incoming);
+    session->incoming.readable = false;
+    if (options.record_path != NULL)
+        session->incoming.record = RECORD_INPUT;
+    set_nonblocking(master_fd);
+    init_channel(&session->outgoing, &session->master_watch,
+            &session->output_watch, &stats.outgoing);
+    free(session->outgoing.buffer.data);
+    init_ring(&session->outgoing.buffer, options.scrollback_size);
+    configure_outgoing(&session->outgoing, &stats);
+    session->outgoing.reply = &session->incoming;
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void update_stream_interest(uint64_t now) {
+    struct session_T *session = &stream.session;
+    session->master_watch.interest = 0;
+    if (session->outgoing.readable && output_space() > 0 &&
+            read_allowance(&session->outgoing, now) > 0)
+        session->master_watch.interest |= EVENT_READ;
+    if (should_flush(&session->incoming, now))
+        session->master_watch.interest |= EVENT_WRITE;
+    apply_interest(&stream.loop, &session->master_watch);
+
+    if (stream.state == STREAM_DISCONNECTED)
+        return;
+    struct watch_T *socket_watch = &session->output_watch;
+    socket_watch->interest = 0;
+    if (stream.state == STREAM_CONNECTING)
+        socket_watch->interest |= EVENT_WRITE;
+    else if (stream.input_length < sizeof stream.input)
+        socket_watch->interest |= EVENT_READ;
+    if (stream.state == STREAM_RUNNING &&
+            should_flush(&session->outgoing, now))
+        socket_watch->interest |= EVENT_WRITE;
+    apply_interest(&stream.loop, socket_watch);
+}
+
+static int64_t retry_timeout(uint64_t now) {
+    if (stream.state != STREAM_DISCONNECTED)
+        return -1;
+    return stream.retry_time > now ? (int64_t) (stream.retry_time - now) : 0;
+}
+
+/* Forwards IO until all output of the command has been read, and sent if
+ * connected. */
+static void serve_stream(int master_fd, pid_t child_pid) {
+    struct session_T *session = &stream.session;
+    struct watch_T *socket_watch = &session->output_watch;
+    init_stream(master_fd);
+    watch_exit(&stream.loop, session, child_pid);
+
+    while (session->outgoing.readable || (stream.state == STREAM_RUNNING &&
+                ring_length(&session->outgoing.buffer) > 0)) {
+        uint64_t now = current_time();
+        if (stream.state == STREAM_DISCONNECTED && now >= stream.retry_time)
+            connect_stream(now);
+        update_stream_interest(now);
+
+        await_events(&stream.loop, earlier_timeout(earlier_timeout(
+                        session_timeout(session, now),
+                        resize_timeout(now)), retry_timeout(now)));
+        stats.wakeups++;
+        now = current_time();
+        if (take_resize(now))
+            set_terminal_size(master_fd);
+        if (should_report_stats) {
+            should_report_stats = false;
+            report_stats(&stats);
+        }
+        if (should_snapshot_screen)
+            request_snapshot();
+
+        if (stream.state == STREAM_CONNECTING &&
+                (socket_watch->ready & EVENT_WRITE))
+            finish_connect(now);
+        else if (stream.state != STREAM_DISCONNECTED &&
+                (socket_watch->ready & EVENT_READ)) {
+#if defined(USE_ZEROCOPY)
+            if (stream.send_tail != stream.send_head)
+                reap_zerocopy();
+#endif /* defined(USE_ZEROCOPY) */
+            read_stream(now);
+        }
+        check_exit(&stream.loop, session, now);
+        end_drain(session, now);
+        if (session->outgoing.readable &&
+                (session->master_watch.ready & EVENT_READ) &&
+                read_allowance(&session->outgoing, now) > 0)
+            read_output(now);
+        process_buffer(&session->incoming, now);
+        if (stream.state != STREAM_DISCONNECTED)
+            process_input(now);
+        if (stream.state == STREAM_RUNNING &&
+                (socket_watch->ready & EVENT_WRITE) &&
+                ring_length(&session->outgoing.buffer) > 0)
+            write_output(now);
+        if (stream.state != STREAM_RUNNING)
+            skip_output(&session->outgoing);
+        add_latency(stats.loop_latency, current_time() - now);
+    }
+}
+
+/* Sends the exit status to the collector if connected. */
+static void close_stream(int exit_status) {
+    if (stream.state == STREAM_RUNNING) {
+        unsigned char status = (unsigned char) exit_status;
+        send_frame(STREAM_EXIT, &status, 1);
+        shutdown(stream.session.output_watch.fd, SHUT_WR);
+    }
+    if (stream.state != STREAM_DISCONNECTED)
+        close(stream.session.output_watch.fd);
+#if defined(USE_GETADDRINFO)
+    freeaddrinfo(stream.addresses);
+#endif /* defined(USE_GETADDRINFO) */
+}
+
+/* A recording mapped for --replay */
+struct recording_T {
+    const char *pathname;
+    const unsigned char *map;
+    size_t size;
+    const unsigned char *index; /* in the format of the file */
+    size_t block_count;
+    unsigned char *rebuilt_index; /* non-NULL if the index was rebuilt */
+    unsigned char *raw; /* decompressed records */
+    size_t raw_capacity;
+};
+
+static void recording_error(const struct recording_T *recording,
+        const char *message) {
+    fprintf(stderr, "%s: %s: %s\n", program_name, recording->pathname,
+            message);
+    exit(EXIT_FAILURE);
+}
+
+/* Returns true if a whole block starts at `offset'. */
+static bool is_block(const struct recording_T *recording, uint64_t offset) {
+    if (offset > recording->size ||
+            recording->size - offset < BLOCK_HEADER_SIZE)
+        return false;
+    const unsigned char *block = &recording->map[offset];
+    return memcmp(block, BLOCK_MAGIC, 4) == 0 && get_le(&block[8], 4) <=
+        recording->size - offset - BLOCK_HEADER_SIZE;
+}
+
+/* Finds the index at the end of the file, or rebuilds it by walking the
+ * blocks if the recording was not finished. */
+static void load_index(struct recording_T *recording) {
+    size_t size = recording->size;
+    if (size >= FILE_HEADER_SIZE + TRAILER_SIZE) {
+        const unsigned char *trailer = &recording->map[size - TRAILER_SIZE];
+        uint64_t offset = get_le(trailer, 8), count = get_le(&trailer[8], 8);
+        if (memcmp(&trailer[16], INDEX_MAGIC, 8) == 0 &&
+                offset <= size - TRAILER_SIZE &&
+                count <= (size - TRAILER_SIZE) / INDEX_ENTRY_SIZE &&
+                count * INDEX_ENTRY_SIZE == size - TRAILER_SIZE - offset) {
+            recording->index = &recording->map[offset];
+            recording->block_count = (size_t) count;
+            return;
+        }
+    }
+
+    size_t capacity = 0;
+    recording->block_count = 0;
+    for (uint64_t offset = FILE_HEADER_SIZE; is_block(recording, offset);
+            offset += BLOCK_HEADER_SIZE +
+                get_le(&recording->map[offset + 8], 4)) {
+        if (recording->block_count == capacity) {
+            capacity = capacity * 2 + 64;
+            recording->rebuilt_index = xrealloc(recording->rebuilt_index,
+                    capacity, INDEX_ENTRY_SIZE);
+        }
+        unsigned char *entry = &recording->rebuilt_index[
+            recording->block_count++ * INDEX_ENTRY_SIZE];
+        put_le(entry, offset, 8);
+        memcpy(&entry[8], &recording->map[offset + 16], 16);
+    }
+    recording->index = recording->rebuilt_index;
+}
+
+/* Returns the index of the first block that has records at or after `time',
+ * or the number of blocks if there is none. */
+static size_t find_block(const struct recording_T *recording, uint64_t time) {
+    size_t low = 0, high = recording->block_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const unsigned char *entry =
+            &recording->index[middle * INDEX_ENTRY_SIZE];
+        if (get_le(&entry[16], 8) < time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/* Returns the records of the block at `offset', decompressing them if
+ * needed. Their length is assigned to `*length'. */
+static const unsigned char *block_records(struct recording_T *recording,
+        uint64_t offset, size_t *length) {
+    if (!is_block(recording, offset))
+        recording_error(recording, "corrupt index");
+    const unsigned char *block = &recording->map[offset];
+    size_t stored = (size_t) get_le(&block[8], 4);
+    switch (get_le(&block[4], 4)) {
+    case COMPRESSION_NONE:
+        *length = stored;
+        return &block[BLOCK_HEADER_SIZE];
+#if defined(PTWRAP_USE_ZSTD)
+    case COMPRESSION_ZSTD: {
+        size_t raw = (size_t) get_le(&block[12], 4);
+        if (raw > recording->raw_capacity) {
+            recording->raw = xrealloc(recording->raw, raw, 1);
+            recording->raw_capacity = raw;
+        }
+        size_t size = ZSTD_decompress(recording->raw, raw,
+                &block[BLOCK_HEADER_SIZE], stored);
+        if (ZSTD_isError(size) || size != raw)
+            recording_error(recording, "corrupt block");
+        *length = raw;
+        return recording->raw;
+    }
+#endif /* defined(PTWRAP_USE_ZSTD) */
+    default:
+        recording_error(recording, "unsupported compression");
+        return NULL;
+    }
+}
+
+/* Sleeps until `delay' microseconds (scaled by --speed) after `start'. */
+static void wait_for(uint64_t start, uint64_t delay) {
+    if (options.replay_speed == 0)
+        return;
+    uint64_t target = start + (uint64_t) ((double) delay /
+            options.replay_speed);
+    for (uint64_t now; (now = current_time()) < target; ) {
+        struct timespec duration = {
+            .tv_sec = (time_t) ((target - now) / 1000000),
+            .tv_nsec = (long) ((target - now) % 1000000 * 1000),
+        };
+        nanosleep(&duration, NULL);
+    }
+}
+
+/* Writes the output in the recording to stdout with the original timing,
+ * starting from --seek. The file is mapped rather than read, so seeking
+ * reads only the index entries visited by the binary search and the blocks
+ * after the position. */
+static int replay(const char *pathname) {
+    struct recording_T recording = { .pathname = pathname, };
+    int fd = open(pathname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+        errno_exit(pathname);
+    if (st.st_size < FILE_HEADER_SIZE || (uint64_t) st.st_size > SIZE_MAX)
+        recording_error(&recording, "not a recording");
+    recording.size = (size_t) st.st_size;
+    void *map = mmap(NULL, recording.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        errno_exit(pathname);
+    close(fd);
+    recording.map = map;
+    if (memcmp(recording.map, RECORDING_MAGIC, 8) != 0)
+        recording_error(&recording, "not a recording");
+    load_index(&recording);
+
+    uint64_t start = current_time(), seek = options.replay_seek;
+    for (size_t i = find_block(&recording, seek);
+            i < recording.block_count; i++) {
+        size_t length;
+        const unsigned char *records = block_records(&recording,
+                get_le(&recording.index[i * INDEX_ENTRY_SIZE], 8), &length);
+        for (size_t p = 0; p < length; ) {
+            if (length - p < RECORD_HEADER_SIZE)
+                recording_error(&recording, "corrupt block");
+            uint64_t time = get_le(&records[p], 8);
+            int type = records[p + 8];
+            size_t size = (size_t) get_le(&records[p + 9], 4);
+            p += RECORD_HEADER_SIZE;
+            if (size > length - p)
+                recording_error(&recording, "corrupt block");
+            if (type == RECORD_OUTPUT && time >= seek) {
+                wait_for(start, time - seek);
+                if (!write_all(STDOUT_FILENO, (const char *) &records[p],
+                            size))
+                    errno_exit("cannot write to stdout");
+            }
+            p += size;
+        }
+    }
+
+    munmap(map, recording.size);
+    free(recording.rebuilt_index);
+    free(recording.raw);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc <= 0)
+        exit(EXIT_FAILURE);
+    program_name = argv[0];
+
+    /* Don't use getopt, because we don't want glibc's reordering extension.
+     * Options are long options only, so that they don't clash with the
+     * command operand. */
+    optind = parse_options(argc, argv);
+    /* With --host and --stream, the terminal is elsewhere. */
+    bool remote = options.host_path != NULL || options.stream_address != NULL;
+    if (options.headless || remote)
+        terminal_fd = -1;
+
+    if (options.attach_path != NULL) {
+        if (options.host_path != NULL)
+            error_exit("--attach cannot be used with --host");
+        if (optind != argc)
+            error_exit("no operand is allowed with --attach");
+        return attach_host();
+    }
+
+    if (options.replay) {
+        if (optind != argc - 1)
+            error_exit("--replay requires a single operand");
+        return replay(argv[optind]);
+    }
+    if (options.replay_seek > 0 || options.replay_speed != 1)
+        error_exit("--seek and --speed require --replay");
+    if (options.record_compress && options.record_path == NULL)
+        error_exit("--record-compress requires --record");
+
+    if (options.multiplex) {
+        if (options.tee_path != NULL)
+            error_exit("--tee cannot be used with --multiplex");
+        if (options.io_uring)
+            error_exit("--io-uring cannot be used with --multiplex");
+        if (options.record_path != NULL)
+            error_exit("--record cannot be used with --multiplex");
+        if (options.cast_path != NULL)
+            error_exit("--asciicast cannot be used with --multiplex");
+        if (options.screen_path != NULL)
+            error_exit("--screen cannot be used with --multiplex");
+        if (options.trigger_count > 0)
+            error_exit("--trigger cannot be used with --multiplex");
+        if (options.host_path != NULL)
+            error_exit("--host cannot be used with --multiplex");
+        if (options.stream_address != NULL)
+            error_exit("--stream cannot be used with --multiplex");
+        if (options.control_path != NULL && options.threads > 0)
+            error_exit("--control cannot be used with --threads");
+        if (optind != argc)
+            error_exit("no operand is allowed in the multiplexed mode");
+        stats.start_time = current_time();
+        install_signal_handlers();
+        if (options.control_path != NULL)
+            open_control_socket();
+        int exit_status = serve_sessions();
+        report_stats(&stats);
+        return exit_status;
+    }
+
+    if (options.threads > 0 && !options.multiplex)
+        error_exit("--threads requires --multiplex");
+    if (options.pool_high > 0 && !options.multiplex)
+        error_exit("--pty-pool requires --multiplex");
+    if (options.io_uring && options.timestamps != TIMESTAMPS_NONE)
+        error_exit("--io-uring cannot be used with --timestamps");
+    if (options.io_uring && options.overflow != OVERFLOW_BLOCK)
+        error_exit("--io-uring cannot be used with --overflow");
+    if (options.io_uring && (options.max_rate > 0 ||
+                options.max_input_rate > 0))
+        error_exit("--io-uring cannot be used with --max-rate");
+    if (options.io_uring && options.drain_timeout >= 0)
+        error_exit("--io-uring cannot be used with --drain-timeout");
+    if (options.low_latency && options.coalesce_window > 0)
+        error_exit("--low-latency cannot be used with --coalesce");
+    if (options.host_path != NULL && options.stream_address != NULL)
+        error_exit("--host cannot be used with --stream");
+    if (remote && options.io_uring)
+        error_exit("--host and --stream cannot be used with --io-uring");
+    if (remote && options.overflow != OVERFLOW_BLOCK)
+        error_exit("--host and --stream cannot be used with --overflow");
+    if (remote && options.timestamps != TIMESTAMPS_NONE)
+        error_exit("--host and --stream cannot be used with --timestamps");
+    if (remote && options.headless)
+        error_exit("--host and --stream cannot be used with --headless");
+    if (remote && options.control_path != NULL)
+        error_exit("--host and --stream cannot be used with --control");
+    if (options.io_uring && options.control_path != NULL)
+        error_exit("--io-uring cannot be used with --control");
+    if ((options.stream_id != NULL || options.stream_zerocopy) &&
+            options.stream_address == NULL)
+        error_exit("--stream-id and --stream-zerocopy require --stream");
+    if (options.screen_diff && options.screen_path == NULL)
+        error_exit("--screen-diff requires --screen");
+    if ((options.tee_rotate > 0 || options.tee_direct) &&
+            options.tee_path == NULL)
+        error_exit("--tee-rotate and --tee-direct require --tee");
+    if (optind == argc)
+        error_exit("operand missing");
+
+    stats.start_time = current_time();
+    install_signal_handlers();
+    if (options.trigger_count > 0)
+        compile_triggers();
+    if (options.tee_path != NULL)
+        open_tee();
+    if (options.record_path != NULL)
+        open_recording();
+    if (options.control_path != NULL)
+        open_control_socket();
+    int listen_fd = options.host_path != NULL ?
+        open_listener(options.host_path, remove_host_socket) : -1;
+    if (options.stream_address != NULL)
+        resolve_stream_address();
+
+    int master_fd = prepare_master_pseudo_terminal();
+    const char *slave_name = slave_pseudo_terminal_name(master_fd);
+    int slave_fd = open_noctty(slave_name);
+
+    /* On Darwin, the slave must have been opened before setting the size. */
+    set_terminal_size(master_fd);
+    if (options.cast_path != NULL)
+        open_cast(master_fd);
+    if (options.screen_path != NULL)
+        open_screen(master_fd);
+
+    if (!options.headless && !remote)
+        disable_canonical_io();
+    /* The local forwarder drains non-blocking stdio at each wakeup. */
+    if (!remote && !options.io_uring)
+        make_stdio_nonblocking(STDIN_FILENO);
+    if ((!remote && !options.io_uring) ||
+            options.overflow != OVERFLOW_BLOCK || options.low_latency)
+        make_stdio_nonblocking(STDOUT_FILENO);
+
+    pid_t child_pid =
+        start_child(master_fd, slave_name, slave_fd, &argv[optind]);
+    close(slave_fd);
+    raise_priority();
+    if (options.host_path != NULL)
+        serve_host(master_fd, listen_fd, child_pid);
+    else if (options.stream_address != NULL)
+        serve_stream(master_fd, child_pid);
+    else
+        forward_all_io(master_fd, child_pid);
+    if (options.tee_path != NULL)
+        close_tee();
+    if (options.record_path != NULL)
+        close_recording();
+    if (options.cast_path != NULL)
+        close_cast();
+    if (options.screen_path != NULL)
+        close_screen();
+    /* The command is still running after a trigger ended the output, so
+     * hang up on it as closing its terminal would. */
+    if (trigger_exit_status >= 0)
+        kill(-child_pid, SIGHUP);
+    int exit_status = await_child(child_pid);
+    if (trigger_exit_status >= 0)
+        exit_status = trigger_exit_status;
+    if (options.host_path != NULL)
+        close_host(exit_status);
+    if (options.stream_address != NULL)
+        close_stream(exit_status);
+    report_stats(&stats);
+    return exit_status;
 }
 
 /* vim: set et sw=4 sts=4 tw=79: */